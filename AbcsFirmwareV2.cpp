@@ -5,6 +5,17 @@
 
 #define DEBUG false
 
+/* Derive every rod's phase from one integer accumulator per voice */
+#define PHASE_LOCKED_RODS true
+
+/* Rod LFOs follow the tracked rod angle instead of free-running */
+#define LFO_FOLLOWS_ROD_ANGLE true
+/* Breakbeam edges per LFO cycle, 3 = one cycle per revolution */
+#define ROD_LFO_PULSES_PER_CYCLE 3
+
+/* MPE lower zone: channel 1 is global, channels 2-16 carry one note each */
+#define MPE_MODE false
+
 #define MAX_POLYPHONY 5
 
 #define NUM_WAVEFORMS 4
@@ -15,11 +26,37 @@
 #define MIN_RANGE 10.f
 #define MAX_RANGE 120.f
 
+/* CC value = preset slot to save into, program change recalls */
+#define PRESET_SAVE_CC 118
+/* 64 and up streams raw sensor events over USB, below stops. DEBUG off only */
+#define CAPTURE_CC 117
+/* Output fade either side of a preset recall */
+#define PRESET_FADE_MS 5.f
+
 #include "./utils.h"
+#include "./SpscRing.h"
+#include "./SensorCapture.h"
+#include "./PotBank.h"
+#include "./EdgeCapture.h"
+#include "./ModMatrix.h"
 #include "./RodOscillators.h"
+#include "./HarmonicPhase.h"
 #include "./RodSensors.h"
+#include "./RotationTracker.h"
 #include "./VoiceManager.h"
+#include "./MonoNotes.h"
 #include "./DistanceSensorManager.h"
+#include "./Sysex.h"
+#include "./MidiUart.h"
+#include "./MidiQueue.h"
+#include "./RodSequencer.h"
+#include "./MidiClock.h"
+#include "./MidiInput.h"
+#include "./MidiOutput.h"
+#include "./MpeExpression.h"
+#include "./CcRouting.h"
+#include "./InstrumentState.h"
+#include "./PresetStore.h"
 
 using namespace daisy;
 using namespace daisy::seed;
@@ -39,6 +76,17 @@ using namespace daisysp;
 #define PIN_POT_SUSTAIN 22
 #define PIN_POT_RELEASE 23
 
+/* ADC channel per pot, in the order they are configured */
+enum Pot
+{
+    POT_GAIN,
+    POT_ATTACK,
+    POT_DECAY,
+    POT_SUSTAIN,
+    POT_RELEASE,
+    NUM_POTS,
+};
+
 /* Distance Sensors */
 #define TCA_IDX_1 0
 #define TCA_IDX_2 1
@@ -79,8 +127,17 @@ uint8_t waveforms[NUM_WAVEFORMS] = {
 };
 
 DaisySeed hw;
-MidiUartHandler midi;
-MidiUartHandler::Config midi_config;
+MidiUart midi;
+
+/* MIDI events waiting to be played by the audio callback */
+MidiQueue midiQueue;
+
+/* Drains the UART handler and coalesces CCs */
+MidiInput midiInput;
+MidiClock midiClock;
+
+/* Rod gestures and clock to other gear */
+static MidiOutput<NUM_RODS> midiOutput;
 
 /* Test filter */
 Svf filt;
@@ -95,69 +152,813 @@ float amps[MAX_POLYPHONY];
 /* DSP for each rod */
 static RodOscillators<MAX_POLYPHONY> rodOscillators[NUM_RODS];
 
+/* Shared voice phases for phase-locked rods */
+static HarmonicPhase<MAX_POLYPHONY> harmonicPhase;
+
+/* Per-note pitch bend, pressure and timbre */
+static MpeExpression<MAX_POLYPHONY> mpe;
+
+/* CC -> parameter table and MIDI learn */
+CcRouting ccRouting;
+
+/* Extra modulation routings on top of the fixed ones */
+static ModMatrix<NUM_RODS> modMatrix;
+
 /* Sensor parsing for each rod */
 static RodSensors rodSensors[NUM_RODS];
 
+/* Note stacks and glide for channels with a polyphony of one */
+static MonoNotes<MAX_POLYPHONY> monoNotes;
+
+/* mtof for every note, so pitch changes never call powf */
+float noteFreqs[128];
+
+/* Arpeggiator / step sequencer clocked by each rod's breakbeam */
+static RodSequencer sequencers[NUM_RODS];
+/* Bit n set = rod n only plays its sequencer */
+uint8_t sequencedRods = 0;
+
 /* Managing the I2C multiplexer for the distance sensors */
 DistanceSensorManager distanceSensorManager;
 
+/*
+  SysEx state transfer. One buffer is shared by both directions: the
+  decoder unpacks incoming dumps into it, and outgoing dumps are captured
+  into it and streamed out from it.
+*/
+enum SysexPhase
+{
+    SYSEX_IDLE,
+    SYSEX_LOAD_PENDING,    // dump received, audio callback applies it
+    SYSEX_CAPTURE_PENDING, // dump requested, audio callback captures state
+    SYSEX_SENDING,         // main loop streams the captured state
+};
+static InstrumentState sysexState;
+SysexDecoder sysexDecoder;
+SysexEncoder sysexEncoder;
+volatile SysexPhase sysexPhase = SYSEX_IDLE;
+
+/*
+  Presets in QSPI flash. Saves capture the state in the audio callback and
+  write it out in the background; recalls are read into RAM by the main
+  loop, then the audio callback fades out, applies and fades back in.
+*/
+enum PresetPhase
+{
+    PRESET_IDLE,
+    PRESET_SAVE_PENDING,   // captured, main loop starts the save
+    PRESET_SAVING,         // main loop writes a page per pass
+    PRESET_RECALL_PENDING, // main loop reads the preset into RAM
+    PRESET_FADE_OUT,       // audio fades out, then applies
+    PRESET_FADE_IN,
+};
+static InstrumentState presetState;
+PresetStore presetStore;
+volatile PresetPhase presetPhase = PRESET_IDLE;
+volatile uint8_t presetSlot = 0;
+float presetFade = 1.f;
+float presetFadeStep = 0.f;
+
 /* Gain */
-AnalogControl gainPot;
 float gain = 1.f;
 
-float attackPotVal, decayPotVal, sustainPotVal, releasePotVal = 1.f;
+PotBank<NUM_POTS> pots;
+/* Envelope pot values waiting for the audio callback, a bit per pot */
+volatile float potEnvelope[NUM_POTS];
+volatile uint32_t potEnvelopeChanged = 0;
 
-int adsrMode = 1;
+/* Raw input recording for replay */
+SensorCapture sensorCapture;
 
 size_t currentPolyphony = MAX_POLYPHONY;
 
+/* Global pitch bend range in semitones */
+float pitchBendRange = 1.f;
+
+/* MIDI pitch bend and matrix pitch, combined in UpdatePitch() */
+float pitchBendRatio = 1.f;
+float modPitchRatio = 1.f;
+
+/* Global modulation sources */
+float lastVelocity = 0.f;
+float modCcValue = 0.f;
+
+/* Equal power pan per rod, unity at centre */
+float panLeft[NUM_RODS];
+float panRight[NUM_RODS];
+
+/* Last rod control values, to report touches to MIDI learn */
+int prevHarmonics[NUM_RODS];
+int prevWaveforms[NUM_RODS];
+
+/* Index into lfoSyncBeats per rod, LFO_SYNC_FREE follows rotation only */
+uint8_t rodLfoSync[NUM_RODS] = {LFO_SYNC_FREE};
+/* Rod angle from breakbeam edges, for LFO_FOLLOWS_ROD_ANGLE */
+RotationTracker rotationTrackers[NUM_RODS];
+/* Distance sensor timing profile, applied over I2C by the main loop */
+volatile uint8_t sensorProfile = VL6180X_DEFAULT_PROFILE;
+
+/* Amplitudes with each voice's rod mask applied */
+float rodAmps[NUM_RODS][MAX_POLYPHONY];
+
 /* ============================================================================ */
-void SetPolyphony(size_t newPolyphony)
+
+/* Per MIDI channel envelope and polyphony, formerly switched on note-on */
+void InitVoicePools()
+{
+    for (size_t c = 0; c < NUM_MIDI_CHANNELS; c++)
+    {
+        voiceHandler.SetPoolADSR(c, 0.06f, 0.1f, 0.6f, 0.2f);
+    }
+
+    /* zero indexed: 1 = MIDI channel 2 */
+    voiceHandler.SetPoolADSR(1, 3.f, 2.f, 0.3f, 3.f);
+    voiceHandler.SetPoolADSR(2, 0.005f, 9.f, 0.1f, 2.f);
+    voiceHandler.SetPoolADSR(3, 0.001f, 0.1f, 0.4f, 0.4f);
+    voiceHandler.SetPoolPolyphony(3, 1);
+    voiceHandler.SetPoolLegato(3, true);
+    voiceHandler.SetPoolADSR(4, 0.003f, 0.3f, 0.1f, 0.5f);
+
+    /* Each rod's sequencer plays one voice at a time, on that rod only */
+    for (size_t r = 0; r < NUM_RODS; r++)
+    {
+        voiceHandler.SetPoolADSR(SEQ_CHANNEL_FIRST + r, 0.002f, 0.15f, 0.5f, 0.1f);
+        voiceHandler.SetPoolPolyphony(SEQ_CHANNEL_FIRST + r, 1);
+        voiceHandler.SetPoolRodMask(SEQ_CHANNEL_FIRST + r, 1 << r);
+    }
+
+    /* Member channels all play the manager channel's part */
+    if (MPE_MODE)
+    {
+        for (size_t c = 1; c < NUM_MIDI_CHANNELS; c++)
+        {
+            voiceHandler.SetChannelPool(c, 0);
+        }
+    }
+
+    /* The pots play channels 1 and 6-16, the others keep their envelopes */
+    uint32_t panel = (1u << NUM_MIDI_CHANNELS) - 1;
+    for (size_t c = 1; c <= 4; c++)
+    {
+        panel &= ~(1u << c);
+    }
+    voiceHandler.SetPanelPools(panel);
+}
+
+/*
+  Update one voice's pitch. Phase-locked rods all read the shared phase,
+  so only the per-rod Oscillator path needs every rod updated.
+*/
+void SetVoiceNote(int voice, int note)
+{
+    float freq = noteFreqs[note & 0x7F];
+    harmonicPhase.SetFundamentalFreq(freq, voice);
+    if (PHASE_LOCKED_RODS)
+        return;
+    for (size_t j = 0; j < NUM_RODS; j++)
+    {
+        rodOscillators[j].SetFundamentalFreq(freq, voice);
+    }
+}
+
+/* Per-note bend for the Oscillator render path */
+void SetRodVoiceBend(size_t voice, float ratio)
+{
+    if (PHASE_LOCKED_RODS)
+        return;
+    for (size_t j = 0; j < NUM_RODS; j++)
+    {
+        rodOscillators[j].SetVoiceBend(voice, ratio);
+    }
+}
+
+/*
+  Allocate, tune and trigger a voice for a note on (voice) channel.
+  Returns the voice, or -1.
+*/
+int StartNote(int channel, int note, uint8_t velocity)
+{
+    int voiceIdx = voiceHandler.AllocateVoice(channel, note);
+    if (voiceIdx < 0)
+        return -1;
+    Voice *freeVoice = &voices[voiceIdx];
+
+    /* A stolen voice may still be gliding to someone else's note */
+    if (monoNotes.IsGliding(voiceIdx))
+    {
+        monoNotes.CancelGlide(voiceIdx);
+        harmonicPhase.RampVoiceBend(voiceIdx, 1.0f, 0);
+        SetRodVoiceBend(voiceIdx, 1.0f);
+    }
+
+    /* Set note but don't trigger */
+    freeVoice->OnNoteOn(note, velocity);
+
+    /* Only the allocated voice changes pitch */
+    SetVoiceNote(voiceIdx, note);
+    if (MPE_MODE)
+    {
+        mpe.OnNoteOn(voiceIdx, channel);
+    }
+
+    /* Trigger ADSR */
+    freeVoice->TriggerNote();
+    return voiceIdx;
+}
+
+/* Mono channel moves from fromNote to voice's current note */
+void GlideVoice(int voice, int fromNote, int toNote, float seconds)
+{
+    float ratio = monoNotes.GetGlideRatio(voice) * noteFreqs[fromNote & 0x7F] / noteFreqs[toNote & 0x7F];
+    monoNotes.StartGlide(voice, ratio, seconds);
+    harmonicPhase.RampVoiceBend(voice, monoNotes.GetGlideRatio(voice), 0);
+    SetRodVoiceBend(voice, monoNotes.GetGlideRatio(voice));
+}
+
+/* Play the note the mono channel's priority picks, if it changed */
+void MonoPlay(int channel, uint8_t velocity, bool fromHeld)
+{
+    const VoicePool &pool = voiceHandler.GetChannelPool(channel);
+    int target = monoNotes.Stack(channel).Get(pool.notePriority);
+    int sounding = monoNotes.GetSounding(channel);
+    if (target == sounding)
+        return;
+
+    if (target < 0)
+    {
+        voiceHandler.OnNoteOff(channel, sounding, 0);
+        monoNotes.SetSounding(channel, -1);
+        return;
+    }
+
+    /* Legato: keep the envelope running and only move the pitch */
+    int voice = -1;
+    if (fromHeld && pool.legato && sounding >= 0)
+    {
+        voice = voiceHandler.RetuneVoice(channel, sounding, target);
+        if (voice >= 0)
+            SetVoiceNote(voice, target);
+    }
+    if (voice < 0)
+    {
+        voice = StartNote(channel, target, velocity);
+    }
+
+    if (voice >= 0 && sounding >= 0 && pool.glide > 0.0f)
+    {
+        GlideVoice(voice, sounding, target, pool.glide);
+    }
+    monoNotes.SetSounding(channel, voice >= 0 ? target : -1);
+}
+
+void MonoNoteOn(int channel, int note, uint8_t velocity)
+{
+    NoteStack &stack = monoNotes.Stack(channel);
+    bool fromHeld = !stack.IsEmpty();
+    stack.Push(note);
+    MonoPlay(channel, velocity, fromHeld);
+}
+
+void MonoNoteOff(int channel, int note)
+{
+    monoNotes.Stack(channel).Remove(note);
+    MonoPlay(channel, uint8_t(lastVelocity * 127.f), true);
+}
+
+/* Release whatever rod's sequencer has sounding */
+void StopSequencer(int rod)
+{
+    int playing = sequencers[rod].GetPlaying();
+    if (playing >= 0)
+    {
+        voiceHandler.OnNoteOff(SEQ_CHANNEL_FIRST + rod, playing, 0);
+    }
+    sequencers[rod].Stop();
+}
+
+/* One pulse of rod's breakbeam, at its frame in the block */
+void StepSequencer(int rod)
+{
+    int playing = sequencers[rod].GetPlaying();
+    if (playing >= 0)
+    {
+        voiceHandler.OnNoteOff(SEQ_CHANNEL_FIRST + rod, playing, 0);
+    }
+
+    int note = sequencers[rod].Advance();
+    if (note >= 0)
+    {
+        StartNote(SEQ_CHANNEL_FIRST + rod, note, uint8_t(lastVelocity * 127.f));
+    }
+}
+
+void SetSequencerMode(int rod, int mode)
+{
+    StopSequencer(rod);
+    sequencers[rod].SetMode(mode);
+    if (sequencers[rod].IsActive())
+        sequencedRods |= 1 << rod;
+    else
+        sequencedRods &= ~(1 << rod);
+}
+
+/* Modulation slot being edited over CC, and a copy of its fields */
+size_t modEditSlot = 0;
+ModSlot modEdit = {MOD_SRC_ROTATION, MOD_ALL_RODS, MOD_DST_CUTOFF, MOD_ALL_RODS, 0.f};
+
+void SelectModSlot(size_t idx)
 {
-    if (currentPolyphony == newPolyphony)
+    modEditSlot = idx;
+    if (idx < modMatrix.NumSlots())
+    {
+        modEdit = modMatrix.GetSlots()[idx];
+        return;
+    }
+    /* Past the end: the next field edit appends a fresh slot */
+    modEdit.source = MOD_SRC_ROTATION;
+    modEdit.sourceRod = MOD_ALL_RODS;
+    modEdit.dest = MOD_DST_CUTOFF;
+    modEdit.destRod = MOD_ALL_RODS;
+    modEdit.amount = 0.f;
+}
+
+void WriteModSlot()
+{
+    int idx = modMatrix.SetSlot(modEditSlot, modEdit);
+    if (idx >= 0)
+        modEditSlot = idx;
+}
+
+/* 0 = MOD_ALL_RODS, then one step per rod */
+uint8_t ModRod(float normal)
+{
+    int rod = int(normal * NUM_RODS + 0.5f);
+    return rod == 0 ? MOD_ALL_RODS : rod - 1;
+}
+
+/* Apply a routed CC. normal is 0-1 after the route's curve and range */
+void ApplyParam(uint8_t param, int channel, float normal)
+{
+    /* Pool settings go where the channel's notes play, e.g. an MPE zone's manager pool */
+    int pool = voiceHandler.GetChannelPoolIndex(channel);
+    switch (param)
+    {
+    case PARAM_NONE:
+        return;
+    case PARAM_ATTACK:
+        voiceHandler.SetAttack(pool, normal * 5.f + 0.002f);
+        return;
+    case PARAM_DECAY:
+        voiceHandler.SetDecay(pool, normal * 5.f + 0.05f);
+        return;
+    case PARAM_SUSTAIN:
+        voiceHandler.SetSustain(pool, normal);
+        return;
+    case PARAM_RELEASE:
+        voiceHandler.SetRelease(pool, normal * 5.f + 0.002f);
+        return;
+    case PARAM_BEND_RANGE:
+        pitchBendRange = roundf(normal * 12.f);
+        return;
+    case PARAM_MOD_CC:
+        modCcValue = normal;
+        return;
+    case PARAM_GLIDE:
+        /* Squared so short glides get most of the travel */
+        voiceHandler.SetPoolGlide(pool, normal * normal * 2.f);
         return;
+    case PARAM_LEGATO:
+        voiceHandler.SetPoolLegato(pool, normal >= 0.5f);
+        return;
+    case PARAM_NOTE_PRIORITY:
+        voiceHandler.SetPoolNotePriority(pool, uint8_t(normal * (PRIORITY_COUNT - 1) + 0.5f));
+        return;
+    case PARAM_SENSOR_PROFILE:
+        sensorProfile = uint8_t(normal * (VL6180X_PROFILE_COUNT - 1) + 0.5f);
+        return;
+    case PARAM_MOD_SLOT:
+        SelectModSlot(size_t(normal * (MAX_MOD_SLOTS - 1) + 0.5f));
+        return;
+    case PARAM_MOD_SOURCE:
+        modEdit.source = uint8_t(normal * (MOD_SRC_COUNT - 1) + 0.5f);
+        WriteModSlot();
+        return;
+    case PARAM_MOD_SOURCE_ROD:
+        modEdit.sourceRod = ModRod(normal);
+        WriteModSlot();
+        return;
+    case PARAM_MOD_DEST:
+        modEdit.dest = uint8_t(normal * (MOD_DST_COUNT - 1) + 0.5f);
+        WriteModSlot();
+        return;
+    case PARAM_MOD_DEST_ROD:
+        modEdit.destRod = ModRod(normal);
+        WriteModSlot();
+        return;
+    case PARAM_MOD_AMOUNT:
+    {
+        /* Bipolar around the centre, which is exactly zero */
+        float amount = normal * 2.f - 1.f;
+        if (fabsf(amount) < 1.f / 127.f)
+            amount = 0.f;
+        modEdit.amount = amount * ModAmountRange(modEdit.dest);
+        WriteModSlot();
+        return;
+    }
+    default:
+        break;
+    }
+
+    int rod = (param - PARAM_ROD_FIRST) / ROD_PARAM_COUNT;
+    if (rod >= NUM_RODS)
+        return;
+
+    switch ((param - PARAM_ROD_FIRST) % ROD_PARAM_COUNT)
+    {
+    case ROD_PARAM_HARMONIC:
+        rodSensors[rod].SetEncoderVal(int(normal * 9.f + 0.5f));
+        prevHarmonics[rod] = rodSensors[rod].GetEncoderVal();
+        break;
+    case ROD_PARAM_WAVEFORM:
+        rodSensors[rod].SetWaveformIndex(int(normal * (NUM_WAVEFORMS - 1) + 0.5f));
+        prevWaveforms[rod] = rodSensors[rod].GetWaveformIndex();
+        break;
+    case ROD_PARAM_LFO_TARGET:
+        rodOscillators[rod].SetLfoTarget(int(normal * (NUM_LFO_TARGETS - 1) + 0.5f));
+        break;
+    case ROD_PARAM_LFO_SYNC:
+        rodLfoSync[rod] = uint8_t(normal * (NUM_LFO_SYNC_DIVISIONS - 1) + 0.5f);
+        break;
+    case ROD_PARAM_SEQ_MODE:
+        SetSequencerMode(rod, int(normal * (SEQ_MODE_COUNT - 1) + 0.5f));
+        break;
+    }
+}
+
+/* Audio callback, at a block boundary */
+void CaptureState(InstrumentState &state)
+{
+    state.version = INSTRUMENT_STATE_VERSION;
+    state.pitchBendRange = pitchBendRange;
+    for (size_t c = 0; c < NUM_MIDI_CHANNELS; c++)
+    {
+        state.pools[c] = voiceHandler.GetPool(c);
+    }
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        state.rods[i].harmonic = rodSensors[i].GetEncoderVal();
+        state.rods[i].waveform = rodSensors[i].GetWaveformIndex();
+        state.rods[i].lfoTarget = rodOscillators[i].GetLfoTarget();
+        state.rods[i].lfoSync = rodLfoSync[i];
+        state.rods[i].seqMode = sequencers[i].GetMode();
+    }
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+    {
+        state.calibration[i].minRange = distanceSensorManager.GetMinRange(i);
+        state.calibration[i].maxRange = distanceSensorManager.GetMaxRange(i);
+    }
+    state.sensorProfile = sensorProfile;
+    state.numModSlots = modMatrix.NumSlots();
+    memcpy(state.modSlots, modMatrix.GetSlots(), sizeof(state.modSlots));
+    memcpy(&state.routing, &ccRouting.GetTable(), sizeof(state.routing));
+}
+
+/* A NaN or inf anywhere would stick in the envelopes or the filters */
+bool StateIsFinite(const InstrumentState &state)
+{
+    if (!isfinite(state.pitchBendRange))
+        return false;
+    for (size_t c = 0; c < NUM_MIDI_CHANNELS; c++)
+    {
+        const VoicePool &pool = state.pools[c];
+        if (!isfinite(pool.attack) || !isfinite(pool.decay) || !isfinite(pool.sustain) ||
+            !isfinite(pool.release) || !isfinite(pool.glide))
+            return false;
+    }
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+    {
+        if (!isfinite(state.calibration[i].minRange) || !isfinite(state.calibration[i].maxRange))
+            return false;
+    }
+    return true;
+}
+
+/* Audio callback, at a block boundary so no block sees half a state */
+void ApplyState(const InstrumentState &state)
+{
+    if (state.version != INSTRUMENT_STATE_VERSION || !StateIsFinite(state))
+        return;
+
+    if (state.pitchBendRange >= 0.f && state.pitchBendRange <= 12.f)
+        pitchBendRange = state.pitchBendRange;
+    for (size_t c = 0; c < NUM_MIDI_CHANNELS; c++)
+    {
+        VoicePool pool = state.pools[c];
+        pool.attack = fmaxf(pool.attack, 0.f);
+        pool.decay = fmaxf(pool.decay, 0.f);
+        pool.sustain = constrain(pool.sustain, 0, 1);
+        pool.release = fmaxf(pool.release, 0.f);
+        pool.glide = fmaxf(pool.glide, 0.f);
+        voiceHandler.LoadPool(c, pool);
+    }
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        const RodState &rod = state.rods[i];
+        rodSensors[i].SetEncoderVal(rod.harmonic);
+        rodSensors[i].SetWaveformIndex(rod.waveform);
+        rodOscillators[i].SetLfoTarget(rod.lfoTarget % NUM_LFO_TARGETS);
+        rodLfoSync[i] = rod.lfoSync < NUM_LFO_SYNC_DIVISIONS ? rod.lfoSync : LFO_SYNC_FREE;
+        SetSequencerMode(i, rod.seqMode);
+        /* Not a front panel touch */
+        prevHarmonics[i] = rodSensors[i].GetEncoderVal();
+        prevWaveforms[i] = rodSensors[i].GetWaveformIndex();
+    }
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+    {
+        distanceSensorManager.SetCalibration(i, state.calibration[i].minRange, state.calibration[i].maxRange);
+    }
+    if (state.sensorProfile < VL6180X_PROFILE_COUNT)
+        sensorProfile = state.sensorProfile;
+    /* Dumps and flash are external input, bad slots are dropped there */
+    modMatrix.LoadSlots(state.modSlots, state.numModSlots);
+    ccRouting.LoadTable(state.routing);
+}
+
+/* Main loop. Starts and streams SysEx dumps */
+void ProcessSysex()
+{
+    /* A dump is applied first, a request waits in the decoder until idle */
+    if (sysexDecoder.TakeResult(SYSEX_RESULT_DUMP))
+    {
+        sysexDecoder.SetAccepting(false);
+        sysexPhase = SYSEX_LOAD_PENDING;
+    }
+    if (sysexPhase == SYSEX_IDLE && sysexDecoder.TakeResult(SYSEX_RESULT_REQUEST))
+    {
+        sysexDecoder.SetAccepting(false);
+        sysexPhase = SYSEX_CAPTURE_PENDING;
+    }
+
+    if (sysexPhase != SYSEX_SENDING)
+        return;
+
+    /* A chunk per pass, as much as the TX ring has room for */
+    uint8_t chunk[MIDI_TX_DMA_SIZE];
+    size_t space = midi.GetTxFree();
+    size_t n = sysexEncoder.Read(chunk, space < sizeof(chunk) ? space : sizeof(chunk));
+    if (n > 0)
+    {
+        midi.Send(chunk, n);
+    }
+    if (sysexEncoder.IsDone())
+    {
+        sysexPhase = SYSEX_IDLE;
+        sysexDecoder.SetAccepting(true);
+    }
+}
+
+/* Main loop. Moves saves and recalls along, one flash operation per pass */
+void ProcessPresets()
+{
+    switch (presetPhase)
+    {
+    case PRESET_SAVE_PENDING:
+        presetPhase = presetStore.BeginSave(presetSlot) ? PRESET_SAVING : PRESET_IDLE;
+        break;
+    case PRESET_SAVING:
+        presetStore.Process();
+        if (!presetStore.IsBusy())
+        {
+            presetPhase = PRESET_IDLE;
+        }
+        break;
+    case PRESET_RECALL_PENDING:
+        presetPhase = presetStore.Load(presetSlot) ? PRESET_FADE_OUT : PRESET_IDLE;
+        break;
+    default:
+        break;
+    }
+}
 
-    currentPolyphony = newPolyphony;
-    voiceHandler.SetCurrentPolyphony(newPolyphony);
+void UpdatePitch()
+{
+    float ratio = pitchBendRatio * modPitchRatio;
+    harmonicPhase.SetPitchBend(ratio);
     for (size_t j = 0; j < NUM_RODS; j++)
     {
-        rodOscillators[j].SetCurrentPolyphony(newPolyphony);
+        rodOscillators[j].SetPitchBend(ratio);
     }
 }
 
-void NextSamples(float &sig)
+/* Control rate, once per block and only while the matrix has slots */
+void UpdateModulation(const float *rotationSpeeds, const float *ranges)
 {
-    float result = 0.0;
+    float envelope = 0.f;
+    for (size_t i = 0; i < currentPolyphony; i++)
+    {
+        if (amps[i] > envelope)
+            envelope = amps[i];
+    }
+    modMatrix.SetGlobalSource(MOD_SRC_ENVELOPE, envelope);
+    modMatrix.SetGlobalSource(MOD_SRC_VELOCITY, lastVelocity);
+    modMatrix.SetGlobalSource(MOD_SRC_CC, modCcValue);
+
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        modMatrix.SetSource(i, MOD_SRC_ROTATION, fclamp(rotationSpeeds[i] / 4.f, 0.f, 1.f));
+        modMatrix.SetSource(i, MOD_SRC_RANGE, ranges[i]);
+        modMatrix.SetSource(i, MOD_SRC_ENCODER, rodSensors[i].GetEncoderVal() / 9.f);
+        modMatrix.SetSource(i, MOD_SRC_LFO, rodOscillators[i].GetLfo());
+    }
+
+    modMatrix.Evaluate();
+
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        const float *mod = modMatrix.GetDestinations(i);
+        rodOscillators[i].ApplyModulation(mod);
+
+        float pan = fclamp(mod[MOD_DST_PAN], -1.f, 1.f);
+        panLeft[i] = cosf((pan + 1.f) * PI_F * 0.25f) * 1.41421356f;
+        panRight[i] = sinf((pan + 1.f) * PI_F * 0.25f) * 1.41421356f;
+    }
+
+    float ratio = powf(2.f, modMatrix.GetPitchSemitones() / 12.f);
+    if (ratio != modPitchRatio)
+    {
+        modPitchRatio = ratio;
+        UpdatePitch();
+    }
+}
+
+void NextSamples(float &left, float &right)
+{
+    float resultL = 0.0;
+    float resultR = 0.0;
 
     /* Get amplitude envelopes from voices */
     for (size_t i = 0; i < currentPolyphony; i++)
     {
         Voice *v = &voices[i];
         amps[i] = v->Process();
+        if (MPE_MODE && mpe.HasExpression(i))
+        {
+            amps[i] *= mpe.NextGain(i);
+        }
+
+        /* Each MIDI channel can be limited to some of the rods */
+        uint8_t rodMask = voiceHandler.GetRodMask(i);
+        if (voiceHandler.GetVoiceChannel(i) < SEQ_CHANNEL_FIRST)
+        {
+            rodMask &= ~sequencedRods;
+        }
+        for (size_t j = 0; j < NUM_RODS; j++)
+        {
+            rodAmps[j][i] = (rodMask >> j) & 1 ? amps[i] : 0.f;
+        }
     }
 
-    /* Pass amps to each rod */
-    for (size_t i = 0; i < NUM_RODS; i++)
+    if (PHASE_LOCKED_RODS)
+    {
+        /* Each rod adds its own vibrato on top of the shared phase */
+        harmonicPhase.Process();
+
+        for (size_t i = 0; i < NUM_RODS; i++)
+        {
+            float rodSig = rodOscillators[i].ProcessLocked(rodAmps[i], harmonicPhase);
+            resultL += rodSig * panLeft[i];
+            resultR += rodSig * panRight[i];
+        }
+    }
+    else
     {
-        result += rodOscillators[i].Process(amps);
+        /* Pass amps to each rod */
+        for (size_t i = 0; i < NUM_RODS; i++)
+        {
+            float rodSig = rodOscillators[i].Process(rodAmps[i]);
+            resultL += rodSig * panLeft[i];
+            resultR += rodSig * panRight[i];
+        }
     }
 
-    sig = result / NUM_RODS;
+    left = resultL / NUM_RODS;
+    right = resultR / NUM_RODS;
+}
+
+void HandleMidiMessage(MidiEvent m);
+
+/* Main loop. The voices are only touched from the audio callback */
+void PostPotEnvelope(Pot pot, float value)
+{
+    ScopedIrqBlocker block;
+    potEnvelope[pot] = value;
+    potEnvelopeChanged |= 1u << pot;
+}
+
+/* Audio callback, top of the block. The main loop can't interrupt it */
+void ApplyPotEnvelopes()
+{
+    uint32_t changed = potEnvelopeChanged;
+    if (!changed)
+        return;
+    potEnvelopeChanged = 0;
+
+    if (changed & (1u << POT_ATTACK))
+        voiceHandler.SetAttack(potEnvelope[POT_ATTACK]);
+    if (changed & (1u << POT_DECAY))
+        voiceHandler.SetDecay(potEnvelope[POT_DECAY]);
+    if (changed & (1u << POT_SUSTAIN))
+        voiceHandler.SetSustain(potEnvelope[POT_SUSTAIN]);
+    if (changed & (1u << POT_RELEASE))
+        voiceHandler.SetRelease(potEnvelope[POT_RELEASE]);
 }
 
 void AudioCallback(AudioHandle::InterleavingInputBuffer in,
                    AudioHandle::InterleavingOutputBuffer out,
                    size_t size)
 {
+    ApplyPotEnvelopes();
+
+    /* Whole-state SysEx transfers take effect between blocks */
+    if (sysexPhase == SYSEX_LOAD_PENDING)
+    {
+        ApplyState(sysexState);
+        sysexPhase = SYSEX_IDLE;
+        sysexDecoder.SetAccepting(true);
+    }
+    else if (sysexPhase == SYSEX_CAPTURE_PENDING)
+    {
+        CaptureState(sysexState);
+        sysexEncoder.Begin(&sysexState, sizeof(sysexState));
+        sysexPhase = SYSEX_SENDING;
+    }
+
+    /* Recalled preset is applied in one go once the output is silent */
+    if (presetPhase == PRESET_FADE_OUT && presetFade <= 0.f)
+    {
+        ApplyState(presetState);
+        presetPhase = PRESET_FADE_IN;
+    }
+
+    /* Expression is applied once per block and ramped across it */
+    if (MPE_MODE && mpe.ProcessBlock(size / 2, currentPolyphony, harmonicPhase, SetRodVoiceBend))
+    {
+        for (size_t i = 0; i < NUM_RODS; i++)
+        {
+            rodOscillators[i].SetCutoffMod(mpe.GetCutoffMod());
+            rodOscillators[i].SetLfoDepthMod(mpe.GetLfoDepthMod());
+        }
+    }
+
+    monoNotes.ProcessBlock(size / 2, currentPolyphony, harmonicPhase, SetRodVoiceBend);
+
+    float rotationSpeeds[NUM_RODS];
+    float ranges[NUM_RODS];
+    uint32_t nowUs = System::GetUs();
+    sensorCapture.RecordAudio(CAPTURE_BLOCK, 0, size / 2, nowUs);
+
     for (size_t i = 0; i < NUM_RODS; i++)
     {
         rodSensors[i].Process();
         float rotationSpeed = rodSensors[i].GetRotationSpeed();
+
+        if (sensorCapture.IsActive())
+        {
+            if (rodSensors[i].GetIncrement() != 0)
+                sensorCapture.RecordAudio(CAPTURE_ENCODER, i, uint16_t(rodSensors[i].GetIncrement()), nowUs);
+            if (rodSensors[i].GetButtonEdge())
+                sensorCapture.RecordAudio(CAPTURE_BUTTON, i, rodSensors[i].GetPressed(), nowUs);
+        }
+
+        uint32_t pulseUs;
+        while (rodSensors[i].TakePulse(pulseUs))
+        {
+            sensorCapture.RecordAudio(CAPTURE_BREAKBEAM, i, 0, pulseUs);
+            sequencers[i].OnPulse(pulseUs);
+            rotationTrackers[i].OnEdge(pulseUs);
+        }
+        rotationTrackers[i].Advance(nowUs);
+        /* Nothing left clocking the sequencer */
+        if (rotationSpeed <= 0.f && sequencers[i].GetPlaying() >= 0)
+        {
+            StopSequencer(i);
+        }
         int harmonic = rodSensors[i].GetEncoderVal();
         int waveform = rodSensors[i].GetWaveformIndex();
 
+        /* Report front panel changes to MIDI learn */
+        if (harmonic != prevHarmonics[i])
+        {
+            ccRouting.Touch(RodParamId(i, ROD_PARAM_HARMONIC));
+            prevHarmonics[i] = harmonic;
+        }
+        if (waveform != prevWaveforms[i])
+        {
+            ccRouting.Touch(RodParamId(i, ROD_PARAM_WAVEFORM));
+            prevWaveforms[i] = waveform;
+        }
+
         rodOscillators[i].SetHarmonic(harmonic);
-        rodOscillators[i].SetLfoFreq(rotationSpeed);
         rodOscillators[i].SetOscWaveform(waveforms[waveform]);
 
         /* TODO clean up */
@@ -167,21 +968,89 @@ void AudioCallback(AudioHandle::InterleavingInputBuffer in,
         if (i == 3)
             addrIdx = 2;
 
-        rodOscillators[i].SetRange(distanceSensorManager.GetNormalizedRange(addrIdx));
+        rotationSpeeds[i] = rotationSpeed;
+        /* Extrapolated between sensor samples */
+        ranges[i] = distanceSensorManager.GetPredictedRange(addrIdx, nowUs);
         if (rodSensors[i].GetLongPress())
         {
             rodOscillators[i].IncrementLfoTarget();
+            ccRouting.Touch(RodParamId(i, ROD_PARAM_LFO_TARGET));
         }
     }
 
-    float sig;
-    sig = 0.0f;
+    if (modMatrix.IsActive())
+    {
+        UpdateModulation(rotationSpeeds, ranges);
+    }
+
+    /* Fixed routings: rotation -> LFO, range -> cutoff or gain */
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        rodOscillators[i].SetLfoFreq(rotationSpeeds[i]);
+        rodOscillators[i].SetRange(ranges[i]);
+
+        /* LFO phase is the rod's angle; MIDI clock sync below still wins */
+        if (LFO_FOLLOWS_ROD_ANGLE && rotationTrackers[i].IsRunning())
+        {
+            rodOscillators[i].SyncLfo(rotationTrackers[i].GetPhase(),
+                                      rotationTrackers[i].GetCyclesPerSample());
+        }
+    }
+
+    /* Synced rods take their LFO rate and phase from MIDI clock */
+    if (midiClock.IsRunning())
+    {
+        float beat = midiClock.GetBeatPosition(System::GetUs());
+        for (size_t i = 0; i < NUM_RODS; i++)
+        {
+            if (rodLfoSync[i] == LFO_SYNC_FREE)
+                continue;
+            float beats = lfoSyncBeats[rodLfoSync[i]];
+            float cycles = beat / beats;
+            rodOscillators[i].SyncLfo(cycles - floorf(cycles), midiClock.GetCyclesPerSample(beats));
+        }
+    }
+
+    midiQueue.BeginBlock();
+
+    float sigL = 0.0f;
+    float sigR = 0.0f;
+    MidiEvent m;
     for (size_t i = 0; i < size; i += 2)
     {
-        NextSamples(sig);
+        /* Split the block at each event's offset */
+        while (midiQueue.PopDue(i / 2, size / 2, m))
+        {
+            HandleMidiMessage(m);
+        }
+        for (size_t r = 0; r < NUM_RODS; r++)
+        {
+            while (sequencers[r].PopDue(midiQueue, i / 2, size / 2))
+            {
+                StepSequencer(r);
+            }
+        }
+
+        NextSamples(sigL, sigR);
         // filt.Process(sig);
         // sig = filt.Low()
-        out[i] = out[i + 1] = sig * gain;
+
+        if (presetPhase == PRESET_FADE_OUT)
+        {
+            presetFade = presetFade > presetFadeStep ? presetFade - presetFadeStep : 0.f;
+        }
+        else if (presetPhase == PRESET_FADE_IN)
+        {
+            presetFade += presetFadeStep;
+            if (presetFade >= 1.f)
+            {
+                presetFade = 1.f;
+                presetPhase = PRESET_IDLE;
+            }
+        }
+
+        out[i] = sigL * gain * presetFade;
+        out[i + 1] = sigR * gain * presetFade;
     }
 }
 
@@ -192,125 +1061,126 @@ void HandleMidiMessage(MidiEvent m)
     case PitchBend:
     {
         PitchBendEvent p = m.AsPitchBend();
+        if (MPE_MODE && mpe.IsMemberChannel(p.channel))
+        {
+            mpe.SetPitchBend(p.channel, p.value);
+            break;
+        }
         float divider = p.value > 0 ? 8191.f : 8192.f;
-        float semiTones = 1.f;
+        float semiTones = pitchBendRange;
         float fqPerSemiTone = semiTones / 12.f;
         float percent = p.value / divider;
-        float fqMultiplier = pow(2.f, percent * fqPerSemiTone);
-        for (size_t j = 0; j < NUM_RODS; j++)
-        {
-            rodOscillators[j].SetPitchBend(fqMultiplier);
-        }
+        pitchBendRatio = pow(2.f, percent * fqPerSemiTone);
+        UpdatePitch();
         break;
     }
     case NoteOn:
     {
 
         NoteOnEvent p = m.AsNoteOn();
-        if (DEBUG)
-        {
-            hw.PrintLine("Note ON:\t%d\t%d\t%d\r\n", p.channel, p.note, p.velocity);
-        }
-
-        /* zero indexed */
-        int channel = p.channel + 1;
 
-        /* TODO: move to voice manager, get polyphony from voice manager */
-
-        /* "Hack" to set ADSR based on MIDI channel */
-        if (adsrMode != channel)
+        /* Note on with 0 velocity is a note off */
+        if (p.velocity == 0)
         {
-            adsrMode = channel;
-            switch (adsrMode)
+            if (voiceHandler.IsMono(p.channel))
+                MonoNoteOff(p.channel, p.note);
+            else
+                voiceHandler.OnNoteOff(p.channel, p.note, 0);
+            for (size_t r = 0; r < NUM_RODS; r++)
             {
-            case 2:
-                voiceHandler.setADSR(3.f, 2.f, 0.3f, 3.f);
-                SetPolyphony(MAX_POLYPHONY);
-                break;
-            case 3:
-                voiceHandler.setADSR(0.005f, 9.f, 0.1f, 2.f);
-                SetPolyphony(MAX_POLYPHONY);
-                break;
-            case 4:
-                voiceHandler.setADSR(0.001f, 0.1f, 0.4f, 0.4f);
-                SetPolyphony(1);
-                break;
-            case 5:
-                voiceHandler.setADSR(0.003f, 0.3f, 0.1f, 0.5f);
-                SetPolyphony(MAX_POLYPHONY);
-                break;
-
-            default:
-                voiceHandler.setADSR(0.06f, 0.1f, 0.6f, 0.2f);
-                SetPolyphony(MAX_POLYPHONY);
-                break;
+                sequencers[r].NoteOff(p.note);
             }
-        }
-
-        /* Note on could have 0 velocity? */
-        if (m.data[1] == 0)
             return;
+        }
 
-        /* TODO: better way of doing this? */
-
-        /* Get voice */
-        Voice *freeVoice = voiceHandler.FindFreeVoice(p.note);
-        if (freeVoice == NULL)
-            return;
-
-        /* Set note but don't trigger */
-        freeVoice->OnNoteOn(p.note, p.velocity);
-
-        /* Update oscillators with all notes (do we need to do all?) */
-        /* Would need freeVoice index */
-        for (size_t i = 0; i < currentPolyphony; i++)
+        lastVelocity = p.velocity / 127.f;
+        if (voiceHandler.IsMono(p.channel))
+            MonoNoteOn(p.channel, p.note, p.velocity);
+        else
+            StartNote(p.channel, p.note, p.velocity);
+        for (size_t r = 0; r < NUM_RODS; r++)
         {
-            Voice *v = &voices[i];
-            float note = mtof(v->GetNote());
-            for (size_t j = 0; j < NUM_RODS; j++)
-            {
-                rodOscillators[j].SetFundamentalFreq(note, i);
-            }
+            sequencers[r].NoteOn(p.note);
         }
-
-        /* Trigger ADSR */
-        freeVoice->TriggerNote();
         break;
     }
     case NoteOff:
     {
-        if (DEBUG)
+        NoteOffEvent p = m.AsNoteOff();
+        if (voiceHandler.IsMono(p.channel))
+            MonoNoteOff(p.channel, p.note);
+        else
+            voiceHandler.OnNoteOff(p.channel, p.note, p.velocity);
+        for (size_t r = 0; r < NUM_RODS; r++)
         {
-            hw.PrintLine("Note OFF:\t%d\t%d\t%d\r\n", m.channel, m.data[0], m.data[1]);
+            sequencers[r].NoteOff(p.note);
         }
-        NoteOffEvent p = m.AsNoteOff();
-        voiceHandler.OnNoteOff(p.note, p.velocity);
         break;
     }
     case ControlChange:
     {
-        /* TODO: update with pitch bend */
         ControlChangeEvent p = m.AsControlChange();
-        float normal = ((float)p.value / 127.0f);
 
-        switch (p.control_number)
+        /* MPE timbre */
+        if (MPE_MODE && p.control_number == 74 && mpe.IsMemberChannel(p.channel))
         {
-        case 1:
-            // CC 1 for cutoff.
-            // filt.SetFreq(mtof((float)p.value));
-            voiceHandler.SetAttack(normal * 5.f + 0.002f);
+            mpe.SetTimbre(p.channel, p.value);
             break;
-        case 2:
-            voiceHandler.SetDecay(normal * 5.f + 0.05f);
+        }
+
+        if (p.control_number == MIDI_LEARN_CC)
+        {
+            ccRouting.SetLearning(p.value >= 64);
             break;
-        case 3:
-            voiceHandler.SetSustain(normal);
+        }
+        if (p.control_number == CAPTURE_CC)
+        {
+            sensorCapture.Request(!DEBUG && p.value >= 64);
             break;
-        case 4:
-            voiceHandler.SetRelease(normal * 5.f + 0.002f);
+        }
+        if (p.control_number == PRESET_SAVE_CC)
+        {
+            if (presetPhase == PRESET_IDLE && p.value < NUM_PRESETS)
+            {
+                CaptureState(presetState);
+                presetSlot = p.value;
+                presetPhase = PRESET_SAVE_PENDING;
+            }
             break;
-        default:
+        }
+        if (ccRouting.Learn(p.channel, p.control_number))
             break;
+
+        const CcRoute &route = ccRouting.GetRoute(p.channel, p.control_number);
+        ApplyParam(route.param, p.channel, CcRouting::Scale(route, p.value));
+        break;
+    }
+    case ProgramChange:
+    {
+        ProgramChangeEvent p = m.AsProgramChange();
+        if (presetPhase == PRESET_IDLE && presetStore.HasPreset(p.program))
+        {
+            presetSlot = p.program;
+            presetPhase = PRESET_RECALL_PENDING;
+        }
+        break;
+    }
+    case ChannelPressure:
+    {
+        ChannelPressureEvent p = m.AsChannelPressure();
+        if (MPE_MODE && mpe.IsMemberChannel(p.channel))
+        {
+            mpe.SetPressure(p.channel, p.pressure);
+        }
+        break;
+    }
+    case PolyphonicKeyPressure:
+    {
+        /* One note per member channel, so this is the same as channel pressure */
+        PolyphonicKeyPressureEvent p = m.AsPolyphonicKeyPressure();
+        if (MPE_MODE && mpe.IsMemberChannel(p.channel))
+        {
+            mpe.SetPressure(p.channel, p.pressure);
         }
         break;
     }
@@ -321,10 +1191,12 @@ void HandleMidiMessage(MidiEvent m)
 
 /* =============================================================================== */
 
-int main(void)
+/* Main loop passes since the last debug report */
+int count = 0;
+
+void Setup()
 {
     float sample_rate;
-    int count = 0;
 
     hw.Init();
     hw.SetAudioBlockSize(4);
@@ -334,16 +1206,42 @@ int main(void)
     {
         hw.StartLog(true);
     }
+    else
+    {
+        /* Free for sensor capture */
+        hw.usb_handle.Init(UsbHandle::FS_INTERNAL);
+    }
     System::Delay(200);
 
     sample_rate = hw.AudioSampleRate();
 
+    for (size_t n = 0; n < 128; n++)
+    {
+        noteFreqs[n] = mtof(n);
+    }
+
     /* Polyphony Voices */
     voiceHandler.Init(sample_rate);
+    InitVoicePools();
+    monoNotes.Init(sample_rate, hw.AudioBlockSize());
+    mpe.Init();
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        sequencers[i].Init();
+        rotationTrackers[i].Init(sample_rate, ROD_LFO_PULSES_PER_CYCLE);
+    }
+    ccRouting.Init();
+    modMatrix.Init();
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        panLeft[i] = panRight[i] = 1.f;
+    }
 
     /* Distance sensors */
     distanceSensorManager.Init(&hw);
 
+    harmonicPhase.Init(sample_rate);
+
     /* Init Rod Oscillators */
     for (size_t i = 0; i < NUM_RODS; i++)
     {
@@ -351,91 +1249,189 @@ int main(void)
     }
 
     /* Rod Sensors */
-    rodSensors[0].Init(1, hw.GetPin(PIN_BREAKBEAM_IN_1), hw.GetPin(PIN_ENC_1_A), hw.GetPin(PIN_ENC_1_B), hw.GetPin(PIN_ENC_1_BTN));
-    rodSensors[1].Init(2, hw.GetPin(PIN_BREAKBEAM_IN_2), hw.GetPin(PIN_ENC_2_A), hw.GetPin(PIN_ENC_2_B), hw.GetPin(PIN_ENC_2_BTN));
-    rodSensors[2].Init(3, hw.GetPin(PIN_BREAKBEAM_IN_3), hw.GetPin(PIN_ENC_3_A), hw.GetPin(PIN_ENC_3_B), hw.GetPin(PIN_ENC_3_BTN));
-    rodSensors[3].Init(4, hw.GetPin(PIN_BREAKBEAM_IN_4), hw.GetPin(PIN_ENC_4_A), hw.GetPin(PIN_ENC_4_B), hw.GetPin(PIN_ENC_4_BTN));
+    bool breakBeams = true;
+    breakBeams &= rodSensors[0].Init(1, hw.GetPin(PIN_BREAKBEAM_IN_1), hw.GetPin(PIN_ENC_1_A), hw.GetPin(PIN_ENC_1_B), hw.GetPin(PIN_ENC_1_BTN));
+    breakBeams &= rodSensors[1].Init(2, hw.GetPin(PIN_BREAKBEAM_IN_2), hw.GetPin(PIN_ENC_2_A), hw.GetPin(PIN_ENC_2_B), hw.GetPin(PIN_ENC_2_BTN));
+    breakBeams &= rodSensors[2].Init(3, hw.GetPin(PIN_BREAKBEAM_IN_3), hw.GetPin(PIN_ENC_3_A), hw.GetPin(PIN_ENC_3_B), hw.GetPin(PIN_ENC_3_BTN));
+    breakBeams &= rodSensors[3].Init(4, hw.GetPin(PIN_BREAKBEAM_IN_4), hw.GetPin(PIN_ENC_4_A), hw.GetPin(PIN_ENC_4_B), hw.GetPin(PIN_ENC_4_BTN));
+    for (size_t i = 0; i < NUM_RODS; i++)
+    {
+        prevHarmonics[i] = rodSensors[i].GetEncoderVal();
+        prevWaveforms[i] = rodSensors[i].GetWaveformIndex();
+    }
+    /* Two breakbeams on the same pin number share an EXTI line */
+    if (DEBUG && !breakBeams)
+    {
+        for (size_t i = 0; i < NUM_RODS; i++)
+            if (!rodSensors[i].HasBreakBeam())
+                hw.PrintLine("Rod %d breakbeam EXTI line taken, no rotation", i);
+    }
 
     filt.Init(sample_rate);
 
     /* ADC Setup */
-    const int numAdcChannels = 5;
-    AdcChannelConfig adcConfig[numAdcChannels];
+    AdcChannelConfig adcConfig[NUM_POTS];
 
-    adcConfig[0].InitSingle(hw.GetPin(PIN_POT_GAIN));
+    adcConfig[POT_GAIN].InitSingle(hw.GetPin(PIN_POT_GAIN));
 
-    adcConfig[1].InitSingle(hw.GetPin(PIN_POT_ATTACK));
-    adcConfig[2].InitSingle(hw.GetPin(PIN_POT_DECAY));
-    adcConfig[3].InitSingle(hw.GetPin(PIN_POT_SUSTAIN));
-    adcConfig[4].InitSingle(hw.GetPin(PIN_POT_RELEASE));
+    adcConfig[POT_ATTACK].InitSingle(hw.GetPin(PIN_POT_ATTACK));
+    adcConfig[POT_DECAY].InitSingle(hw.GetPin(PIN_POT_DECAY));
+    adcConfig[POT_SUSTAIN].InitSingle(hw.GetPin(PIN_POT_SUSTAIN));
+    adcConfig[POT_RELEASE].InitSingle(hw.GetPin(PIN_POT_RELEASE));
 
-    hw.adc.Init(adcConfig, numAdcChannels);
+    /* Oversampled and decimated in hardware, DMA keeps the results current */
+    hw.adc.Init(adcConfig, NUM_POTS, AdcHandle::OVS_128);
 
     hw.adc.Start();
+    pots.Init(&hw.adc);
+    pots.SetCapture(&sensorCapture);
 
     /* MIDI */
-    midi.Init(midi_config);
+    midi.Init();
+    midiQueue.Init(sample_rate);
+    midiClock.Init(sample_rate);
+    midiInput.Init(&midi, &midiQueue, &midiClock);
+    midiOutput.Init(&midi);
+    sysexDecoder.Init(&sysexState, sizeof(sysexState));
+    midi.SetSysexDecoder(&sysexDecoder);
+    midi.SetCapture(&sensorCapture);
+
+    /* Sensor capture, idle until CAPTURE_CC */
+    sensorCapture.Init(&hw.usb_handle, sample_rate, hw.AudioBlockSize());
+    distanceSensorManager.SetCapture(&sensorCapture);
+
+    /* Presets */
+    presetStore.Init(&hw.qspi, &presetState, sizeof(presetState), INSTRUMENT_STATE_VERSION);
+    presetFadeStep = 1000.f / (PRESET_FADE_MS * sample_rate);
+    /* Slot 0 is restored at power on */
+    if (presetStore.Load(0))
+    {
+        ApplyState(presetState);
+    }
 
     /* Start */
     hw.StartAudio(AudioCallback);
     midi.StartReceive();
+}
 
-    for (;;)
+/* One pass of the main loop */
+void Loop()
+{
+    /* MIDI */
+    /* Played from the audio callback, never touched here */
+    midiInput.Process();
+    ProcessSysex();
+    ProcessPresets();
+
+    /* Only fills the TX ring, DMA does the sending */
+    float rotations[NUM_RODS];
+    float ranges[NUM_RODS];
+    for (size_t i = 0; i < NUM_RODS; i++)
     {
-        /* MIDI */
-        midi.Listen();
-        if (midi.HasEvents())
-        {
-            HandleMidiMessage(midi.PopEvent());
-        }
+        rotations[i] = rodSensors[i].GetRotationSpeed();
+        ranges[i] = distanceSensorManager.GetNormalizedRange(tcaIndexMap[i]);
+    }
+    /* A channel status byte inside the dump would end it early */
+    midiOutput.SetHold(sysexPhase == SYSEX_SENDING);
+    midiOutput.Process(rotations, ranges);
 
-        // Set the onboard LED
-        // hw.SetLed(rodSensors[0].GetPulse());
+    // Set the onboard LED
+    // hw.SetLed(rodSensors[0].GetPulse());
 
-        /* Distance Sensors are slow */
-        if (count >= 8000)
+    /* Never waits on a measurement */
+    distanceSensorManager.SetProfile(sensorProfile);
+    distanceSensorManager.UpdateRanges();
+
+    /* Streams whatever was recorded, never waits on USB */
+    sensorCapture.Process();
+
+    if (count >= 8000)
+    {
+        // if (DEBUG)
+        // {
+        //     for (size_t i = 0; i < 4; i++)
+        //     {
+        //         float range = distanceSensorManager.GetNormalizedRange(i);
+        //         hw.PrintLine("%d", int(range * 100.f));
+        //     }
+        // }
+        if (DEBUG)
         {
-            distanceSensorManager.UpdateRanges();
-            // if (DEBUG)
-            // {
-            //     for (size_t i = 0; i < 4; i++)
-            //     {
-            //         float range = distanceSensorManager.GetNormalizedRange(i);
-            //         hw.PrintLine("%d", int(range * 100.f));
-            //     }
-            // }
-            count = 0;
+            hw.PrintLine("MIDI rx %d coalesced %d dropped %d",
+                         midiInput.GetEventsReceived(),
+                         midiInput.GetEventsCoalesced(),
+                         midiInput.GetEventsDropped());
+            hw.PrintLine("MIDI tx queued %d dropped %d suppressed %d",
+                         midi.GetTxQueued(),
+                         midi.GetTxDropped(),
+                         midiOutput.GetCcSuppressed());
+            hw.PrintLine("MIDI clock %s %d.%d BPM",
+                         midiClock.IsRunning() ? "running" : "stopped",
+                         int(midiClock.GetBpm()),
+                         int(midiClock.GetBpm() * 10.f) % 10);
+            for (size_t i = 0; i < NUM_RODS; i++)
+            {
+                int idx = tcaIndexMap[i];
+                hw.PrintLine("Rod %d range health %d breakbeam %s profile %d %dHz noise %d.%02dmm",
+                             i, distanceSensorManager.GetHealth(idx),
+                             rodSensors[i].HasBreakBeam() ? "ok" : "dead",
+                             distanceSensorManager.GetProfile(),
+                             int(distanceSensorManager.GetUpdateRate(idx) + 0.5f),
+                             int(distanceSensorManager.GetNoise(idx)),
+                             int(distanceSensorManager.GetNoise(idx) * 100.f) % 100);
+            }
+            hw.PrintLine("I2C bus recoveries %d", distanceSensorManager.GetRecoveries());
+            for (size_t i = 0; i <= NUM_SENSORS; i++)
+            {
+                const uint32_t *h = distanceSensorManager.GetLatencyHistogram(i);
+                hw.PrintLine("I2C dev %d err %d lat %d %d %d %d %d %d %d %d",
+                             i, distanceSensorManager.GetErrors(i),
+                             h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+            }
+            hw.PrintLine("Mod matrix %d slots, last %dns max %dns",
+                         modMatrix.NumSlots(),
+                         int(modMatrix.GetLastEvalUs() * 1000.f),
+                         int(modMatrix.GetMaxEvalUs() * 1000.f));
         }
-        count++;
+        count = 0;
+    }
+    count++;
 
-        /* TODO change to AnalogControl? */
-        gain = 1.f - hw.adc.GetFloat(0);
+    /* Envelopes are only recomputed when a pot really moves */
+    pots.Process();
+    if (pots.TakeChange(POT_GAIN))
+    {
+        gain = 1.f - pots.GetValue(POT_GAIN);
         if (gain < 0.04f)
             gain = 0.0f;
+    }
+    if (pots.TakeChange(POT_ATTACK))
+    {
+        ccRouting.Touch(PARAM_ATTACK);
+        PostPotEnvelope(POT_ATTACK, pots.GetValue(POT_ATTACK) * 5.f);
+    }
+    if (pots.TakeChange(POT_DECAY))
+    {
+        ccRouting.Touch(PARAM_DECAY);
+        PostPotEnvelope(POT_DECAY, pots.GetValue(POT_DECAY) * 5.f);
+    }
+    if (pots.TakeChange(POT_SUSTAIN))
+    {
+        ccRouting.Touch(PARAM_SUSTAIN);
+        PostPotEnvelope(POT_SUSTAIN, pots.GetValue(POT_SUSTAIN));
+    }
+    if (pots.TakeChange(POT_RELEASE))
+    {
+        ccRouting.Touch(PARAM_RELEASE);
+        PostPotEnvelope(POT_RELEASE, pots.GetValue(POT_RELEASE) * 5.f);
+    }
+}
 
-        float newAttackVal = hw.adc.GetFloat(1);
-        if (abs(newAttackVal - attackPotVal) > 0.03f)
-        {
-            attackPotVal = newAttackVal;
-            voiceHandler.SetAttack(newAttackVal * 5.f);
-        }
-        float newDecayVal = hw.adc.GetFloat(2);
-        if (abs(newDecayVal - decayPotVal) > 0.03f)
-        {
-            decayPotVal = newDecayVal;
-            voiceHandler.SetDecay(newDecayVal * 5.f);
-        }
-        float newSustainVal = hw.adc.GetFloat(3);
-        if (abs(newSustainVal - sustainPotVal) > 0.03f)
-        {
-            sustainPotVal = newSustainVal;
-            voiceHandler.SetSustain(newSustainVal);
-        }
-        float newReleaseVal = hw.adc.GetFloat(4);
-        if (abs(newReleaseVal - releasePotVal) > 0.03f)
-        {
-            releasePotVal = newReleaseVal;
-            voiceHandler.SetRelease(newReleaseVal * 5.f);
-        }
+int main(void)
+{
+    Setup();
+    for (;;)
+    {
+        Loop();
     }
 }
\ No newline at end of file
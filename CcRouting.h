@@ -0,0 +1,180 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Undefined in the MIDI spec; value >= 64 arms MIDI learn */
+#define MIDI_LEARN_CC 119
+
+/* Parameters a CC can be routed to. Rod parameters repeat per rod. */
+enum ParamId
+{
+    PARAM_NONE,
+    PARAM_ATTACK,
+    PARAM_DECAY,
+    PARAM_SUSTAIN,
+    PARAM_RELEASE,
+    PARAM_BEND_RANGE,
+    PARAM_MOD_CC,
+    PARAM_GLIDE,
+    PARAM_LEGATO,
+    PARAM_NOTE_PRIORITY,
+    PARAM_SENSOR_PROFILE,
+    /* Modulation matrix editing: pick a slot, then set its fields */
+    PARAM_MOD_SLOT,
+    PARAM_MOD_SOURCE,
+    PARAM_MOD_SOURCE_ROD,
+    PARAM_MOD_DEST,
+    PARAM_MOD_DEST_ROD,
+    PARAM_MOD_AMOUNT,
+    PARAM_ROD_FIRST,
+};
+
+enum RodParam
+{
+    ROD_PARAM_HARMONIC,
+    ROD_PARAM_WAVEFORM,
+    ROD_PARAM_LFO_TARGET,
+    ROD_PARAM_LFO_SYNC,
+    ROD_PARAM_SEQ_MODE,
+    ROD_PARAM_COUNT,
+};
+
+inline uint8_t RodParamId(int rod, RodParam param)
+{
+    return PARAM_ROD_FIRST + rod * ROD_PARAM_COUNT + param;
+}
+
+enum CcCurve
+{
+    CURVE_LINEAR,
+    CURVE_SQUARED,
+    CURVE_CUBED,
+    CURVE_SQRT,
+};
+
+/* One table entry. lo/hi are 0-255 fractions of the parameter's range; hi < lo inverts */
+struct CcRoute
+{
+    uint8_t param;
+    uint8_t curve;
+    uint8_t lo;
+    uint8_t hi;
+};
+
+/* Flat and POD so it can be copied into a preset as-is */
+struct CcRoutingTable
+{
+    CcRoute routes[16][128];
+};
+
+/*
+  Table-driven CC dispatch: one lookup per message, no branching on the CC
+  number. In learn mode the next CC (other than MIDI_LEARN_CC) on any
+  channel is bound to the last parameter reported through Touch().
+*/
+class CcRouting
+{
+private:
+    CcRoutingTable table;
+
+    bool learning;
+    uint8_t lastTouched;
+
+    static float ApplyCurve(uint8_t curve, float x)
+    {
+        switch (curve)
+        {
+        case CURVE_SQUARED:
+            return x * x;
+        case CURVE_CUBED:
+            return x * x * x;
+        case CURVE_SQRT:
+            return sqrtf(x);
+        default:
+            return x;
+        }
+    }
+
+public:
+    CcRouting(){};
+    ~CcRouting(){};
+
+    /* Defaults match the old hard-coded CC1-4 -> ADSR on every channel */
+    void Init()
+    {
+        memset(&table, 0, sizeof(table));
+        for (size_t c = 0; c < 16; c++)
+        {
+            SetRoute(c, 1, PARAM_ATTACK);
+            SetRoute(c, 2, PARAM_DECAY);
+            SetRoute(c, 3, PARAM_SUSTAIN);
+            SetRoute(c, 4, PARAM_RELEASE);
+            /* Expression pedal feeds the modulation matrix */
+            SetRoute(c, 11, PARAM_MOD_CC);
+            /* Portamento time and legato footswitch, for mono channels */
+            SetRoute(c, 5, PARAM_GLIDE);
+            SetRoute(c, 68, PARAM_LEGATO);
+            /* Undefined CCs edit the modulation matrix */
+            SetRoute(c, 102, PARAM_MOD_SLOT);
+            SetRoute(c, 103, PARAM_MOD_SOURCE);
+            SetRoute(c, 104, PARAM_MOD_SOURCE_ROD);
+            SetRoute(c, 105, PARAM_MOD_DEST);
+            SetRoute(c, 106, PARAM_MOD_DEST_ROD);
+            SetRoute(c, 107, PARAM_MOD_AMOUNT);
+        }
+        learning = false;
+        lastTouched = PARAM_NONE;
+    }
+
+    void SetRoute(int channel, int cc, uint8_t param, uint8_t curve = CURVE_LINEAR, uint8_t lo = 0, uint8_t hi = 255)
+    {
+        CcRoute &r = table.routes[channel & 0x0F][cc & 0x7F];
+        r.param = param;
+        r.curve = curve;
+        r.lo = lo;
+        r.hi = hi;
+    }
+
+    inline const CcRoute &GetRoute(int channel, int cc) const
+    {
+        return table.routes[channel & 0x0F][cc & 0x7F];
+    }
+
+    /* 0-127 through the route's curve and range, result 0-1 */
+    static float Scale(const CcRoute &r, uint8_t value)
+    {
+        float x = ApplyCurve(r.curve, value / 127.f);
+        return (r.lo + (float(r.hi) - r.lo) * x) / 255.f;
+    }
+
+    /* ---- MIDI learn ---- */
+
+    void SetLearning(bool on) { learning = on; }
+    inline bool IsLearning() const { return learning; }
+
+    /* Called whenever a front panel control moves */
+    void Touch(uint8_t param) { lastTouched = param; }
+
+    /*
+      Binds cc to the last touched control if learning. Returns true when
+      the message was consumed by learn.
+    */
+    bool Learn(int channel, int cc)
+    {
+        if (!learning || lastTouched == PARAM_NONE)
+            return false;
+
+        SetRoute(channel, cc, lastTouched);
+        learning = false;
+        return true;
+    }
+
+    /* ---- Bulk access for presets ---- */
+
+    const CcRoutingTable &GetTable() const { return table; }
+
+    void LoadTable(const CcRoutingTable &newTable)
+    {
+        memcpy(&table, &newTable, sizeof(table));
+    }
+};
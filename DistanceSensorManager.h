@@ -11,6 +11,43 @@ using namespace daisysp;
 
 #define NUM_SENSORS 4
 
+/* A background poll of the next sensor is started this often */
+#define DISTANCE_POLL_INTERVAL_US 1000
+
+/* Update rate and noise are measured over windows this long */
+#define DISTANCE_STATS_WINDOW_US 1000000
+
+/* Consecutive failed polls before a sensor is taken out and re-probed */
+#define DISTANCE_DEAD_FAILURES 3
+/* Answering but no sample for this long, e.g. reset and no longer ranging */
+#define DISTANCE_STALE_US 500000
+/* Re-probe backoff, doubling from min to max */
+#define DISTANCE_REPROBE_MIN_US 100000
+#define DISTANCE_REPROBE_MAX_US 5000000
+/* Register writes in one timing profile */
+#define DISTANCE_PROFILE_WRITES 4
+
+#include "./I2cScheduler.h"
+#include "./RangePredictor.h"
+
+enum SensorHealth
+{
+    SENSOR_OK,
+    SENSOR_FAILING, // polls failing, range held
+    SENSOR_DEAD,    // out of the round-robin, re-probed with backoff
+};
+
+/* Samples per window and their spread, for comparing profiles */
+struct RangeStats
+{
+    uint32_t count;
+    float mean;
+    float m2;
+    /* Last finished window */
+    float rateHz;
+    float noiseMm;
+};
+
 I2CHandle _i2c;
 
 static constexpr I2CHandle::Config _i2c_config = {
@@ -21,22 +58,205 @@ static constexpr I2CHandle::Config _i2c_config = {
     },
     I2CHandle::Config::Speed::I2C_1MHZ};
 
+/*
+  Four VL6180X sensors behind a TCA9548 mux, polled in the background.
+
+  The main loop only blocks on the bus in three places, all bounded:
+  re-probing a dead sensor (one NACK, ~50 us, or ~2 ms of setup writes
+  when it has come back), a re-probe on a wedged bus (one 1 ms HAL
+  timeout, then backoff), and bus recovery (~100 us). At most one of them
+  runs per pass, so the worst pass is a sensor that answers setup and then
+  times out on its last write: ~2 ms of writes plus one timeout, under
+  4 ms. host/sensor_fault_test checks this against a simulated bus. A
+  sensor that stops answering keeps its last range until it is found
+  again.
+
+  Profile writes only go to sensors that are in the round-robin. A dead
+  sensor's queue is flushed when it is re-probed and it gets the current
+  profile then; a queue too full for a whole profile is retried on later
+  passes rather than left half written.
+*/
 class DistanceSensorManager
 {
 private:
     VL6180X_Sensor vl[NUM_SENSORS];
+    I2cScheduler<NUM_SENSORS> scheduler;
+    RangePredictor predictors[NUM_SENSORS];
+    int profile = VL6180X_DEFAULT_PROFILE;
+    RangeStats stats[NUM_SENSORS];
+    uint32_t statsStartUs = 0;
     DaisySeed *hw;
     bool isActive = false;
     uint8_t range = 0;
-    int activeIndex = 0;
+    uint32_t lastPollUs = 0;
+
+    SensorHealth health[NUM_SENSORS];
+    uint32_t lastSampleUs[NUM_SENSORS];
+    uint32_t reprobeUs[NUM_SENSORS];
+    uint32_t backoffUs[NUM_SENSORS];
+    uint32_t recoveries = 0;
+    /* Profile still to be queued, the queue was full */
+    bool profilePending[NUM_SENSORS];
+    SensorCapture *capture = NULL;
+
+    void MarkDead(size_t idx, uint32_t now)
+    {
+        scheduler.SetActive(idx, false);
+        health[idx] = SENSOR_DEAD;
+        profilePending[idx] = false;
+        reprobeUs[idx] = now + backoffUs[idx];
+        backoffUs[idx] = backoffUs[idx] * 2 > DISTANCE_REPROBE_MAX_US ? DISTANCE_REPROBE_MAX_US : backoffUs[idx] * 2;
+    }
+
+    void MarkAlive(size_t idx, uint32_t now)
+    {
+        scheduler.SetActive(idx, true);
+        health[idx] = SENSOR_OK;
+        lastSampleUs[idx] = now;
+        backoffUs[idx] = DISTANCE_REPROBE_MIN_US;
+    }
+
+    /*
+      Blocking, bus must be idle. Re-runs sensor setup: one NACK when the
+      sensor is still missing, about 50 register writes (~2 ms) when it
+      comes back fresh out of reset.
+    */
+    void Reprobe(size_t idx, uint32_t now)
+    {
+        /* Anything queued was meant for the sensor before it was lost */
+        scheduler.FlushWrites(idx);
+        bool ok = tcaselect(idx) && vl[idx].Begin();
+        scheduler.Invalidate();
+        if (ok)
+        {
+            MarkAlive(idx, now);
+            /* Setup left it on the default profile */
+            if (profile != VL6180X_DEFAULT_PROFILE)
+                QueueProfile(idx);
+        }
+        else
+            MarkDead(idx, now);
+    }
 
-    void tcaselect(uint8_t i)
+    /*
+      A slave stuck mid-byte holds SDA low and no transfer can start.
+      Clock SCL by hand until it lets go, send a STOP, then hand the pins
+      back to the peripheral. About 100 us.
+    */
+    void RecoverBus()
+    {
+        dsy_gpio scl, sda;
+        scl.pin = _i2c_config.pin_config.scl;
+        scl.mode = DSY_GPIO_MODE_OUTPUT_OD;
+        scl.pull = DSY_GPIO_NOPULL;
+        sda.pin = _i2c_config.pin_config.sda;
+        sda.mode = DSY_GPIO_MODE_OUTPUT_OD;
+        sda.pull = DSY_GPIO_NOPULL;
+        dsy_gpio_init(&scl);
+        dsy_gpio_init(&sda);
+        dsy_gpio_write(&sda, 1);
+
+        for (size_t i = 0; i < 9 && !dsy_gpio_read(&sda); i++)
+        {
+            dsy_gpio_write(&scl, 0);
+            System::DelayUs(5);
+            dsy_gpio_write(&scl, 1);
+            System::DelayUs(5);
+        }
+
+        /* STOP: SDA rises while SCL is high */
+        dsy_gpio_write(&scl, 0);
+        dsy_gpio_write(&sda, 0);
+        System::DelayUs(5);
+        dsy_gpio_write(&scl, 1);
+        System::DelayUs(5);
+        dsy_gpio_write(&sda, 1);
+        System::DelayUs(5);
+
+        dsy_gpio_deinit(&scl);
+        dsy_gpio_deinit(&sda);
+        _i2c.Init(_i2c_config);
+        scheduler.Invalidate();
+        recoveries++;
+    }
+
+    /* The whole profile or nothing, false if the queue had no room */
+    bool QueueProfile(size_t idx)
+    {
+        if (scheduler.GetWriteSpace(idx) < DISTANCE_PROFILE_WRITES)
+        {
+            profilePending[idx] = true;
+            return false;
+        }
+        profilePending[idx] = false;
+        const VL6180XProfileSettings &p = vl6180xProfiles[profile];
+        scheduler.QueueWrite(idx, VL6180X_REG_READOUT_AVERAGING_SAMPLE_PERIOD, p.averaging);
+        scheduler.QueueWrite(idx, VL6180X_REG_SYSRANGE_MAX_CONVERGENCE_TIME, p.convergenceMs);
+        scheduler.QueueWrite(idx, VL6180X_REG_SYSRANGE_RANGE_CHECK_ENABLES, p.checkEnables);
+        scheduler.QueueWrite(idx, SYSRANGE__INTERMEASUREMENT_PERIOD, VL6180X_Sensor::PeriodReg(p.periodMs));
+        return true;
+    }
+
+    /* Main loop. Demotes sensors that stopped delivering, re-probes dead ones */
+    void CheckHealth(uint32_t now)
+    {
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            if (health[i] == SENSOR_DEAD)
+            {
+                if (!scheduler.IsBusy() && int32_t(now - reprobeUs[i]) >= 0)
+                {
+                    /* One blocking probe per pass at most */
+                    Reprobe(i, now);
+                    return;
+                }
+                continue;
+            }
+
+            uint8_t failures = scheduler.GetFailures(i);
+            if (failures >= DISTANCE_DEAD_FAILURES || now - lastSampleUs[i] > DISTANCE_STALE_US)
+                MarkDead(i, now);
+            else
+            {
+                health[i] = failures > 0 ? SENSOR_FAILING : SENSOR_OK;
+                if (profilePending[i])
+                    QueueProfile(i);
+            }
+        }
+    }
+
+    void AddStat(size_t idx, uint8_t newRange)
+    {
+        /* Welford, so a still hand's small spread isn't lost to rounding */
+        RangeStats &st = stats[idx];
+        st.count++;
+        float delta = newRange - st.mean;
+        st.mean += delta / st.count;
+        st.m2 += delta * (newRange - st.mean);
+    }
+
+    void FinishStats(uint32_t now)
+    {
+        float seconds = (now - statsStartUs) * 1e-6f;
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            RangeStats &st = stats[i];
+            st.rateHz = seconds > 0.f ? st.count / seconds : 0.f;
+            st.noiseMm = st.count > 1 ? sqrtf(st.m2 / (st.count - 1)) : 0.f;
+            st.count = 0;
+            st.mean = 0.f;
+            st.m2 = 0.f;
+        }
+        statsStartUs = now;
+    }
+
+    bool tcaselect(uint8_t i)
     {
         if (i > 7)
-            return;
+            return false;
 
         uint8_t data = 1 << i;
-        _i2c.TransmitBlocking(TCAADDR, &data, 1, 500);
+        return _i2c.TransmitBlocking(TCAADDR, &data, 1, VL6180X_I2C_TIMEOUT_MS) == I2CHandle::Result::OK;
     }
 
     void PrintAddresses()
@@ -51,7 +271,7 @@ private:
                 if (address == TCAADDR)
                     continue;
                 uint8_t testData = 0;
-                I2CHandle::Result i2cResult = _i2c.TransmitBlocking(address, &testData, 1, 500);
+                I2CHandle::Result i2cResult = _i2c.TransmitBlocking(address, &testData, 1, VL6180X_I2C_TIMEOUT_MS);
 
                 if (i2cResult == I2CHandle::Result::OK)
                 {
@@ -79,17 +299,39 @@ public:
             PrintAddresses();
         }
 
+        uint32_t activeMask = 0;
         for (size_t i = 0; i < NUM_SENSORS; i++)
         {
             tcaselect(i);
             // hw->PrintLine("Init sensor %d", i);
             vl[i].Init(_hw, &_i2c);
             bool res = vl[i].Begin();
-            // if (!res)
-            // {
-            //     hw->PrintLine("Error setting up");
-            // }
+            if (res)
+                activeMask |= 1 << i;
+        }
+
+        /* Every access from here on goes through the scheduler */
+        scheduler.Init(&_i2c, TCAADDR, VL6180X_DEFAULT_I2C_ADDR, activeMask);
+
+        uint32_t now = System::GetUs();
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            /* Sensors missing at boot are re-probed like ones lost later */
+            backoffUs[i] = DISTANCE_REPROBE_MIN_US;
+            profilePending[i] = false;
+            if ((activeMask >> i) & 1)
+                MarkAlive(i, now);
+            else
+                MarkDead(i, now);
+
+            predictors[i].Init();
+            stats[i].count = 0;
+            stats[i].mean = 0.f;
+            stats[i].m2 = 0.f;
+            stats[i].rateHz = 0.f;
+            stats[i].noiseMm = 0.f;
         }
+        statsStartUs = now;
     };
     uint8_t GetRange(int idx)
     {
@@ -99,11 +341,120 @@ public:
     {
         return vl[idx].GetNormalizedRange();
     }
+    /* Audio callback. Range extrapolated to nowUs, 0-1 like GetNormalizedRange */
+    float GetPredictedRange(int idx, uint32_t nowUs)
+    {
+        float minRange = vl[idx].GetMinRange();
+        float maxRange = vl[idx].GetMaxRange();
+        float mm = constrain(predictors[idx].Predict(nowUs), minRange, maxRange);
+        return mapf(mm, minRange, maxRange, 0.f, 1.f);
+    }
+    void SetFilter(float minCutoffHz, float betaHz)
+    {
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+            vl[i].SetFilter(minCutoffHz, betaHz);
+    }
+    void SetCalibration(int idx, float minMm, float maxMm)
+    {
+        vl[idx].SetCalibration(minMm, maxMm);
+    }
+    float GetMinRange(int idx)
+    {
+        return vl[idx].GetMinRange();
+    }
+    float GetMaxRange(int idx)
+    {
+        return vl[idx].GetMaxRange();
+    }
+    /*
+      Main loop, every pass. Collects samples the scheduler has read and
+      starts the next background poll, never touching the bus itself.
+    */
     void UpdateRanges()
     {
-        tcaselect(activeIndex);
-        vl[activeIndex].UpdateRange();
-        activeIndex++;
-        activeIndex = activeIndex % NUM_SENSORS;
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            uint8_t newRange, status;
+            uint32_t timeUs;
+            if (scheduler.TakeSample(i, newRange, status, timeUs))
+                FeedSample(i, newRange, status, timeUs);
+        }
+
+        uint32_t now = System::GetUs();
+        if (now - statsStartUs >= DISTANCE_STATS_WINDOW_US)
+            FinishStats(now);
+
+        CheckHealth(now);
+        if (now - lastPollUs < DISTANCE_POLL_INTERVAL_US)
+            return;
+        lastPollUs = now;
+        if (scheduler.Process())
+            RecoverBus();
+    }
+    /*
+      Main loop. One sample as read from the sensor, status included for
+      the capture. UpdateRanges() feeds every sample it takes through here,
+      host replay feeds recorded ones.
+    */
+    void FeedSample(size_t idx, uint8_t newRange, uint8_t status, uint32_t timeUs)
+    {
+        if (capture != NULL)
+            capture->RecordMain(CAPTURE_RANGE, idx, newRange | status << 8, timeUs);
+        lastSampleUs[idx] = timeUs;
+        vl[idx].AddSample(newRange, timeUs);
+        predictors[idx].Update(vl[idx].GetFilteredRange(), timeUs);
+        AddStat(idx, newRange);
+    }
+    /* Raw samples are recorded as they are taken */
+    void SetCapture(SensorCapture *_capture)
+    {
+        capture = _capture;
+    }
+    /*
+      Main loop. Only the timing registers are rewritten, queued behind
+      each live sensor's next poll; ranging carries on and picks them up
+      from its next measurement. Dead sensors get it when re-probed.
+    */
+    void SetProfile(int _profile)
+    {
+        if (_profile == profile || _profile < 0 || _profile >= VL6180X_PROFILE_COUNT)
+            return;
+        profile = _profile;
+
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            if (health[i] != SENSOR_DEAD)
+                QueueProfile(i);
+        }
+        /* Don't mix windows from two profiles */
+        FinishStats(System::GetUs());
+    }
+    int GetProfile()
+    {
+        return profile;
+    }
+    float GetUpdateRate(int idx)
+    {
+        return stats[idx].rateHz;
+    }
+    float GetNoise(int idx)
+    {
+        return stats[idx].noiseMm;
+    }
+    SensorHealth GetHealth(int idx)
+    {
+        return health[idx];
+    }
+    uint32_t GetRecoveries()
+    {
+        return recoveries;
+    }
+    const uint32_t *GetLatencyHistogram(size_t device)
+    {
+        return scheduler.GetLatencyHistogram(device);
+    }
+    uint32_t GetErrors(size_t device)
+    {
+        return scheduler.GetErrors(device);
     }
 };
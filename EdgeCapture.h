@@ -0,0 +1,114 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+/* Edges that can wait between two audio blocks, power of two */
+#define EDGE_RING_SIZE 16
+/* Edges closer than this to the last one are glitches */
+#define EDGE_MIN_INTERVAL_US 500
+
+/*
+  Both edges of one GPIO, timestamped in its EXTI interrupt.
+
+  The interrupt only reads the microsecond clock and pushes into a ring,
+  so the time is taken within a few microseconds of the edge rather than
+  at the next block's debounce. An edge only counts if the level really
+  changed and enough time has passed since the last one.
+*/
+class EdgeCapture
+{
+private:
+    dsy_gpio gpio;
+    uint8_t lastLevel;
+    uint32_t lastUs;
+    uint32_t dropped;
+
+public:
+    SpscRing<uint32_t, EDGE_RING_SIZE> edges;
+
+    /* Reads as the pulled-up idle level until Init succeeds */
+    EdgeCapture() : lastLevel(1), lastUs(0), dropped(0){};
+    ~EdgeCapture(){};
+
+    bool Init(dsy_gpio_pin pin);
+
+    /* EXTI interrupt */
+    void OnInterrupt()
+    {
+        uint32_t now = System::GetUs();
+        uint8_t level = dsy_gpio_read(&gpio);
+        if (level == lastLevel || now - lastUs < EDGE_MIN_INTERVAL_US)
+            return;
+        lastLevel = level;
+        lastUs = now;
+        if (!edges.Push(now))
+            dropped++;
+    }
+
+    inline uint8_t GetLevel() const { return lastLevel; }
+    inline uint32_t GetDropped() const { return dropped; }
+};
+
+/* Indexed by EXTI line, which is the pin number on any port */
+static EdgeCapture *edgeCaptures[16];
+
+static GPIO_TypeDef *const edgePorts[] = {GPIOA, GPIOB, GPIOC, GPIOD, GPIOE, GPIOF, GPIOG, GPIOH, GPIOI, GPIOJ, GPIOK};
+
+/* False if the line is already taken by another pin */
+bool EdgeCapture::Init(dsy_gpio_pin pin)
+{
+    if (pin.port >= DSY_GPIOX || pin.pin > 15 || edgeCaptures[pin.pin] != NULL)
+        return false;
+
+    /* Clocks the port and sets the pull-up, the same as the old Switch */
+    gpio.pin = pin;
+    gpio.mode = DSY_GPIO_MODE_INPUT;
+    gpio.pull = DSY_GPIO_PULLUP;
+    dsy_gpio_init(&gpio);
+    lastLevel = dsy_gpio_read(&gpio);
+    lastUs = System::GetUs();
+    dropped = 0;
+    edgeCaptures[pin.pin] = this;
+
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    GPIO_InitTypeDef init;
+    init.Pin = 1 << pin.pin;
+    init.Mode = GPIO_MODE_IT_RISING_FALLING;
+    init.Pull = GPIO_PULLUP;
+    init.Speed = GPIO_SPEED_FREQ_LOW;
+    init.Alternate = 0;
+    HAL_GPIO_Init(edgePorts[pin.port], &init);
+
+    IRQn_Type irq;
+    if (pin.pin <= 4)
+        irq = IRQn_Type(EXTI0_IRQn + pin.pin);
+    else if (pin.pin <= 9)
+        irq = EXTI9_5_IRQn;
+    else
+        irq = EXTI15_10_IRQn;
+    /* Above audio, the handler is a few dozen cycles */
+    HAL_NVIC_SetPriority(irq, 0, 0);
+    HAL_NVIC_EnableIRQ(irq);
+    return true;
+}
+
+static void DispatchEdges(uint32_t first, uint32_t last)
+{
+    for (uint32_t line = first; line <= last; line++)
+    {
+        uint32_t mask = 1 << line;
+        if (!__HAL_GPIO_EXTI_GET_IT(mask))
+            continue;
+        __HAL_GPIO_EXTI_CLEAR_IT(mask);
+        if (edgeCaptures[line] != NULL)
+            edgeCaptures[line]->OnInterrupt();
+    }
+}
+
+extern "C" void EXTI0_IRQHandler() { DispatchEdges(0, 0); }
+extern "C" void EXTI1_IRQHandler() { DispatchEdges(1, 1); }
+extern "C" void EXTI2_IRQHandler() { DispatchEdges(2, 2); }
+extern "C" void EXTI3_IRQHandler() { DispatchEdges(3, 3); }
+extern "C" void EXTI4_IRQHandler() { DispatchEdges(4, 4); }
+extern "C" void EXTI9_5_IRQHandler() { DispatchEdges(5, 9); }
+extern "C" void EXTI15_10_IRQHandler() { DispatchEdges(10, 15); }
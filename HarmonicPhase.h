@@ -0,0 +1,104 @@
+// #include "daisy_seed.h"
+#include "daisysp.h"
+#include <math.h>
+
+using namespace daisy;
+using namespace daisysp;
+
+/*
+  One 32-bit integer phase accumulator per voice, shared by every rod.
+
+  Each rod plays an integer harmonic of the voice's note, so its phase is
+  just the voice phase multiplied by the harmonic number. The multiply wraps
+  around 2^32 exactly like the accumulator does, which keeps all rods
+  phase-locked to each other. Pitch bend is applied here once per voice;
+  each rod's vibrato stays its own, see RodOscillators::ProcessLocked().
+*/
+template <size_t max_polyphony>
+class HarmonicPhase
+{
+private:
+    /* Phase of each voice, full scale = one cycle */
+    uint32_t phases[max_polyphony];
+    /* Un-modulated phase increment of each voice */
+    float baseIncrements[max_polyphony];
+    /* Increment actually applied on the last Process() */
+    uint32_t increments[max_polyphony];
+    /* Per-note (MPE) pitch bend ratio, ramped across a block */
+    float voiceBends[max_polyphony];
+    float voiceBendSteps[max_polyphony];
+    uint16_t voiceBendFrames[max_polyphony];
+
+    float sampleRate;
+    float pitchBend;
+
+    size_t currentPolyphony;
+
+public:
+    HarmonicPhase(){};
+    ~HarmonicPhase(){};
+
+    void Init(float sample_rate)
+    {
+        sampleRate = sample_rate;
+        pitchBend = 1.0f;
+        currentPolyphony = max_polyphony;
+
+        for (size_t i = 0; i < max_polyphony; i++)
+        {
+            phases[i] = 0;
+            baseIncrements[i] = 0.0f;
+            increments[i] = 0;
+            voiceBends[i] = 1.0f;
+            voiceBendSteps[i] = 0.0f;
+            voiceBendFrames[i] = 0;
+        }
+    }
+
+    void SetCurrentPolyphony(size_t numVoices)
+    {
+        currentPolyphony = numVoices;
+    }
+
+    void SetFundamentalFreq(float freq, int target)
+    {
+        /* 2^32 / sample rate */
+        baseIncrements[target] = freq * (4294967296.f / sampleRate);
+    }
+
+    void SetPitchBend(float fq)
+    {
+        pitchBend = fq;
+    }
+
+    /* Glide one voice's bend ratio to target over the next frames samples */
+    void RampVoiceBend(size_t voice, float target, size_t frames)
+    {
+        if (frames == 0)
+        {
+            voiceBends[voice] = target;
+            voiceBendFrames[voice] = 0;
+            return;
+        }
+        voiceBendSteps[voice] = (target - voiceBends[voice]) / frames;
+        voiceBendFrames[voice] = frames;
+    }
+
+    void Process()
+    {
+        for (size_t i = 0; i < currentPolyphony; i++)
+        {
+            if (voiceBendFrames[i])
+            {
+                voiceBends[i] += voiceBendSteps[i];
+                voiceBendFrames[i]--;
+            }
+            float inc = baseIncrements[i] * voiceBends[i] * pitchBend;
+            increments[i] = inc > 0.0f ? uint32_t(inc) : 0;
+            phases[i] += increments[i];
+        }
+    }
+
+    inline uint32_t GetPhase(size_t voice) const { return phases[voice]; }
+    inline uint32_t GetIncrement(size_t voice) const { return increments[voice]; }
+};
@@ -0,0 +1,366 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+/* Mux channel unknown, the next access always selects */
+#define I2C_MUX_NONE 0xFF
+/* Register writes waiting per sensor, power of two */
+#define I2C_WRITE_QUEUE_SIZE 16
+/* Power of two transfer latency buckets: <16us, <32us ... >=1024us */
+#define I2C_LATENCY_BUCKETS 8
+#define I2C_LATENCY_MIN_SHIFT 4
+/*
+  A whole poll chain is well under 1 ms at 1 MHz. One still running after
+  this has lost its completion interrupt, usually to a slave holding SDA.
+*/
+#define I2C_CHAIN_TIMEOUT_US 2000
+
+/*
+  One batched read covers range status (0x04D) through the range value
+  (0x062), so a poll is a single address write and a single read
+*/
+#define I2C_BATCH_FIRST VL6180X_REG_RESULT_RANGE_STATUS
+#define I2C_BATCH_SIZE (VL6180X_REG_RESULT_RANGE_VAL - I2C_BATCH_FIRST + 1)
+
+/* DMA buffers must live in D2 SRAM */
+static uint8_t DMA_BUFFER_MEM_SECTION i2cTxDmaBuffer[3];
+static uint8_t DMA_BUFFER_MEM_SECTION i2cRxDmaBuffer[I2C_BATCH_SIZE];
+
+struct I2cRegWrite
+{
+    uint16_t reg;
+    uint8_t value;
+};
+
+/*
+  Background VL6180X polling behind the TCA9548 mux.
+
+  A poll of one sensor is a chain of DMA transfers, each started from the
+  previous one's completion callback: a mux select (skipped when the
+  channel is already selected), any queued register writes, the batched
+  result read and, if a sample was ready, the interrupt clear. The main
+  loop only starts a chain for the next sensor round-robin and collects
+  finished samples, so it never waits on the bus.
+
+  Blocking transfers on the same bus (sensor setup) must be finished
+  before Init() and may later only run while !IsBusy(), followed by
+  Invalidate().
+*/
+template <size_t num_sensors>
+class I2cScheduler
+{
+private:
+    enum Step
+    {
+        STEP_IDLE,
+        STEP_SELECT,
+        STEP_WRITE,
+        STEP_ADDRESS,
+        STEP_READ,
+        STEP_CLEAR,
+    };
+
+    /* Sensors first, then the mux */
+    static constexpr size_t NUM_DEVICES = num_sensors + 1;
+    static constexpr size_t MUX_DEVICE = num_sensors;
+
+    I2CHandle *i2c;
+    uint8_t muxAddress;
+    uint8_t sensorAddress;
+    uint32_t activeMask;
+
+    volatile Step step;
+    volatile uint8_t muxChannel;
+    size_t current;
+    size_t nextSensor;
+    uint32_t startUs;
+    uint32_t chainStartUs;
+
+    SpscRing<I2cRegWrite, I2C_WRITE_QUEUE_SIZE> writes[num_sensors];
+
+    /* Read result waiting for its interrupt clear */
+    uint8_t pendingRange;
+    uint8_t pendingStatus;
+    uint32_t pendingUs;
+
+    /* Written by the chain, read by the main loop */
+    volatile uint8_t sample[num_sensors];
+    volatile uint8_t sampleStatus[num_sensors];
+    volatile uint32_t sampleUs[num_sensors];
+    volatile uint32_t sampleCount[num_sensors];
+    uint32_t takenCount[num_sensors];
+
+    uint32_t latency[NUM_DEVICES][I2C_LATENCY_BUCKETS];
+    uint32_t errors[NUM_DEVICES];
+    /* Failed transfers since the device last answered */
+    volatile uint8_t failures[NUM_DEVICES];
+
+    static void Callback(void *context, I2CHandle::Result res)
+    {
+        ((I2cScheduler *)context)->OnDone(res);
+    }
+
+    void Record(size_t device)
+    {
+        uint32_t us = System::GetUs() - startUs;
+        int bucket = (31 - __builtin_clz(us | 1)) - I2C_LATENCY_MIN_SHIFT + 1;
+        if (bucket < 0)
+            bucket = 0;
+        if (bucket >= I2C_LATENCY_BUCKETS)
+            bucket = I2C_LATENCY_BUCKETS - 1;
+        latency[device][bucket]++;
+    }
+
+    /* The transfer's device is blamed, and the mux state is no longer known */
+    void Fail(size_t device)
+    {
+        errors[device]++;
+        if (failures[device] < 0xFF)
+            failures[device]++;
+        muxChannel = I2C_MUX_NONE;
+        step = STEP_IDLE;
+    }
+
+    void Transmit(Step next, uint16_t address, size_t size)
+    {
+        step = next;
+        startUs = System::GetUs();
+        if (i2c->TransmitDma(address, i2cTxDmaBuffer, size, Callback, this) != I2CHandle::Result::OK)
+            Fail(next == STEP_SELECT ? MUX_DEVICE : current);
+    }
+
+    void StartSelect()
+    {
+        i2cTxDmaBuffer[0] = 1 << current;
+        Transmit(STEP_SELECT, muxAddress, 1);
+    }
+
+    void StartRegisters()
+    {
+        const I2cRegWrite *w = writes[current].Peek();
+        if (w != NULL)
+        {
+            i2cTxDmaBuffer[0] = uint8_t(w->reg >> 8);
+            i2cTxDmaBuffer[1] = uint8_t(w->reg & 0xFF);
+            i2cTxDmaBuffer[2] = w->value;
+            Transmit(STEP_WRITE, sensorAddress, 3);
+            return;
+        }
+        i2cTxDmaBuffer[0] = uint8_t(I2C_BATCH_FIRST >> 8);
+        i2cTxDmaBuffer[1] = uint8_t(I2C_BATCH_FIRST & 0xFF);
+        Transmit(STEP_ADDRESS, sensorAddress, 2);
+    }
+
+    void StartRead()
+    {
+        step = STEP_READ;
+        startUs = System::GetUs();
+        if (i2c->ReceiveDma(sensorAddress, i2cRxDmaBuffer, I2C_BATCH_SIZE, Callback, this) != I2CHandle::Result::OK)
+            Fail(current);
+    }
+
+    /* I2C interrupt */
+    void OnDone(I2CHandle::Result res)
+    {
+        /* Late callback for a chain the watchdog already gave up on */
+        if (step == STEP_IDLE)
+            return;
+
+        size_t device = step == STEP_SELECT ? MUX_DEVICE : current;
+        if (res != I2CHandle::Result::OK)
+        {
+            Fail(device);
+            return;
+        }
+        Record(device);
+        failures[device] = 0;
+
+        switch (step)
+        {
+        case STEP_SELECT:
+            muxChannel = current;
+            StartRegisters();
+            return;
+
+        case STEP_WRITE:
+            writes[current].Pop();
+            StartRegisters();
+            return;
+
+        case STEP_ADDRESS:
+            StartRead();
+            return;
+
+        case STEP_READ:
+        {
+            uint8_t status = i2cRxDmaBuffer[VL6180X_REG_RESULT_INTERRUPT_STATUS_GPIO - I2C_BATCH_FIRST];
+            if (!(status & 0x04))
+            {
+                step = STEP_IDLE;
+                return;
+            }
+            pendingRange = i2cRxDmaBuffer[VL6180X_REG_RESULT_RANGE_VAL - I2C_BATCH_FIRST];
+            pendingStatus = i2cRxDmaBuffer[0] >> 4;
+            pendingUs = System::GetUs();
+
+            i2cTxDmaBuffer[0] = uint8_t(VL6180X_REG_SYSTEM_INTERRUPT_CLEAR >> 8);
+            i2cTxDmaBuffer[1] = uint8_t(VL6180X_REG_SYSTEM_INTERRUPT_CLEAR & 0xFF);
+            i2cTxDmaBuffer[2] = 0x07;
+            Transmit(STEP_CLEAR, sensorAddress, 3);
+            return;
+        }
+
+        case STEP_CLEAR:
+            /* The count goes last, TakeSample rereads if it moved under it */
+            sample[current] = pendingRange;
+            sampleStatus[current] = pendingStatus;
+            sampleUs[current] = pendingUs;
+            sampleCount[current]++;
+            step = STEP_IDLE;
+            return;
+
+        default:
+            step = STEP_IDLE;
+            return;
+        }
+    }
+
+public:
+    I2cScheduler(){};
+    ~I2cScheduler(){};
+
+    /* activeMask has a bit per sensor that answered at setup */
+    void Init(I2CHandle *_i2c, uint8_t _muxAddress, uint8_t _sensorAddress, uint32_t _activeMask)
+    {
+        i2c = _i2c;
+        muxAddress = _muxAddress;
+        sensorAddress = _sensorAddress;
+        activeMask = _activeMask;
+        step = STEP_IDLE;
+        muxChannel = I2C_MUX_NONE;
+        current = 0;
+        nextSensor = 0;
+        chainStartUs = 0;
+
+        for (size_t s = 0; s < num_sensors; s++)
+        {
+            sample[s] = 0;
+            sampleStatus[s] = 0;
+            sampleUs[s] = 0;
+            sampleCount[s] = 0;
+            takenCount[s] = 0;
+        }
+        for (size_t d = 0; d < NUM_DEVICES; d++)
+        {
+            errors[d] = 0;
+            failures[d] = 0;
+            for (size_t b = 0; b < I2C_LATENCY_BUCKETS; b++)
+                latency[d][b] = 0;
+        }
+    }
+
+    inline bool IsBusy() const { return step != STEP_IDLE; }
+
+    /*
+      Main loop. Starts polling the next active sensor if the bus is free.
+      Returns true if it had to abandon a stuck chain, the bus then needs
+      recovering before the next poll.
+    */
+    bool Process()
+    {
+        if (IsBusy())
+        {
+            if (System::GetUs() - chainStartUs < I2C_CHAIN_TIMEOUT_US)
+                return false;
+
+            ScopedIrqBlocker block;
+            if (!IsBusy())
+                return false;
+            Fail(step == STEP_SELECT ? MUX_DEVICE : current);
+            return true;
+        }
+        if (activeMask == 0)
+            return false;
+
+        chainStartUs = System::GetUs();
+
+        for (size_t i = 0; i < num_sensors; i++)
+        {
+            size_t s = nextSensor;
+            nextSensor = (nextSensor + 1) % num_sensors;
+            if (!((activeMask >> s) & 1))
+                continue;
+
+            current = s;
+            if (muxChannel != s)
+                StartSelect();
+            else
+                StartRegisters();
+            return false;
+        }
+        return false;
+    }
+
+    /* Main loop, while !IsBusy() */
+    inline void Invalidate() { muxChannel = I2C_MUX_NONE; }
+
+    /* Main loop. Inactive sensors are skipped by the round-robin */
+    void SetActive(size_t sensor, bool active)
+    {
+        if (active)
+            activeMask |= 1 << sensor;
+        else
+            activeMask &= ~(1 << sensor);
+        failures[sensor] = 0;
+    }
+    inline bool IsActive(size_t sensor) const { return (activeMask >> sensor) & 1; }
+
+    /* Main loop. Written before that sensor's next poll */
+    bool QueueWrite(size_t sensor, uint16_t reg, uint8_t value)
+    {
+        I2cRegWrite w;
+        w.reg = reg;
+        w.value = value;
+        return sensor < num_sensors && writes[sensor].Push(w);
+    }
+
+    /* Main loop. Room left in a sensor's write queue */
+    inline size_t GetWriteSpace(size_t sensor) const
+    {
+        return I2C_WRITE_QUEUE_SIZE - 1 - writes[sensor].Size();
+    }
+
+    /*
+      Main loop, while !IsBusy() so no chain is popping. Drops the writes
+      still queued for a sensor, e.g. one that was lost before they went out
+    */
+    void FlushWrites(size_t sensor)
+    {
+        while (writes[sensor].Peek() != NULL)
+            writes[sensor].Pop();
+    }
+
+    /* Main loop. Newest sample since the last call, false if none */
+    bool TakeSample(size_t sensor, uint8_t &range, uint8_t &status, uint32_t &timeUs)
+    {
+        uint32_t count;
+        do
+        {
+            count = sampleCount[sensor];
+            range = sample[sensor];
+            status = sampleStatus[sensor];
+            timeUs = sampleUs[sensor];
+        } while (count != sampleCount[sensor]);
+
+        if (count == takenCount[sensor])
+            return false;
+        takenCount[sensor] = count;
+        return true;
+    }
+
+    /* Devices 0 .. num_sensors - 1 are the sensors, num_sensors the mux */
+    inline size_t NumDevices() const { return NUM_DEVICES; }
+    inline const uint32_t *GetLatencyHistogram(size_t device) const { return latency[device]; }
+    inline uint32_t GetErrors(size_t device) const { return errors[device]; }
+    inline uint8_t GetFailures(size_t device) const { return failures[device]; }
+};
@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+/* Bump when the layout or the ParamId numbering changes, older dumps are rejected */
+#define INSTRUMENT_STATE_VERSION 5
+
+struct RodState
+{
+    uint8_t harmonic;
+    uint8_t waveform;
+    uint8_t lfoTarget;
+    uint8_t lfoSync;
+    uint8_t seqMode;
+    uint8_t reserved[3];
+};
+
+/* Distance sensor readings (mm) that map to 0 and 1 */
+struct SensorCalibration
+{
+    float minRange;
+    float maxRange;
+};
+
+/*
+  Everything needed to restore the instrument, flat and POD so it can be
+  sent over SysEx or written to flash byte for byte.
+*/
+struct InstrumentState
+{
+    uint32_t version;
+    float pitchBendRange;
+    VoicePool pools[NUM_MIDI_CHANNELS];
+    RodState rods[NUM_RODS];
+    SensorCalibration calibration[NUM_SENSORS];
+    uint32_t sensorProfile;
+    uint32_t numModSlots;
+    ModSlot modSlots[MAX_MOD_SLOTS];
+    CcRoutingTable routing;
+};
@@ -0,0 +1,140 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#define MIDI_CLOCKS_PER_BEAT 24
+
+/* LFO sync divisions in beats per LFO cycle. Index 0 is free running */
+#define LFO_SYNC_FREE 0
+#define NUM_LFO_SYNC_DIVISIONS 8
+static const float lfoSyncBeats[NUM_LFO_SYNC_DIVISIONS] = {
+    0.f,       // free
+    4.f,       // 1 bar
+    2.f,       // 1/2
+    1.f,       // 1/4
+    0.5f,      // 1/8
+    1.f / 3.f, // 1/8 triplet
+    0.25f,     // 1/16
+    0.125f,    // 1/32
+};
+
+/*
+  Tempo and beat position from incoming MIDI clock.
+
+  Runs a second order delay-locked loop on the receive timestamps of the
+  0xF8 ticks rather than on when the main loop gets round to them, so the
+  estimate survives main loop stalls and averages out UART and sender
+  jitter. The audio callback reads the beat position extrapolated to the
+  start of its block.
+*/
+class MidiClock
+{
+private:
+    /* Loop gains, settle over roughly a beat */
+    static constexpr float kPhaseGain = 0.1f;
+    static constexpr float kPeriodGain = 0.005f;
+
+    /* Written by the main loop with IRQs blocked, read by the audio callback */
+    volatile bool running;
+    volatile bool locked;
+    /* Ticks received since Start */
+    volatile uint32_t ticks;
+    /* Where tick number `ticks` is expected */
+    volatile uint32_t predictedUs;
+    volatile float periodUs;
+
+    bool haveLast;
+    uint32_t lastUs;
+    float sampleRate;
+
+public:
+    MidiClock(){};
+    ~MidiClock(){};
+
+    void Init(float sample_rate)
+    {
+        sampleRate = sample_rate;
+        running = false;
+        locked = false;
+        ticks = 0;
+        predictedUs = 0;
+        /* 120 BPM until told otherwise */
+        periodUs = 60000000.f / (120.f * MIDI_CLOCKS_PER_BEAT);
+        haveLast = false;
+        lastUs = 0;
+    }
+
+    /* Main loop, with the tick's receive timestamp */
+    void OnClock(uint32_t timeUs)
+    {
+        ScopedIrqBlocker block;
+        ticks++;
+
+        if (!locked)
+        {
+            /* Two ticks give the first period estimate */
+            if (haveLast && timeUs != lastUs)
+            {
+                periodUs = float(timeUs - lastUs);
+                predictedUs = timeUs + uint32_t(periodUs);
+                locked = true;
+            }
+            haveLast = true;
+            lastUs = timeUs;
+            return;
+        }
+
+        float error = float(int32_t(timeUs - predictedUs));
+
+        /* Clock paused or jumped, start over instead of slewing */
+        if (error > periodUs * 4.f || error < -periodUs)
+        {
+            locked = false;
+            lastUs = timeUs;
+            return;
+        }
+
+        periodUs = periodUs + kPeriodGain * error;
+        predictedUs = predictedUs + uint32_t(periodUs + kPhaseGain * error);
+        lastUs = timeUs;
+    }
+
+    /* Main loop. The next tick is beat 0 */
+    void OnStart()
+    {
+        ScopedIrqBlocker block;
+        running = true;
+        ticks = 0;
+    }
+
+    void OnContinue()
+    {
+        running = true;
+    }
+
+    void OnStop()
+    {
+        running = false;
+    }
+
+    /* True while synced LFOs should follow the clock */
+    inline bool IsRunning() const { return running && locked; }
+
+    float GetBpm() const
+    {
+        return 60000000.f / (periodUs * MIDI_CLOCKS_PER_BEAT);
+    }
+
+    /* Audio callback. Beats since Start, extrapolated to nowUs */
+    float GetBeatPosition(uint32_t nowUs) const
+    {
+        float sincePredicted = float(int32_t(nowUs - predictedUs)) / periodUs;
+        return (float(ticks) + sincePredicted) / MIDI_CLOCKS_PER_BEAT;
+    }
+
+    /* Audio callback. LFO cycles per sample for a cycle of `beats` */
+    float GetCyclesPerSample(float beats) const
+    {
+        return 1000000.f / (periodUs * MIDI_CLOCKS_PER_BEAT * beats * sampleRate);
+    }
+};
@@ -0,0 +1,166 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#define MIDI_NUM_CHANNELS 16
+#define MIDI_NUM_CCS 128
+/* Distinct controllers that can be pending between two flushes */
+#define MAX_PENDING_CC 32
+
+/*
+  Drains every pending event from the MIDI UART into the MidiQueue.
+
+  Control changes are not forwarded one by one: only the latest value per
+  channel and controller is kept while draining a run of CCs, and the
+  coalesced set is pushed when the run ends, i.e. before any other event
+  and at the end of the pass. A fast CC sweep therefore costs one ADSR
+  update per pass instead of one per message, while a CC sent before a
+  note (legato, glide time, routed CCs) still reaches the audio callback
+  before that note.
+
+  Clock, start, stop and continue go straight to the MidiClock with their
+  receive time and never reach the audio queue.
+*/
+class MidiInput
+{
+private:
+    MidiUart *midi;
+    MidiQueue *queue;
+    MidiClock *clock;
+
+    uint8_t ccValues[MIDI_NUM_CHANNELS][MIDI_NUM_CCS];
+    uint32_t ccTimes[MIDI_NUM_CHANNELS][MIDI_NUM_CCS];
+    bool ccPending[MIDI_NUM_CHANNELS][MIDI_NUM_CCS];
+    /* channel << 7 | cc, in arrival order */
+    uint16_t pendingList[MAX_PENDING_CC];
+    size_t numPending;
+
+    uint32_t eventsReceived;
+    uint32_t eventsCoalesced;
+    uint32_t eventsDropped;
+
+    void Forward(const MidiEvent &m, uint32_t timeUs)
+    {
+        if (!queue->Push(m, timeUs))
+        {
+            eventsDropped++;
+        }
+    }
+
+    void StoreControlChange(const MidiEvent &m, uint32_t timeUs)
+    {
+        uint8_t channel = m.channel & 0x0F;
+        uint8_t cc = m.data[0] & 0x7F;
+
+        if (ccPending[channel][cc])
+        {
+            eventsCoalesced++;
+        }
+        else
+        {
+            if (numPending >= MAX_PENDING_CC)
+            {
+                FlushControlChanges();
+            }
+            ccPending[channel][cc] = true;
+            pendingList[numPending++] = (channel << 7) | cc;
+        }
+
+        ccValues[channel][cc] = m.data[1];
+        ccTimes[channel][cc] = timeUs;
+    }
+
+    void HandleRealtime(const MidiEvent &m, uint32_t timeUs)
+    {
+        switch (m.srt_type)
+        {
+        case TimingClock:
+            clock->OnClock(timeUs);
+            break;
+        case Start:
+            clock->OnStart();
+            break;
+        case Continue:
+            clock->OnContinue();
+            break;
+        case Stop:
+            clock->OnStop();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void FlushControlChanges()
+    {
+        MidiEvent m;
+        m.type = ControlChange;
+        m.srt_type = TimingClock;
+        for (size_t i = 0; i < numPending; i++)
+        {
+            uint8_t channel = pendingList[i] >> 7;
+            uint8_t cc = pendingList[i] & 0x7F;
+            m.channel = channel;
+            m.data[0] = cc;
+            m.data[1] = ccValues[channel][cc];
+            ccPending[channel][cc] = false;
+            Forward(m, ccTimes[channel][cc]);
+        }
+        numPending = 0;
+    }
+
+public:
+    MidiInput(){};
+    ~MidiInput(){};
+
+    void Init(MidiUart *_midi, MidiQueue *_queue, MidiClock *_clock)
+    {
+        midi = _midi;
+        queue = _queue;
+        clock = _clock;
+        numPending = 0;
+        eventsReceived = 0;
+        eventsCoalesced = 0;
+        eventsDropped = 0;
+        for (size_t c = 0; c < MIDI_NUM_CHANNELS; c++)
+        {
+            for (size_t i = 0; i < MIDI_NUM_CCS; i++)
+            {
+                ccValues[c][i] = 0;
+                ccTimes[c][i] = 0;
+                ccPending[c][i] = false;
+            }
+        }
+    }
+
+    /* Main loop, once per pass */
+    void Process()
+    {
+        MidiEvent m;
+        uint32_t timeUs;
+        while (midi->PopEvent(m, timeUs))
+        {
+            eventsReceived++;
+
+            if (m.type == ControlChange)
+            {
+                StoreControlChange(m, timeUs);
+            }
+            else if (m.type == SystemRealTime)
+            {
+                HandleRealtime(m, timeUs);
+            }
+            else
+            {
+                /* Keep CCs ahead of whatever followed them */
+                FlushControlChanges();
+                Forward(m, timeUs);
+            }
+        }
+        FlushControlChanges();
+    }
+
+    uint32_t GetEventsReceived() const { return eventsReceived; }
+    uint32_t GetEventsCoalesced() const { return eventsCoalesced; }
+    uint32_t GetEventsDropped() const { return eventsDropped; }
+};
@@ -0,0 +1,164 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+/* CC numbers for rod 1, rods 2-4 follow */
+#define MIDI_OUT_ROTATION_CC 20
+#define MIDI_OUT_RANGE_CC 24
+/* At most one CC per controller in this window */
+#define MIDI_OUT_CC_INTERVAL_US 10000
+/* Rotation speed (rev/s) that maps to CC 127 */
+#define MIDI_OUT_MAX_ROTATION 4.f
+
+/*
+  Sends rod gestures to other gear: rotation speed and range of each rod
+  as CCs, and MIDI clock from one rod's rotation (one revolution = one
+  quarter note, 24 clocks). CCs are only sent when the 7-bit value
+  changes and no more often than MIDI_OUT_CC_INTERVAL_US per controller,
+  which keeps the stream well inside the 31250 baud budget.
+
+  While held (e.g. during an outgoing SysEx dump, which any channel
+  status byte would end early) only realtime clock bytes are sent; CCs
+  that changed in the meantime go out once released.
+*/
+template <size_t num_rods>
+class MidiOutput
+{
+private:
+    MidiUart *uart;
+    uint8_t channel;
+
+    uint8_t lastRotation[num_rods];
+    uint8_t lastRange[num_rods];
+    uint32_t lastRotationUs[num_rods];
+    uint32_t lastRangeUs[num_rods];
+    /* Changed value waiting out the interval, 0xFF if none */
+    uint8_t waitingRotation[num_rods];
+    uint8_t waitingRange[num_rods];
+
+    bool held;
+
+    int clockRod;
+    bool clockRunning;
+    uint32_t nextClockUs;
+
+    /* Value changes that were never sent, each counted once */
+    uint32_t ccSuppressed;
+
+    void SendRealtime(uint8_t status)
+    {
+        uart->Send(&status, 1);
+    }
+
+    void MaybeSendCc(uint8_t cc, uint8_t value, uint8_t &last, uint8_t &waiting, uint32_t &lastUs, uint32_t now)
+    {
+        /* A waiting change is lost when another value replaces it */
+        if (waiting != 0xFF && waiting != value)
+        {
+            ccSuppressed++;
+            waiting = 0xFF;
+        }
+        if (value == last)
+            return;
+        if (now - lastUs < MIDI_OUT_CC_INTERVAL_US)
+        {
+            waiting = value;
+            return;
+        }
+
+        uint8_t msg[3] = {uint8_t(0xB0 | channel), cc, value};
+        if (uart->Send(msg, 3))
+        {
+            last = value;
+            lastUs = now;
+            waiting = 0xFF;
+        }
+    }
+
+    void ProcessClock(float revPerSec, uint32_t now)
+    {
+        if (revPerSec <= 0.f)
+        {
+            if (clockRunning)
+            {
+                SendRealtime(0xFC); // Stop
+                clockRunning = false;
+            }
+            return;
+        }
+
+        uint32_t interval = uint32_t(1000000.f / (revPerSec * 24.f));
+        if (!clockRunning)
+        {
+            SendRealtime(0xFA); // Start
+            clockRunning = true;
+            nextClockUs = now;
+        }
+
+        /* Resync instead of bursting if the main loop stalled */
+        if (int32_t(now - nextClockUs) > int32_t(interval * 4))
+        {
+            nextClockUs = now;
+        }
+
+        while (int32_t(now - nextClockUs) >= 0)
+        {
+            SendRealtime(0xF8); // Timing clock
+            nextClockUs += interval;
+        }
+    }
+
+public:
+    MidiOutput(){};
+    ~MidiOutput(){};
+
+    void Init(MidiUart *_uart, uint8_t _channel = 0)
+    {
+        uart = _uart;
+        channel = _channel & 0x0F;
+        held = false;
+        clockRod = 0;
+        clockRunning = false;
+        nextClockUs = 0;
+        ccSuppressed = 0;
+        for (size_t i = 0; i < num_rods; i++)
+        {
+            /* Out of the 7-bit range so the first value always goes out */
+            lastRotation[i] = lastRange[i] = 0xFF;
+            lastRotationUs[i] = lastRangeUs[i] = 0;
+            waitingRotation[i] = waitingRange[i] = 0xFF;
+        }
+    }
+
+    /* Main loop. Hold back channel messages, realtime still goes out */
+    void SetHold(bool hold)
+    {
+        held = hold;
+    }
+
+    /* -1 disables the clock */
+    void SetClockRod(int rod)
+    {
+        clockRod = rod;
+    }
+
+    /* Main loop. rotation in rev/s, range 0-1 */
+    void Process(const float *rotation, const float *range)
+    {
+        uint32_t now = System::GetUs();
+        for (size_t i = 0; i < num_rods && !held; i++)
+        {
+            uint8_t rot = uint8_t(fclamp(rotation[i] / MIDI_OUT_MAX_ROTATION, 0.f, 1.f) * 127.f);
+            uint8_t rng = uint8_t(fclamp(range[i], 0.f, 1.f) * 127.f);
+            MaybeSendCc(MIDI_OUT_ROTATION_CC + i, rot, lastRotation[i], waitingRotation[i], lastRotationUs[i], now);
+            MaybeSendCc(MIDI_OUT_RANGE_CC + i, rng, lastRange[i], waitingRange[i], lastRangeUs[i], now);
+        }
+
+        if (clockRod >= 0 && clockRod < int(num_rods))
+        {
+            ProcessClock(rotation[clockRod], now);
+        }
+    }
+
+    uint32_t GetCcSuppressed() const { return ccSuppressed; }
+};
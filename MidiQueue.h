@@ -0,0 +1,99 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#define MIDI_QUEUE_SIZE 64
+/* Receive-to-playback delay. Covers a normal main loop pass, not a sensor bus recovery */
+#define MIDI_LATENCY_US 1000
+
+/* Compact copy of a channel/realtime MidiEvent plus its receive time */
+struct TimedMidiEvent
+{
+    uint32_t timeUs;
+    uint8_t type;
+    uint8_t channel;
+    uint8_t data[2];
+    uint8_t srtType;
+};
+
+/*
+  Hands MIDI events from the main loop to the audio callback.
+
+  Events are timestamped in microseconds when their last byte arrives.
+  The audio callback plays each event MIDI_LATENCY_US after that, at the
+  matching frame of whichever block it falls in, so note timing is sample
+  accurate with a fixed latency instead of jittering to the next block
+  boundary. Events not yet due stay queued for a later block.
+
+  The main loop only has to hand an event over within MIDI_LATENCY_US of
+  its arrival. One that is later than that plays at frame 0 of the next
+  block: late, but still in order.
+*/
+class MidiQueue
+{
+private:
+    SpscRing<TimedMidiEvent, MIDI_QUEUE_SIZE> ring;
+
+    float samplesPerUs;
+    /* Start of the current audio block, audio side only */
+    uint32_t blockUs;
+
+public:
+    MidiQueue(){};
+    ~MidiQueue(){};
+
+    void Init(float sample_rate)
+    {
+        samplesPerUs = sample_rate / 1000000.f;
+        blockUs = System::GetUs();
+    }
+
+    /* Main loop. Returns false if the queue is full and the event was dropped */
+    bool Push(const MidiEvent &m, uint32_t timeUs)
+    {
+        TimedMidiEvent e;
+        e.timeUs = timeUs;
+        e.type = uint8_t(m.type);
+        e.channel = uint8_t(m.channel);
+        e.data[0] = m.data[0];
+        e.data[1] = m.data[1];
+        e.srtType = uint8_t(m.srt_type);
+        return ring.Push(e);
+    }
+
+    /* Audio callback, once at the top of every block */
+    void BeginBlock()
+    {
+        blockUs = System::GetUs();
+    }
+
+    /*
+      Frame of the current block at which something received at timeUs
+      plays. blockFrames or more means a later block.
+    */
+    size_t FrameOffset(uint32_t timeUs, size_t blockFrames) const
+    {
+        int32_t sinceBlock = int32_t(timeUs + MIDI_LATENCY_US - blockUs);
+        if (sinceBlock <= 0)
+            return 0;
+
+        size_t frame = size_t(sinceBlock * samplesPerUs);
+        return frame < blockFrames ? frame : blockFrames;
+    }
+
+    /* Audio callback. Pops the next event due at or before frame */
+    bool PopDue(size_t frame, size_t blockFrames, MidiEvent &m)
+    {
+        const TimedMidiEvent *e = ring.Peek();
+        if (e == NULL || FrameOffset(e->timeUs, blockFrames) > frame)
+            return false;
+
+        m.type = MidiMessageType(e->type);
+        m.channel = e->channel;
+        m.data[0] = e->data[0];
+        m.data[1] = e->data[1];
+        m.srt_type = SystemRealTimeType(e->srtType);
+        ring.Pop();
+        return true;
+    }
+};
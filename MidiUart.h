@@ -0,0 +1,210 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#define MIDI_RX_DMA_SIZE 64
+#define MIDI_RX_RING_SIZE 256
+#define MIDI_TX_RING_SIZE 256
+/* Largest chunk handed to one DMA transfer */
+#define MIDI_TX_DMA_SIZE 32
+
+/* DMA buffers must live in D2 SRAM */
+static uint8_t DMA_BUFFER_MEM_SECTION midiRxDmaBuffer[MIDI_RX_DMA_SIZE];
+static uint8_t DMA_BUFFER_MEM_SECTION midiTxDmaBuffer[MIDI_TX_DMA_SIZE];
+
+/* One received byte and when it arrived */
+struct TimedMidiByte
+{
+    uint32_t timeUs;
+    uint8_t byte;
+};
+
+/*
+  MIDI over USART1 (D13 TX, D14 RX) without blocking in either direction.
+
+  Replaces MidiUartHandler, whose SendMessage blocks until the UART has
+  shifted every byte out. Received bytes are timestamped in the DMA
+  callback and parsed in the main loop. Outgoing messages go into a byte
+  ring that is drained by chained DMA transfers; the main loop only ever
+  copies bytes into the ring.
+
+  With a SysexDecoder attached, SysEx bytes bypass the MidiParser (whose
+  SysEx buffer is far too small for a state dump) and are decoded as they
+  are popped. Realtime bytes inside a SysEx message still reach the parser.
+*/
+class MidiUart
+{
+private:
+    UartHandler uart;
+    MidiParser parser;
+    SysexDecoder *sysex;
+    bool inSysex;
+    SensorCapture *capture;
+
+    SpscRing<TimedMidiByte, MIDI_RX_RING_SIZE> rxRing;
+    SpscRing<uint8_t, MIDI_TX_RING_SIZE> txRing;
+    volatile bool txBusy;
+
+    uint32_t rxOverflows;
+    uint32_t txQueued;
+    uint32_t txDropped;
+
+    static void RxCallback(uint8_t *data, size_t size, void *context, UartHandler::Result res)
+    {
+        MidiUart *self = (MidiUart *)context;
+        if (res != UartHandler::Result::OK)
+            return;
+
+        uint32_t now = System::GetUs();
+        for (size_t i = 0; i < size; i++)
+        {
+            TimedMidiByte b;
+            b.timeUs = now;
+            b.byte = data[i];
+            if (!self->rxRing.Push(b))
+                self->rxOverflows++;
+        }
+    }
+
+    static void TxEndCallback(void *context, UartHandler::Result res)
+    {
+        MidiUart *self = (MidiUart *)context;
+        self->txBusy = false;
+        self->StartTx();
+    }
+
+    /* Called from the main loop when idle, or from the TX end interrupt */
+    void StartTx()
+    {
+        size_t count = 0;
+        while (count < MIDI_TX_DMA_SIZE && txRing.Pop(midiTxDmaBuffer[count]))
+        {
+            count++;
+        }
+        if (count == 0)
+            return;
+
+        txBusy = true;
+        if (uart.DmaTransmit(midiTxDmaBuffer, count, NULL, TxEndCallback, this) != UartHandler::Result::OK)
+        {
+            txBusy = false;
+        }
+    }
+
+public:
+    MidiUart(){};
+    ~MidiUart(){};
+
+    void Init()
+    {
+        UartHandler::Config config;
+        config.periph = UartHandler::Config::Peripheral::USART_1;
+        config.mode = UartHandler::Config::Mode::TX_RX;
+        config.baudrate = 31250;
+        config.stopbits = UartHandler::Config::StopBits::BITS_1;
+        config.parity = UartHandler::Config::Parity::NONE;
+        config.wordlength = UartHandler::Config::WordLength::BITS_8;
+        config.pin_config.tx = {DSY_GPIOB, 6};
+        config.pin_config.rx = {DSY_GPIOB, 7};
+        uart.Init(config);
+        parser.Init();
+        sysex = NULL;
+        inSysex = false;
+        capture = NULL;
+
+        txBusy = false;
+        rxOverflows = 0;
+        txQueued = 0;
+        txDropped = 0;
+    }
+
+    void StartReceive()
+    {
+        uart.DmaListenStart(midiRxDmaBuffer, MIDI_RX_DMA_SIZE, RxCallback, this);
+    }
+
+    void SetSysexDecoder(SysexDecoder *decoder)
+    {
+        sysex = decoder;
+    }
+
+    /* Received bytes are recorded as they are parsed */
+    void SetCapture(SensorCapture *_capture)
+    {
+        capture = _capture;
+    }
+
+    /* Main loop. Parses buffered bytes until one complete event is found */
+    bool PopEvent(MidiEvent &event, uint32_t &timeUs)
+    {
+        TimedMidiByte b;
+        while (rxRing.Pop(b))
+        {
+            if (capture != NULL)
+                capture->RecordMain(CAPTURE_MIDI, 0, b.byte, b.timeUs);
+            if (sysex != NULL && b.byte < 0xF8)
+            {
+                if (b.byte == 0xF0)
+                {
+                    sysex->Begin();
+                    inSysex = true;
+                    continue;
+                }
+                if (inSysex)
+                {
+                    if (b.byte == 0xF7)
+                    {
+                        sysex->End();
+                        inSysex = false;
+                        continue;
+                    }
+                    if (b.byte < 0x80)
+                    {
+                        sysex->Feed(b.byte);
+                        continue;
+                    }
+                    /* Any other status byte ends the message early */
+                    sysex->Abort();
+                    inSysex = false;
+                }
+            }
+
+            if (parser.Parse(b.byte, &event))
+            {
+                timeUs = b.timeUs;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Main loop only. Queues a whole message or nothing */
+    bool Send(const uint8_t *bytes, size_t size)
+    {
+        if (GetTxFree() < size)
+        {
+            txDropped++;
+            return false;
+        }
+        for (size_t i = 0; i < size; i++)
+        {
+            txRing.Push(bytes[i]);
+        }
+        txQueued++;
+
+        if (!txBusy)
+        {
+            ScopedIrqBlocker block;
+            if (!txBusy)
+                StartTx();
+        }
+        return true;
+    }
+
+    /* Bytes Send() can accept right now */
+    size_t GetTxFree() const { return MIDI_TX_RING_SIZE - 1 - txRing.Size(); }
+
+    uint32_t GetRxOverflows() const { return rxOverflows; }
+    uint32_t GetTxQueued() const { return txQueued; }
+    uint32_t GetTxDropped() const { return txDropped; }
+};
@@ -0,0 +1,245 @@
+#include "daisy_seed.h"
+#include <math.h>
+#include <stdint.h>
+
+using namespace daisy;
+
+#define MAX_MOD_SLOTS 16
+/* Slot source/destination applies to every rod */
+#define MOD_ALL_RODS 0xFF
+
+enum ModSource
+{
+    MOD_SRC_ROTATION, // rotation speed, 0-1
+    MOD_SRC_RANGE,    // distance sensor, 0-1
+    MOD_SRC_ENCODER,  // harmonic, 0-1
+    MOD_SRC_ENVELOPE, // loudest voice envelope
+    MOD_SRC_VELOCITY, // last note-on velocity
+    MOD_SRC_CC,       // PARAM_MOD_CC
+    MOD_SRC_LFO,      // rod LFO, -1 to 1
+    MOD_SRC_COUNT,
+};
+
+enum ModDestination
+{
+    MOD_DST_PITCH,      // semitones, summed over rods
+    MOD_DST_CUTOFF,     // octaves
+    MOD_DST_RESONANCE,  // added to 0-1 resonance
+    MOD_DST_GAIN,       // added to 0-1 rod gain
+    MOD_DST_PAN,        // -1 left to 1 right
+    MOD_DST_LFO_RATE,   // ratio offset, 1 = double speed
+    MOD_DST_LFO_DEPTH,  // added to 0-1 depth
+    MOD_DST_DRIVE,      // shaper drive, 0 = off
+    MOD_DST_COUNT,
+};
+
+struct ModSlot
+{
+    uint8_t source;
+    uint8_t sourceRod; // rod to read from, MOD_ALL_RODS = same rod as destination
+    uint8_t dest;
+    uint8_t destRod; // MOD_ALL_RODS = every rod
+    float amount;
+};
+
+/* Largest useful amount per destination, in its own units */
+inline float ModAmountRange(uint8_t dest)
+{
+    switch (dest)
+    {
+    case MOD_DST_PITCH:
+        return 12.0f;
+    case MOD_DST_CUTOFF:
+        return 4.0f;
+    case MOD_DST_LFO_RATE:
+        return 2.0f;
+    default:
+        return 1.0f;
+    }
+}
+
+/*
+  Fixed-size modulation matrix evaluated once per audio block.
+
+  Slots are kept packed at the front of the array so evaluation only
+  visits the active ones; an empty matrix costs a single compare.
+  Destinations are offsets on top of the rods' built-in behaviour
+  (rotation -> LFO, range -> cutoff or gain).
+*/
+template <size_t num_rods>
+class ModMatrix
+{
+private:
+    ModSlot slots[MAX_MOD_SLOTS];
+    size_t numSlots;
+
+    float sources[num_rods][MOD_SRC_COUNT];
+    float dests[num_rods][MOD_DST_COUNT];
+
+    /* One more evaluation is needed to zero destinations after a removal */
+    bool needsClear;
+
+    uint32_t lastEvalTicks;
+    uint32_t maxEvalTicks;
+
+    /* Slots can come from a SysEx dump or flash, and index arrays in Evaluate() */
+    static bool IsValid(const ModSlot &s)
+    {
+        return s.source < MOD_SRC_COUNT && s.dest < MOD_DST_COUNT &&
+               (s.sourceRod < num_rods || s.sourceRod == MOD_ALL_RODS) &&
+               (s.destRod < num_rods || s.destRod == MOD_ALL_RODS) &&
+               isfinite(s.amount);
+    }
+
+public:
+    ModMatrix(){};
+    ~ModMatrix(){};
+
+    void Init()
+    {
+        numSlots = 0;
+        needsClear = false;
+        lastEvalTicks = 0;
+        maxEvalTicks = 0;
+        for (size_t r = 0; r < num_rods; r++)
+        {
+            for (size_t s = 0; s < MOD_SRC_COUNT; s++)
+                sources[r][s] = 0.0f;
+            for (size_t d = 0; d < MOD_DST_COUNT; d++)
+                dests[r][d] = 0.0f;
+        }
+    }
+
+    /* Returns the slot index, or -1 if the matrix is full or the slot invalid */
+    int AddSlot(ModSource source, uint8_t sourceRod, ModDestination dest, uint8_t destRod, float amount)
+    {
+        ModSlot s;
+        s.source = source;
+        s.sourceRod = sourceRod;
+        s.dest = dest;
+        s.destRod = destRod;
+        s.amount = amount;
+        if (numSlots >= MAX_MOD_SLOTS || !IsValid(s))
+            return -1;
+
+        slots[numSlots] = s;
+        return numSlots++;
+    }
+
+    /*
+      Replaces slot idx, or appends when idx is past the last slot.
+      Returns the slot's index, or -1 if the matrix is full.
+    */
+    int SetSlot(size_t idx, const ModSlot &slot)
+    {
+        if (idx >= numSlots)
+            return AddSlot(ModSource(slot.source), slot.sourceRod, ModDestination(slot.dest), slot.destRod, slot.amount);
+        if (!IsValid(slot))
+            return -1;
+        slots[idx] = slot;
+        return idx;
+    }
+
+    void SetAmount(size_t idx, float amount)
+    {
+        if (idx < numSlots && isfinite(amount))
+            slots[idx].amount = amount;
+    }
+
+    /* Moves the last slot into the gap, so slot indices can change */
+    void RemoveSlot(size_t idx)
+    {
+        if (idx >= numSlots)
+            return;
+        slots[idx] = slots[--numSlots];
+        needsClear = true;
+    }
+
+    void Clear()
+    {
+        numSlots = 0;
+        needsClear = true;
+    }
+
+    inline size_t NumSlots() const { return numSlots; }
+    inline const ModSlot *GetSlots() const { return slots; }
+
+    /*
+      Replace every slot, e.g. from a state dump. Slots that are out of
+      range are dropped. Returns how many were.
+    */
+    size_t LoadSlots(const ModSlot *newSlots, size_t count)
+    {
+        if (count > MAX_MOD_SLOTS)
+            count = MAX_MOD_SLOTS;
+        numSlots = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (IsValid(newSlots[i]))
+                slots[numSlots++] = newSlots[i];
+        }
+        needsClear = true;
+        return count - numSlots;
+    }
+
+    /* True if Evaluate() would change anything */
+    inline bool IsActive() const { return numSlots > 0 || needsClear; }
+
+    inline void SetSource(size_t rod, ModSource source, float value) { sources[rod][source] = value; }
+
+    /* Same value for every rod (envelope, velocity, CC) */
+    void SetGlobalSource(ModSource source, float value)
+    {
+        for (size_t r = 0; r < num_rods; r++)
+            sources[r][source] = value;
+    }
+
+    void Evaluate()
+    {
+        uint32_t start = System::GetTick();
+
+        for (size_t r = 0; r < num_rods; r++)
+        {
+            for (size_t d = 0; d < MOD_DST_COUNT; d++)
+                dests[r][d] = 0.0f;
+        }
+
+        for (size_t i = 0; i < numSlots; i++)
+        {
+            const ModSlot &s = slots[i];
+            if (s.destRod == MOD_ALL_RODS)
+            {
+                for (size_t r = 0; r < num_rods; r++)
+                {
+                    size_t from = s.sourceRod == MOD_ALL_RODS ? r : s.sourceRod;
+                    dests[r][s.dest] += sources[from][s.source] * s.amount;
+                }
+            }
+            else if (s.destRod < num_rods)
+            {
+                size_t from = s.sourceRod == MOD_ALL_RODS ? s.destRod : s.sourceRod;
+                dests[s.destRod][s.dest] += sources[from][s.source] * s.amount;
+            }
+        }
+        needsClear = false;
+
+        lastEvalTicks = System::GetTick() - start;
+        if (lastEvalTicks > maxEvalTicks)
+            maxEvalTicks = lastEvalTicks;
+    }
+
+    inline const float *GetDestinations(size_t rod) const { return dests[rod]; }
+
+    /* Pitch is per voice, so rods' pitch offsets are summed */
+    float GetPitchSemitones() const
+    {
+        float sum = 0.0f;
+        for (size_t r = 0; r < num_rods; r++)
+            sum += dests[r][MOD_DST_PITCH];
+        return sum;
+    }
+
+    /* Evaluation cost of the last / worst tick */
+    float GetLastEvalUs() const { return lastEvalTicks * 1000000.f / System::GetTickFreq(); }
+    float GetMaxEvalUs() const { return maxEvalTicks * 1000000.f / System::GetTickFreq(); }
+};
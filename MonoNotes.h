@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <math.h>
+
+enum NotePriority
+{
+    PRIORITY_LAST,
+    PRIORITY_LOW,
+    PRIORITY_HIGH,
+    PRIORITY_COUNT,
+};
+
+/*
+  Keys held on one channel. Press order is a doubly linked list threaded
+  through per-note arrays and lowest / highest come from a 128-bit map, so
+  push, remove and every priority lookup are O(1).
+*/
+class NoteStack
+{
+private:
+    static constexpr uint8_t NONE = 0xFF;
+
+    uint8_t prev[128];
+    uint8_t next[128];
+    uint32_t bits[4];
+    uint8_t head;
+    uint8_t tail;
+
+    inline bool IsHeld(uint8_t note) const { return (bits[note >> 5] >> (note & 31)) & 1; }
+
+public:
+    NoteStack(){};
+    ~NoteStack(){};
+
+    void Init()
+    {
+        head = tail = NONE;
+        for (size_t i = 0; i < 4; i++)
+            bits[i] = 0;
+    }
+
+    inline bool IsEmpty() const { return tail == NONE; }
+
+    /* A key pressed again moves to the top */
+    void Push(uint8_t note)
+    {
+        note &= 0x7F;
+        if (IsHeld(note))
+            Remove(note);
+
+        prev[note] = tail;
+        next[note] = NONE;
+        if (tail != NONE)
+            next[tail] = note;
+        else
+            head = note;
+        tail = note;
+        bits[note >> 5] |= 1u << (note & 31);
+    }
+
+    void Remove(uint8_t note)
+    {
+        note &= 0x7F;
+        if (!IsHeld(note))
+            return;
+
+        if (prev[note] != NONE)
+            next[prev[note]] = next[note];
+        else
+            head = next[note];
+        if (next[note] != NONE)
+            prev[next[note]] = prev[note];
+        else
+            tail = prev[note];
+        bits[note >> 5] &= ~(1u << (note & 31));
+    }
+
+    /* -1 if nothing is held */
+    int Get(int priority) const
+    {
+        if (IsEmpty())
+            return -1;
+
+        switch (priority)
+        {
+        case PRIORITY_LOW:
+            for (int w = 0; w < 4; w++)
+            {
+                if (bits[w])
+                    return w * 32 + __builtin_ctz(bits[w]);
+            }
+            return -1;
+        case PRIORITY_HIGH:
+            for (int w = 3; w >= 0; w--)
+            {
+                if (bits[w])
+                    return w * 32 + 31 - __builtin_clz(bits[w]);
+            }
+            return -1;
+        default:
+            return tail;
+        }
+    }
+};
+
+/*
+  Note stacks and glides for channels whose pool has a polyphony of one.
+  Glides are a voice bend ratio moving back to 1 exponentially, updated
+  once per block and ramped across it like MPE pitch bend.
+*/
+template <size_t max_voices>
+class MonoNotes
+{
+private:
+    NoteStack stacks[NUM_MIDI_CHANNELS];
+    /* Note the channel's voice is playing, -1 if released */
+    int sounding[NUM_MIDI_CHANNELS];
+
+    float sampleRate;
+    size_t blockFrames;
+
+    float glideRatio[max_voices];
+    float glideStep[max_voices];
+    uint32_t glideFrames[max_voices];
+
+public:
+    MonoNotes(){};
+    ~MonoNotes(){};
+
+    void Init(float sample_rate, size_t block_frames)
+    {
+        sampleRate = sample_rate;
+        blockFrames = block_frames;
+        for (size_t c = 0; c < NUM_MIDI_CHANNELS; c++)
+        {
+            stacks[c].Init();
+            sounding[c] = -1;
+        }
+        for (size_t v = 0; v < max_voices; v++)
+        {
+            glideRatio[v] = 1.0f;
+            glideStep[v] = 1.0f;
+            glideFrames[v] = 0;
+        }
+    }
+
+    inline NoteStack &Stack(int channel) { return stacks[channel]; }
+    inline int GetSounding(int channel) const { return sounding[channel]; }
+    inline void SetSounding(int channel, int note) { sounding[channel] = note; }
+
+    inline bool IsGliding(size_t voice) const { return glideFrames[voice] > 0; }
+    inline float GetGlideRatio(size_t voice) const { return glideRatio[voice]; }
+
+    /* Start the voice at ratio times its new note and glide to 1 */
+    void StartGlide(size_t voice, float ratio, float seconds)
+    {
+        uint32_t frames = uint32_t(seconds * sampleRate);
+        if (frames == 0 || ratio == 1.0f)
+        {
+            CancelGlide(voice);
+            return;
+        }
+        glideRatio[voice] = ratio;
+        /* Per-block multiplier, so ProcessBlock needs no powf */
+        glideStep[voice] = powf(1.0f / ratio, float(blockFrames) / frames);
+        glideFrames[voice] = frames;
+    }
+
+    void CancelGlide(size_t voice)
+    {
+        glideRatio[voice] = 1.0f;
+        glideFrames[voice] = 0;
+    }
+
+    /*
+      Once per block. bendFn(voice, ratio) sets the bend for the per-rod
+      Oscillator path, phase gets the same ramp for the phase-locked path.
+    */
+    template <typename Phase, typename BendFn>
+    void ProcessBlock(size_t frames, size_t numVoices, Phase &phase, BendFn bendFn)
+    {
+        for (size_t v = 0; v < numVoices; v++)
+        {
+            if (!glideFrames[v])
+                continue;
+
+            float target;
+            if (glideFrames[v] > frames)
+            {
+                glideFrames[v] -= frames;
+                target = glideRatio[v] * glideStep[v];
+            }
+            else
+            {
+                glideFrames[v] = 0;
+                target = 1.0f;
+            }
+            glideRatio[v] = target;
+            phase.RampVoiceBend(v, target, frames);
+            bendFn(v, target);
+        }
+    }
+};
@@ -0,0 +1,235 @@
+#include "daisysp.h"
+#include <math.h>
+
+using namespace daisysp;
+
+/* Where pressure and timbre (CC74) end up */
+enum MpeDestination
+{
+    MPE_DEST_NONE,
+    MPE_DEST_GAIN,
+    MPE_DEST_CUTOFF,
+    MPE_DEST_LFO_DEPTH,
+};
+
+/*
+  Per-note expression for MPE (lower zone: channel 1 is the manager,
+  channels 2-16 are member channels, zero indexed 0 and 1-15).
+
+  MIDI handlers only store the latest value per member channel and mark it
+  dirty. ProcessBlock() runs once per audio block: voices on a dirty
+  channel get new targets that are ramped across the block. Voices whose
+  channel never sent expression are skipped entirely.
+
+  Gain is per voice. The filter and LFO belong to the rods, so those
+  destinations use the strongest value among the expressive voices.
+*/
+template <size_t max_voices>
+class MpeExpression
+{
+private:
+    static constexpr int NO_CHANNEL = -1;
+
+    /* Latest values per member channel */
+    float channelBend[16];
+    float channelPressure[16];
+    float channelTimbre[16];
+    bool channelDirty[16];
+
+    /* Member channel of each voice, NO_CHANNEL if not expressive */
+    int voiceChannel[max_voices];
+    /* Voice left MPE and still carries a per-note bend */
+    bool needsReset[max_voices];
+
+    float gains[max_voices];
+    float gainSteps[max_voices];
+    uint16_t gainFrames[max_voices];
+
+    float pressureValues[max_voices];
+    float timbreValues[max_voices];
+
+    float bendRange;
+    MpeDestination pressureDest;
+    MpeDestination timbreDest;
+
+    float cutoffMod;
+    float lfoDepthMod;
+    bool anyDirty;
+
+    float DestinationValue(MpeDestination dest, size_t voice)
+    {
+        float value = 0.0f;
+        if (pressureDest == dest && pressureValues[voice] > value)
+            value = pressureValues[voice];
+        if (timbreDest == dest && timbreValues[voice] > value)
+            value = timbreValues[voice];
+        return value;
+    }
+
+public:
+    MpeExpression(){};
+    ~MpeExpression(){};
+
+    void Init()
+    {
+        /* MPE default member channel bend range */
+        bendRange = 48.f;
+        pressureDest = MPE_DEST_GAIN;
+        timbreDest = MPE_DEST_CUTOFF;
+        cutoffMod = 1.0f;
+        lfoDepthMod = 0.0f;
+        anyDirty = false;
+
+        for (size_t c = 0; c < 16; c++)
+        {
+            channelBend[c] = 1.0f;
+            channelPressure[c] = 0.0f;
+            /* CC74 rests at 64 */
+            channelTimbre[c] = 0.5f;
+            channelDirty[c] = false;
+        }
+        for (size_t i = 0; i < max_voices; i++)
+        {
+            voiceChannel[i] = NO_CHANNEL;
+            needsReset[i] = false;
+            gains[i] = 1.0f;
+            gainSteps[i] = 0.0f;
+            gainFrames[i] = 0;
+            pressureValues[i] = 0.0f;
+            timbreValues[i] = 0.5f;
+        }
+    }
+
+    void SetBendRange(float semitones) { bendRange = semitones; }
+    void SetPressureDestination(MpeDestination dest) { pressureDest = dest; }
+    void SetTimbreDestination(MpeDestination dest) { timbreDest = dest; }
+
+    static bool IsMemberChannel(int channel)
+    {
+        return channel > 0 && channel < 16;
+    }
+
+    /* value is -8192..8191 */
+    void SetPitchBend(int channel, int value)
+    {
+        float divider = value > 0 ? 8191.f : 8192.f;
+        channelBend[channel] = powf(2.f, value / divider * bendRange / 12.f);
+        channelDirty[channel] = anyDirty = true;
+    }
+
+    void SetPressure(int channel, uint8_t value)
+    {
+        channelPressure[channel] = value / 127.f;
+        channelDirty[channel] = anyDirty = true;
+    }
+
+    void SetTimbre(int channel, uint8_t value)
+    {
+        channelTimbre[channel] = value / 127.f;
+        channelDirty[channel] = anyDirty = true;
+    }
+
+    /* A voice starts a note on channel; it picks up that channel's state */
+    void OnNoteOn(size_t voice, int channel)
+    {
+        if (!IsMemberChannel(channel))
+        {
+            if (voiceChannel[voice] != NO_CHANNEL)
+            {
+                needsReset[voice] = anyDirty = true;
+            }
+            voiceChannel[voice] = NO_CHANNEL;
+            gains[voice] = 1.0f;
+            gainFrames[voice] = 0;
+            pressureValues[voice] = 0.0f;
+            timbreValues[voice] = 0.5f;
+            return;
+        }
+        voiceChannel[voice] = channel;
+        gainFrames[voice] = 0;
+        channelDirty[channel] = anyDirty = true;
+    }
+
+    inline bool HasExpression(size_t voice) const { return voiceChannel[voice] != NO_CHANNEL; }
+
+    /* Per sample, only for voices with HasExpression() */
+    inline float NextGain(size_t voice)
+    {
+        if (gainFrames[voice])
+        {
+            gains[voice] += gainSteps[voice];
+            gainFrames[voice]--;
+        }
+        return gains[voice];
+    }
+
+    inline float GetCutoffMod() const { return cutoffMod; }
+    inline float GetLfoDepthMod() const { return lfoDepthMod; }
+
+    /*
+      Once per audio block. Returns true when the rod-level cutoff / LFO
+      depth changed. Phase is anything with RampVoiceBend(voice, ratio,
+      frames), bendVoice(voice, ratio) is called for the Oscillator path.
+    */
+    template <typename Phase, typename BendFn>
+    bool ProcessBlock(size_t frames, size_t numVoices, Phase &phase, BendFn bendVoice)
+    {
+        if (!anyDirty)
+            return false;
+
+        float maxCutoff = 0.0f;
+        float maxLfo = 0.0f;
+        bool anyExpressive = false;
+
+        for (size_t i = 0; i < numVoices; i++)
+        {
+            int c = voiceChannel[i];
+            if (c == NO_CHANNEL)
+            {
+                if (needsReset[i])
+                {
+                    phase.RampVoiceBend(i, 1.0f, 0);
+                    bendVoice(i, 1.0f);
+                    needsReset[i] = false;
+                }
+                continue;
+            }
+            anyExpressive = true;
+
+            if (channelDirty[c])
+            {
+                phase.RampVoiceBend(i, channelBend[c], frames);
+                bendVoice(i, channelBend[c]);
+
+                pressureValues[i] = channelPressure[c];
+                timbreValues[i] = channelTimbre[c];
+
+                /* No pressure leaves a quarter of the level */
+                float gainTarget = 1.0f;
+                if (pressureDest == MPE_DEST_GAIN || timbreDest == MPE_DEST_GAIN)
+                    gainTarget = 0.25f + 0.75f * DestinationValue(MPE_DEST_GAIN, i);
+                gainSteps[i] = (gainTarget - gains[i]) / frames;
+                gainFrames[i] = frames;
+            }
+
+            float cutoffValue = DestinationValue(MPE_DEST_CUTOFF, i);
+            float lfoValue = DestinationValue(MPE_DEST_LFO_DEPTH, i);
+            if (cutoffValue > maxCutoff)
+                maxCutoff = cutoffValue;
+            if (lfoValue > maxLfo)
+                maxLfo = lfoValue;
+        }
+
+        for (size_t c = 0; c < 16; c++)
+        {
+            channelDirty[c] = false;
+        }
+        anyDirty = false;
+
+        /* +-2 octaves around the range-driven cutoff, 0.5 = unchanged */
+        bool cutoffUsed = pressureDest == MPE_DEST_CUTOFF || timbreDest == MPE_DEST_CUTOFF;
+        cutoffMod = anyExpressive && cutoffUsed ? powf(2.f, (maxCutoff - 0.5f) * 4.f) : 1.0f;
+        lfoDepthMod = anyExpressive ? maxLfo : 0.0f;
+        return true;
+    }
+};
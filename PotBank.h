@@ -0,0 +1,103 @@
+#include "daisy_seed.h"
+#include <math.h>
+
+using namespace daisy;
+
+/* Pots are looked at this often, the ADC oversamples in between */
+#define POT_UPDATE_INTERVAL_US 1000
+/* One-pole smoothing per update, on top of the hardware oversampling */
+#define POT_SMOOTHING 0.25f
+/* Default dead band around the last reported value, 0-1 */
+#define POT_HYSTERESIS 0.004f
+
+/*
+  Front panel pots on the DMA-driven ADC. The ADC oversamples and
+  decimates in hardware, this smooths the result a little more and only
+  reports a pot as changed once it has moved further than its hysteresis
+  from the last reported value, so a resting pot never produces work.
+  The ends snap to exactly 0 and 1.
+*/
+template <size_t num_pots>
+class PotBank
+{
+private:
+    AdcHandle *adc;
+    float smoothed[num_pots];
+    float value[num_pots];
+    float hysteresis[num_pots];
+    uint32_t changed;
+    uint32_t lastUs;
+    SensorCapture *capture = NULL;
+
+public:
+    PotBank(){};
+    ~PotBank(){};
+
+    /* After adc->Start(). Every pot starts out changed, to apply it once */
+    void Init(AdcHandle *_adc)
+    {
+        adc = _adc;
+        for (size_t i = 0; i < num_pots; i++)
+        {
+            smoothed[i] = value[i] = adc->GetFloat(i);
+            hysteresis[i] = POT_HYSTERESIS;
+        }
+        changed = (1u << num_pots) - 1;
+        lastUs = System::GetUs();
+    }
+
+    /* Raw readings are recorded at every update */
+    void SetCapture(SensorCapture *_capture)
+    {
+        capture = _capture;
+    }
+
+    void SetHysteresis(size_t pot, float h)
+    {
+        hysteresis[pot] = h;
+    }
+
+    /* Main loop, every pass */
+    void Process()
+    {
+        uint32_t now = System::GetUs();
+        if (now - lastUs < POT_UPDATE_INTERVAL_US)
+            return;
+        lastUs = now;
+
+        for (size_t i = 0; i < num_pots; i++)
+        {
+            /* One read, so the recording has exactly what was used */
+            uint16_t raw = adc->Get(i);
+            if (capture != NULL)
+                capture->RecordMain(CAPTURE_POT, i, raw, now);
+            smoothed[i] += POT_SMOOTHING * (raw / 65536.f - smoothed[i]);
+
+            float target = smoothed[i];
+            float h = hysteresis[i];
+            if (target < h)
+                target = 0.f;
+            else if (target > 1.f - h)
+                target = 1.f;
+
+            bool atEnd = (target == 0.f || target == 1.f) && target != value[i];
+            if (atEnd || fabsf(target - value[i]) > h)
+            {
+                value[i] = target;
+                changed |= 1u << i;
+            }
+        }
+    }
+
+    /* True once after each reported move */
+    bool TakeChange(size_t pot)
+    {
+        uint32_t bit = 1u << pot;
+        if (!(changed & bit))
+            return false;
+        changed &= ~bit;
+        return true;
+    }
+
+    inline float GetValue(size_t pot) const { return value[pot]; }
+};
@@ -0,0 +1,368 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#define NUM_PRESETS 16
+
+/* Last 1MB of the 8MB QSPI chip, well clear of any QSPI program image */
+#define PRESET_FLASH_OFFSET 0x00700000
+#define PRESET_FLASH_SIZE 0x00100000
+#define PRESET_SECTOR_SIZE 4096
+#define PRESET_PAGE_SIZE 256
+#define PRESET_MAGIC 0x50434241 // "ABCP"
+/* Sector erase is 300ms at most on the IS25LP064, give up well after */
+#define PRESET_ERASE_TIMEOUT_MS 1000
+
+/* IS25LP064 commands, single line */
+#define QSPI_CMD_WRITE_ENABLE 0x06
+#define QSPI_CMD_READ_STATUS 0x05
+#define QSPI_CMD_SECTOR_ERASE 0x20
+#define QSPI_STATUS_WIP 0x01
+
+/* First page of every frame, programmed last to commit the record */
+struct PresetHeader
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t slot;
+    uint16_t version;
+    uint32_t size;
+};
+
+/*
+  Log-structured preset storage in QSPI flash.
+
+  The region is split into equal frames of whole sectors, each holding one
+  record: a header page followed by the payload. Saves always go to the
+  next frame after the newest record, skipping frames that still hold a
+  slot's latest record, so erases are spread over the whole region. The
+  header is programmed after the payload, so a save cut short by power
+  loss leaves an unreadable frame and the previous record still wins.
+
+  Init scans every header once to build the slot -> frame index. A save is
+  split into sector erases and page writes, one step per Process() call.
+  QSPIHandle::EraseSector waits out the whole erase (tens to hundreds of
+  ms), so erases go to the QUADSPI registers directly instead: a pass
+  issues the erase and later passes read the status register until WIP
+  clears, then memory mapped mode is put back as libDaisy left it. Page
+  writes stay with QSPIHandle, about a millisecond each.
+*/
+class PresetStore
+{
+private:
+    enum Job
+    {
+        JOB_IDLE,
+        JOB_ERASE,
+        JOB_PROGRAM,
+        JOB_COMMIT,
+    };
+
+    QSPIHandle *qspi;
+    uint8_t *buffer;
+    size_t size;
+    uint16_t version;
+
+    size_t frameSize;
+    size_t numFrames;
+
+    /* Latest record per slot, -1 if none */
+    int16_t index[NUM_PRESETS];
+    uint32_t nextSeq;
+    size_t head;
+
+    Job job;
+    size_t jobFrame;
+    size_t jobStep;
+    uint16_t jobSlot;
+
+    /* Memory mapped setup saved while an erase runs */
+    bool erasing;
+    uint32_t eraseStart;
+    uint32_t savedCcr;
+    uint32_t savedAbr;
+
+    uint32_t errors;
+
+    inline uint32_t FrameAddress(size_t frame) const
+    {
+        return PRESET_FLASH_OFFSET + frame * frameSize;
+    }
+
+    inline const PresetHeader *Header(size_t frame)
+    {
+        return (const PresetHeader *)qspi->GetData(FrameAddress(frame));
+    }
+
+    bool IsLive(size_t frame) const
+    {
+        for (size_t i = 0; i < NUM_PRESETS; i++)
+        {
+            if (index[i] == int16_t(frame))
+                return true;
+        }
+        return false;
+    }
+
+    size_t NumPages() const
+    {
+        return (size + PRESET_PAGE_SIZE - 1) / PRESET_PAGE_SIZE;
+    }
+
+    void Fail()
+    {
+        if (erasing)
+            EndErase();
+        errors++;
+        job = JOB_IDLE;
+    }
+
+    /* A few bytes on the wire, microseconds at most */
+    bool WaitTransfer()
+    {
+        for (uint32_t i = 0; i < 100000; i++)
+        {
+            if (QUADSPI->SR & QUADSPI_SR_TCF)
+            {
+                QUADSPI->FCR = QUADSPI_FCR_CTCF;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Clears within a transfer, a bit that stays set is a hung peripheral */
+    bool Abort()
+    {
+        QUADSPI->CR |= QUADSPI_CR_ABORT;
+        for (uint32_t i = 0; i < 100000; i++)
+        {
+            if (!(QUADSPI->CR & QUADSPI_CR_ABORT))
+                return true;
+        }
+        return false;
+    }
+
+    /* Leaves memory mapped mode and issues the erase, false on a timeout */
+    bool StartErase(uint32_t address)
+    {
+        savedCcr = QUADSPI->CCR;
+        savedAbr = QUADSPI->ABR;
+        erasing = true;
+        eraseStart = System::GetNow();
+        if (!Abort())
+            return false;
+
+        /* No address or data, so writing CCR sends the command */
+        QUADSPI->CCR = QUADSPI_CCR_IMODE_0 | QSPI_CMD_WRITE_ENABLE;
+        if (!WaitTransfer())
+            return false;
+
+        /* 24 bit address, sent when AR is written */
+        QUADSPI->CCR = QUADSPI_CCR_IMODE_0 | QUADSPI_CCR_ADMODE_0 | QUADSPI_CCR_ADSIZE_1 | QSPI_CMD_SECTOR_ERASE;
+        QUADSPI->AR = address;
+        return WaitTransfer();
+    }
+
+    /* One status register read, false while the erase is still running */
+    bool EraseDone(bool &ok)
+    {
+        ok = true;
+        QUADSPI->DLR = 0;
+        QUADSPI->CCR = QUADSPI_CCR_FMODE_0 | QUADSPI_CCR_DMODE_0 | QUADSPI_CCR_IMODE_0 | QSPI_CMD_READ_STATUS;
+        if (!WaitTransfer())
+        {
+            ok = false;
+            return true;
+        }
+        uint8_t status = *(volatile uint8_t *)&QUADSPI->DR;
+        if (status & QSPI_STATUS_WIP)
+        {
+            if (System::GetNow() - eraseStart < PRESET_ERASE_TIMEOUT_MS)
+                return false;
+            ok = false;
+        }
+        return true;
+    }
+
+    /* Back to memory mapped reads, set up the way libDaisy had it */
+    bool EndErase()
+    {
+        bool ok = Abort();
+        QUADSPI->FCR = QUADSPI_FCR_CTCF | QUADSPI_FCR_CSMF | QUADSPI_FCR_CTEF | QUADSPI_FCR_CTOF;
+        QUADSPI->ABR = savedAbr;
+        QUADSPI->CCR = savedCcr;
+        erasing = false;
+        return ok;
+    }
+
+public:
+    PresetStore(){};
+    ~PresetStore(){};
+
+    /* Payloads are `size` bytes of `buffer`, tagged with `_version` */
+    void Init(QSPIHandle *_qspi, void *_buffer, size_t _size, uint16_t _version)
+    {
+        qspi = _qspi;
+        buffer = (uint8_t *)_buffer;
+        size = _size;
+        version = _version;
+        job = JOB_IDLE;
+        erasing = false;
+        errors = 0;
+
+        size_t sectors = (PRESET_PAGE_SIZE + size + PRESET_SECTOR_SIZE - 1) / PRESET_SECTOR_SIZE;
+        frameSize = sectors * PRESET_SECTOR_SIZE;
+        numFrames = PRESET_FLASH_SIZE / frameSize;
+
+        /* Newest valid record per slot wins */
+        uint32_t slotSeq[NUM_PRESETS];
+        for (size_t i = 0; i < NUM_PRESETS; i++)
+        {
+            index[i] = -1;
+            slotSeq[i] = 0;
+        }
+
+        nextSeq = 1;
+        head = 0;
+        for (size_t f = 0; f < numFrames; f++)
+        {
+            const PresetHeader *h = Header(f);
+            if (h->magic != PRESET_MAGIC || h->version != version || h->size != size || h->slot >= NUM_PRESETS)
+                continue;
+
+            if (index[h->slot] < 0 || h->seq > slotSeq[h->slot])
+            {
+                index[h->slot] = f;
+                slotSeq[h->slot] = h->seq;
+            }
+            if (h->seq >= nextSeq)
+            {
+                nextSeq = h->seq + 1;
+                head = (f + 1) % numFrames;
+            }
+        }
+    }
+
+    inline bool IsBusy() const { return job != JOB_IDLE; }
+
+    inline bool HasPreset(size_t slot) const { return slot < NUM_PRESETS && index[slot] >= 0; }
+
+    /*
+      Main loop. Copies a preset into the buffer, false if the slot is empty
+      or a save is in progress (flash is not readable while programming).
+    */
+    bool Load(size_t slot)
+    {
+        if (IsBusy() || !HasPreset(slot))
+            return false;
+
+        uint32_t address = FrameAddress(index[slot]) + PRESET_PAGE_SIZE;
+        uint8_t *data = (uint8_t *)qspi->GetData(address);
+        /* The frame may have been rewritten since it was last cached */
+        SCB_InvalidateDCache_by_Addr(data, size);
+        memcpy(buffer, data, size);
+        return true;
+    }
+
+    /* Main loop. Starts saving the buffer to slot, Process() does the work */
+    bool BeginSave(size_t slot)
+    {
+        if (IsBusy() || slot >= NUM_PRESETS)
+            return false;
+
+        /* Skip frames still holding a slot's latest record */
+        size_t frame = head;
+        for (size_t i = 0; i < numFrames && IsLive(frame); i++)
+        {
+            frame = (frame + 1) % numFrames;
+        }
+        if (IsLive(frame))
+        {
+            errors++;
+            return false;
+        }
+
+        jobFrame = frame;
+        jobSlot = slot;
+        jobStep = 0;
+        job = JOB_ERASE;
+        return true;
+    }
+
+    /*
+      Main loop, once per pass. Starts or polls one sector erase, or writes
+      one page
+    */
+    void Process()
+    {
+        switch (job)
+        {
+        case JOB_IDLE:
+            return;
+
+        case JOB_ERASE:
+        {
+            if (!erasing)
+            {
+                if (!StartErase(FrameAddress(jobFrame) + jobStep * PRESET_SECTOR_SIZE))
+                    Fail();
+                return;
+            }
+            bool ok;
+            if (!EraseDone(ok))
+                return;
+            if (!EndErase() || !ok)
+            {
+                Fail();
+                return;
+            }
+            if (++jobStep >= frameSize / PRESET_SECTOR_SIZE)
+            {
+                jobStep = 0;
+                job = JOB_PROGRAM;
+            }
+            return;
+        }
+
+        case JOB_PROGRAM:
+        {
+            size_t offset = jobStep * PRESET_PAGE_SIZE;
+            size_t count = size - offset < PRESET_PAGE_SIZE ? size - offset : PRESET_PAGE_SIZE;
+            uint32_t address = FrameAddress(jobFrame) + PRESET_PAGE_SIZE + offset;
+            if (qspi->Write(address, count, buffer + offset) != QSPIHandle::Result::OK)
+            {
+                Fail();
+                return;
+            }
+            if (++jobStep >= NumPages())
+            {
+                job = JOB_COMMIT;
+            }
+            return;
+        }
+
+        case JOB_COMMIT:
+        {
+            PresetHeader h;
+            h.magic = PRESET_MAGIC;
+            h.seq = nextSeq;
+            h.slot = jobSlot;
+            h.version = version;
+            h.size = size;
+            if (qspi->Write(FrameAddress(jobFrame), sizeof(h), (uint8_t *)&h) != QSPIHandle::Result::OK)
+            {
+                Fail();
+                return;
+            }
+            index[jobSlot] = jobFrame;
+            nextSeq++;
+            head = (jobFrame + 1) % numFrames;
+            job = JOB_IDLE;
+            return;
+        }
+        }
+    }
+
+    uint32_t GetErrors() const { return errors; }
+};
@@ -0,0 +1,137 @@
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+/* Critically damped alpha-beta gains, beta = alpha^2 / (2 - alpha) */
+#define RANGE_PREDICT_ALPHA 0.7f
+#define RANGE_PREDICT_BETA 0.377f
+/* A stalled sensor holds its last trajectory end instead of running away */
+#define RANGE_PREDICT_MAX_US 40000
+/* Sample interval assumed until one has been measured */
+#define RANGE_PREDICT_INTERVAL_S 0.02f
+
+/*
+  Alpha-beta tracker over one sensor's filtered range. Samples arrive a
+  few tens of times a second; the audio callback asks for the position at
+  the current time, extrapolated along the estimated velocity, so a sweep
+  moves every block instead of stepping at each sample.
+
+  The output starts from the newest sample and moves no faster than the
+  samples last moved, and not at all when the tracker and the samples
+  disagree on the direction. While the samples slow down it eases to a
+  stop where that deceleration would end. A hand turning round is then
+  not carried past the turn by a velocity estimate that is behind it
+  (host/range_trace measures this).
+
+  When a sample corrects the estimate, the difference from what was being
+  output is faded out over one sample interval rather than jumped.
+*/
+class RangePredictor
+{
+private:
+    /* Main loop */
+    bool primed;
+    float pos;
+    float vel;
+    uint32_t lastUs;
+    float interval;
+    /* Previous sample and its speed from the one before */
+    float lastX;
+    float lastStep;
+
+    /* Read by the audio callback, written together with interrupts off */
+    volatile float outPos;
+    volatile float outVel;
+    /* Seconds until a decelerating output stops, 0 if it isn't */
+    volatile float outStop;
+    volatile float outOffset;
+    volatile float outBlend;
+    volatile uint32_t outUs;
+
+    void Publish(float offset, float extrapolate, float stop)
+    {
+        ScopedIrqBlocker block;
+        outPos = lastX;
+        outVel = extrapolate;
+        outStop = stop;
+        outOffset = offset;
+        outBlend = interval;
+        outUs = lastUs;
+    }
+
+public:
+    RangePredictor(){};
+    ~RangePredictor(){};
+
+    void Init()
+    {
+        primed = false;
+        pos = vel = 0.f;
+        lastUs = 0;
+        lastX = lastStep = 0.f;
+        interval = RANGE_PREDICT_INTERVAL_S;
+        Publish(0.f, 0.f, 0.f);
+    }
+
+    /* Main loop, once per sample (mm) taken at timeUs */
+    void Update(float x, uint32_t timeUs)
+    {
+        if (!primed)
+        {
+            pos = lastX = x;
+            lastStep = 0.f;
+            vel = 0.f;
+            lastUs = timeUs;
+            primed = true;
+            Publish(0.f, 0.f, 0.f);
+            return;
+        }
+
+        float dt = (timeUs - lastUs) * 1e-6f;
+        if (dt <= 0.f)
+            return;
+
+        /* What the audio side is outputting right now */
+        float before = Predict(timeUs);
+
+        float predicted = pos + vel * dt;
+        float residual = x - predicted;
+        pos = predicted + RANGE_PREDICT_ALPHA * residual;
+        vel += RANGE_PREDICT_BETA / dt * residual;
+        lastUs = timeUs;
+        interval += 0.1f * (dt - interval);
+
+        float step = (x - lastX) / dt;
+        float extrapolate = vel * step > 0.f ? (fabsf(step) < fabsf(vel) ? step : vel) : 0.f;
+        float stop = 0.f;
+        if (step * lastStep > 0.f && fabsf(step) < fabsf(lastStep))
+            stop = step / (lastStep - step) * dt;
+        lastX = x;
+        lastStep = step;
+
+        Publish(before - x, extrapolate, stop);
+    }
+
+    /* Audio callback. Position (mm) at nowUs */
+    float Predict(uint32_t nowUs) const
+    {
+        int32_t us = int32_t(nowUs - outUs);
+        if (us < 0)
+            us = 0;
+        if (us > RANGE_PREDICT_MAX_US)
+            us = RANGE_PREDICT_MAX_US;
+
+        float t = us * 1e-6f;
+        float fade = 1.f - t / outBlend;
+        if (fade < 0.f)
+            fade = 0.f;
+        float travel = t;
+        if (outStop > 0.f)
+        {
+            if (travel > outStop)
+                travel = outStop;
+            travel -= 0.5f * travel * travel / outStop;
+        }
+        return outPos + outVel * travel + outOffset * fade;
+    }
+};
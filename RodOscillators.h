@@ -17,6 +17,12 @@ private:
     float realFreqs[max_polyphony];
     /* Depth of vibrato for each voice */
     float vibratoDepths[max_polyphony];
+    /* Per-note (MPE) pitch bend ratio for each voice */
+    float voiceBends[max_polyphony];
+    /* Leaky integrator state for phase-locked triangles */
+    float lastOuts[max_polyphony];
+    /* This rod's vibrato, integrated as a phase offset on the locked phase */
+    uint32_t vibratoPhases[max_polyphony];
 
     Svf flt;
     // Tone flt;
@@ -34,10 +40,21 @@ private:
 
     float filterCutoff;
     float prevFilterCutoff;
+    /* Expression (MPE) modulation, applied at block rate */
+    float cutoffMod;
+    float lfoDepthMod;
+    /* Modulation matrix offsets, applied at block rate */
+    float matrixCutoffMul;
+    float matrixGain;
+    float matrixLfoRate;
+    float matrixLfoDepth;
+    float resonance;
+    float drive;
 
     float pitchBend;
     float vibratoDepth;
     float gain;
+    float oscAmp;
     uint8_t gainLineFinished;
 
     /*
@@ -47,16 +64,108 @@ private:
     float sinZ = 0.0;
     float cosZ = 1.0;
 
+    void UpdateOscFreq(size_t i)
+    {
+        float fq = oscFreqs[i] * harmonicMultiplier;
+        realFreqs[i] = fq;
+        /* Vibrato depth is based on frequency */
+        vibratoDepths[i] = fq * 0.015f;
+        oscillators[i].SetFreq(fq * voiceBends[i]);
+    }
+
     void UpdateOscFreqs()
     {
         for (size_t i = 0; i < currentPolyphony; i++)
         {
-            float fq = oscFreqs[i] * harmonicMultiplier;
-            realFreqs[i] = fq;
-            /* Vibrato depth is based on frequency */
-            vibratoDepths[i] = fq * 0.015f;
-            oscillators[i].SetFreq(fq);
+            UpdateOscFreq(i);
+        }
+    }
+
+    /* Same correction as DaisySP's Oscillator */
+    inline float polyblep(float dt, float t)
+    {
+        if (t < dt)
+        {
+            t /= dt;
+            return t + t - t * t - 1.0f;
+        }
+        else if (t > 1.0f - dt)
+        {
+            t = (t - 1.0f) / dt;
+            return t * t + t + t + 1.0f;
+        }
+        return 0.0f;
+    }
+
+    /* Render one sample of the current waveform from a normalized phase */
+    float renderWaveform(float t, float dt, size_t voice)
+    {
+        float out;
+        switch (waveform)
+        {
+        case Oscillator::WAVE_POLYBLEP_TRI:
+        {
+            float t2 = t + 0.5f;
+            t2 -= float(int(t2));
+            out = t < 0.5f ? 1.0f : -1.0f;
+            out += polyblep(dt, t);
+            out -= polyblep(dt, t2);
+            /* Leaky integrator, increment in radians to match Oscillator */
+            float inc = TWOPI_F * dt;
+            out = inc * out + (1.0f - inc) * lastOuts[voice];
+            lastOuts[voice] = out;
+            out *= 4.f;
+            break;
+        }
+        case Oscillator::WAVE_POLYBLEP_SAW:
+            out = (2.0f * t) - 1.0f;
+            out -= polyblep(dt, t);
+            out *= -1.0f;
+            break;
+        case Oscillator::WAVE_POLYBLEP_SQUARE:
+        {
+            float t2 = t + 0.5f;
+            t2 -= float(int(t2));
+            out = t < 0.5f ? 1.0f : -1.0f;
+            out += polyblep(dt, t);
+            out -= polyblep(dt, t2);
+            out *= 0.707f;
+            break;
+        }
+        default:
+            out = sinf(TWOPI_F * t);
+            break;
+        }
+        return out * oscAmp;
+    }
+
+    /* Tremolo, filter and gain shared by both render paths */
+    float processOutput(float sig)
+    {
+        /* Tremolo */
+        if (lfoTarget == 1)
+        {
+            float modSig = sinZ * 0.5F + 1.0F;
+            sig = sig * (1 - lfoDepth) + (sig * modSig) * lfoDepth;
+        }
+
+        float sigOut = sig;
+
+        /* Soft clipping shaper, only when modulated */
+        if (drive > 0.0f)
+        {
+            float x = sigOut * (1.0f + drive * 4.0f);
+            sigOut = x / (1.0f + fabsf(x));
+        }
+
+        /* Only filter saw and square */
+        if (isSaw(waveform) || isSquare(waveform))
+        {
+            flt.Process(sigOut);
+            sigOut = flt.Low();
         }
+
+        return sigOut * gain;
     }
 
 public:
@@ -69,6 +178,9 @@ public:
         {
             oscFreqs[i] = 0.0f;
             realFreqs[i] = 0.0f;
+            lastOuts[i] = 0.0f;
+            vibratoPhases[i] = 0;
+            voiceBends[i] = 1.0f;
             oscillators[i].Init(sample_rate);
             oscillators[i].SetAmp(1.0f);
         }
@@ -79,6 +191,7 @@ public:
         currentPolyphony = max_polyphony;
 
         gain = 1.0f;
+        oscAmp = 1.0f;
         lfoFreq = 0.0f;
         lfoDepth = 0.0f;
         prevDepth = 0.0f;
@@ -86,11 +199,19 @@ public:
 
         filterCutoff = 15000;
         prevFilterCutoff = 15000;
+        cutoffMod = 1.0f;
+        lfoDepthMod = 0.0f;
+        matrixCutoffMul = 1.0f;
+        matrixGain = 0.0f;
+        matrixLfoRate = 0.0f;
+        matrixLfoDepth = 0.0f;
+        resonance = 0.2f;
+        drive = 0.0f;
 
         harmonicMultiplier = 1;
 
         flt.SetFreq(filterCutoff);
-        flt.SetRes(0.2f);
+        flt.SetRes(resonance);
         SetLfoTarget(1);
     }
 
@@ -107,7 +228,12 @@ public:
         currentPolyphony = numVoices;
     }
 
-    float Process(float amps[max_polyphony])
+    /*
+      Advance the LFO, depth and gain slides by one sample.
+      Returns this rod's vibrato as a frequency ratio offset (0 when the LFO
+      is not targeting pitch), which ProcessLocked() integrates per voice.
+    */
+    float ProcessLfo()
     {
         // iterate LFO
         sinZ = sinZ + lfoFreq * cosZ;
@@ -122,11 +248,23 @@ public:
             gain = gainLine.Process(&gainLineFinished);
         }
 
+        if (lfoTarget == 0)
+        {
+            /* Matches the per-rod path, which adds the vibrato twice */
+            return lfoDepth * 0.03f * sinZ;
+        }
+        return 0.0f;
+    }
+
+    float Process(float amps[max_polyphony])
+    {
+        ProcessLfo();
+
         float sum = 0.0f;
 
         for (size_t i = 0; i < currentPolyphony; i++)
         {
-            float fq = realFreqs[i];
+            float fq = realFreqs[i] * voiceBends[i];
             if (pitchBend != 1.f)
             {
                 fq *= pitchBend;
@@ -147,25 +285,43 @@ public:
             sum += oscillators[i].Process() * amps[i];
         }
 
-        float sig = sum;
-
-        /* Tremolo */
-        if (lfoTarget == 1)
-        {
-            float modSig = sinZ * 0.5F + 1.0F;
-            sig = sig * (1 - lfoDepth) + (sig * modSig) * lfoDepth;
-        }
+        return processOutput(sum);
+    }
 
-        float sigOut = sig;
+    /*
+      Phase-locked render path. Call phase.Process() first.
+      The rod phase is the voice phase times the harmonic; the uint32_t
+      multiply wraps exactly like the accumulator. This rod's own vibrato is
+      integrated into a per-voice offset on top, so it bends only this rod
+      and the offset swings back as the LFO does.
+    */
+    template <typename Phase>
+    float ProcessLocked(float amps[max_polyphony], const Phase &phase)
+    {
+        /* Top 24 bits, so the float never rounds up to 1.0 */
+        const float phaseScale = 1.0f / 16777216.f;
+        float vibrato = ProcessLfo();
+        float sum = 0.0f;
 
-        /* Only filter saw and square */
-        if (isSaw(waveform) || isSquare(waveform))
+        for (size_t i = 0; i < currentPolyphony; i++)
         {
-            flt.Process(sigOut);
-            sigOut = flt.Low();
+            float inc = float(phase.GetIncrement(i)) * harmonicMultiplier;
+            int32_t vibInc = int32_t(inc * vibrato);
+            vibratoPhases[i] += uint32_t(vibInc);
+
+            /* The triangle's integrator has to keep running while silent */
+            if (amps[i] == 0.0f && waveform != Oscillator::WAVE_POLYBLEP_TRI)
+                continue;
+
+            uint32_t p = phase.GetPhase(i) * uint32_t(harmonicMultiplier) + vibratoPhases[i];
+            float t = float(p >> 8) * phaseScale;
+            float dt = (inc + float(vibInc)) * (phaseScale / 256.f);
+            float out = renderWaveform(t, dt, i);
+            if (amps[i] != 0.0f)
+                sum += out * amps[i];
         }
 
-        return sigOut * gain;
+        return processOutput(sum);
     }
 
     void SetLfoTarget(int target)
@@ -173,6 +329,8 @@ public:
         lfoTarget = target;
     }
 
+    inline int GetLfoTarget() const { return lfoTarget; }
+
     void SetPitchBend(float fq)
     {
         pitchBend = fq;
@@ -215,24 +373,84 @@ public:
                 oscillators[i].SetAmp(0.8F);
             }
         }
+
+        if (isSaw(waveform))
+            oscAmp = 0.7F;
+        else if (isSquare(waveform))
+            oscAmp = 0.8F;
     }
 
+    /* Only the target voice is recomputed */
     void SetFundamentalFreq(float freq, int target)
     {
         oscFreqs[target] = freq;
-        UpdateOscFreqs();
+        UpdateOscFreq(target);
     }
 
     void SetLfoFreq(float freq)
     {
-        lfoFreq = freq / 10000.0;
+        lfoFreq = freq * (1.0f + matrixLfoRate) / 10000.0;
 
         /* Auto set depth based on freq */
         // SetLfoDepth(fclamp(freq / 4, 0.f, 1.f));
 
-        lfoDepth = fclamp(freq / 4, 0.f, 1.f);
+        lfoDepth = fclamp(freq / 4 + lfoDepthMod + matrixLfoDepth, 0.f, 1.f);
+    }
+
+    /*
+      Lock the LFO to an external phase (0-1) and rate, once per block
+      after SetLfoFreq. Depth still follows rotation.
+    */
+    void SyncLfo(float phase, float cyclesPerSample)
+    {
+        float theta = TWOPI_F * phase;
+        sinZ = sinf(theta);
+        cosZ = cosf(theta);
+        lfoFreq = 2.0f * sinf(PI_F * cyclesPerSample);
+    }
+
+    /* Per-note bend for the Oscillator path, once per block at most */
+    void SetVoiceBend(size_t voice, float ratio)
+    {
+        voiceBends[voice] = ratio;
+        oscillators[voice].SetFreq(realFreqs[voice] * ratio * pitchBend);
+    }
+
+    /* Cutoff multiplier from expression, picked up by the next SetRange */
+    void SetCutoffMod(float mod)
+    {
+        cutoffMod = mod;
+    }
+
+    /* Added to the rotation-driven LFO depth */
+    void SetLfoDepthMod(float depth)
+    {
+        lfoDepthMod = depth;
+    }
+
+    /*
+      Modulation matrix destinations for this rod, indexed by ModDestination.
+      Picked up by the next SetLfoFreq / SetRange, so call it first.
+    */
+    void ApplyModulation(const float *mod)
+    {
+        matrixCutoffMul = powf(2.f, mod[MOD_DST_CUTOFF]);
+        matrixGain = mod[MOD_DST_GAIN];
+        matrixLfoRate = mod[MOD_DST_LFO_RATE];
+        matrixLfoDepth = mod[MOD_DST_LFO_DEPTH];
+        drive = mod[MOD_DST_DRIVE] > 0.0f ? mod[MOD_DST_DRIVE] : 0.0f;
+
+        float res = fclamp(0.2f + mod[MOD_DST_RESONANCE], 0.f, 1.f);
+        if (res != resonance)
+        {
+            resonance = res;
+            flt.SetRes(resonance);
+        }
     }
 
+    /* Current LFO output, -1 to 1 */
+    inline float GetLfo() const { return sinZ; }
+
     void SetLfoDepth(float depth)
     {
         lfoDepth = depth * 0.05 + prevDepth * 0.95;
@@ -244,7 +462,7 @@ public:
     {
         /* TODO smooth? */
         filterCutoff = freq;
-        flt.SetFreq(freq);
+        flt.SetFreq(freq * cutoffMod * matrixCutoffMul);
     }
 
     /* range from 0-1 */
@@ -257,14 +475,14 @@ public:
         /* Filter sawtooth and square waves */
         if (isSaw(waveform) || isSquare(waveform))
         {
-            SetGain(1);
+            SetGain(1 + matrixGain);
         }
 
         /* Set gain for sine and triangle */
         else
         {
             // SetFilterCutoff(15000);
-            SetGain(range);
+            SetGain(range + matrixGain);
         }
 
         if (range < 0.05)
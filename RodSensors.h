@@ -18,32 +18,26 @@ private:
     // Adafruit_VL6180X vl = Adafruit_VL6180X();
 
     const uint8_t PulsesPerRevolution = 3;
-    const unsigned long ZeroTimeout = 500000;
-    const uint8_t numReadings = 10;
+    const uint32_t ZeroTimeout = 500000;
 
     Encoder rodEncoder;
-    Switch breakBeamSwitch;
-
-    unsigned long LastTimeWeMeasured;
-    unsigned long PeriodBetweenPulses = ZeroTimeout + 10;
-    unsigned long PeriodAverage = ZeroTimeout + 10;
-    unsigned long FrequencyRaw;
-    unsigned long FrequencyReal;
-    unsigned long RPM;
+    EdgeCapture breakBeam;
+    /* False if the breakbeam's EXTI line couldn't be claimed, no rotation then */
+    bool breakBeamOk = false;
+
+    /* Edge times in us, from the EXTI ring */
+    uint32_t LastTimeWeMeasured = 0;
+    bool HaveEdge = false;
+    uint32_t PeriodSum = 0;
     unsigned int PulseCounter = 1;
-    unsigned long PeriodSum;
-
-    unsigned long LastTimeCycleMeasure = LastTimeWeMeasured;
-    unsigned long CurrentMicros = (System::GetNow() * 1000);
     unsigned int AmountOfReadings = 1;
-    unsigned int ZeroDebouncingExtra;
-    unsigned long readings[10];
-    unsigned long readIndex;
-    unsigned long total;
-    unsigned int average;
-    unsigned int photoCellVal;
+    /* Revolutions per second, only recomputed when an edge arrives */
+    float rotationSpeed = 0.f;
 
     int encoderVal = 0;
+    /* This block's raw encoder input */
+    int increment = 0;
+    bool buttonEdge = false;
     int waveformIndex = 0;
 
     int prevLongPress = 0;
@@ -59,49 +53,40 @@ private:
     float oldk = 0.0;
 
     bool canUpdateWaveform = false;
-    void updateVelocityAverage()
+
+    /* This block's breakbeam edges, for anything clocked by the rod */
+    uint32_t pulses[EDGE_RING_SIZE];
+    size_t numPulses = 0;
+    size_t pulseRead = 0;
+
+    void Pulse_Event(uint32_t timeUs)
     {
-        LastTimeCycleMeasure = LastTimeWeMeasured;
-        CurrentMicros = (System::GetNow() * 1000);
-        if (CurrentMicros < LastTimeCycleMeasure)
+        if (!HaveEdge)
         {
-            LastTimeCycleMeasure = CurrentMicros;
+            /* Nothing to measure a period against yet */
+            LastTimeWeMeasured = timeUs;
+            HaveEdge = true;
+            return;
         }
-        FrequencyRaw = 10000000000 / PeriodAverage;
-        if (PeriodBetweenPulses > ZeroTimeout - ZeroDebouncingExtra || CurrentMicros - LastTimeCycleMeasure > ZeroTimeout - ZeroDebouncingExtra)
+        uint32_t PeriodBetweenPulses = timeUs - LastTimeWeMeasured;
+        LastTimeWeMeasured = timeUs;
+        if (PeriodBetweenPulses > ZeroTimeout)
         {
-            FrequencyRaw = 0; // Set frequency as 0.
-            ZeroDebouncingExtra = 2000;
-        }
-        else
-        {
-            ZeroDebouncingExtra = 0;
-        }
-        FrequencyReal = FrequencyRaw / 10000;
-
-        RPM = FrequencyRaw / PulsesPerRevolution * 60;
-        RPM = RPM / 10000;
-        total = total - readings[readIndex];
-        readings[readIndex] = RPM;
-        total = total + readings[readIndex];
-        readIndex = readIndex + 1;
-
-        if (readIndex >= numReadings)
-        {
-            readIndex = 0;
+            /* Starting up from standstill */
+            PulseCounter = 1;
+            PeriodSum = 0;
+            rotationSpeed = 0.f;
+            return;
         }
-        average = total / numReadings;
-    }
-    void Pulse_Event()
-    {
-        PeriodBetweenPulses = (System::GetNow() * 1000) - LastTimeWeMeasured;
-        LastTimeWeMeasured = (System::GetNow() * 1000);
 
+        PeriodSum += PeriodBetweenPulses;
         if (PulseCounter >= AmountOfReadings)
         {
-            PeriodAverage = PeriodSum / AmountOfReadings;
+            /* One float reciprocal per averaged period, not per block */
+            float PeriodAverage = float(PeriodSum) / AmountOfReadings;
+            rotationSpeed = 1000000.f / (PeriodAverage * PulsesPerRevolution);
             PulseCounter = 1;
-            PeriodSum = PeriodBetweenPulses;
+            PeriodSum = 0;
 
             int RemapedAmountOfReadings = map(PeriodBetweenPulses, 40000, 5000, 1, 10);
             RemapedAmountOfReadings = constrain(RemapedAmountOfReadings, 1, 10);
@@ -110,28 +95,33 @@ private:
         else
         {
             PulseCounter++;
-            PeriodSum = PeriodSum + PeriodBetweenPulses;
         }
     }
 
 public:
     RodSensors(){};
     ~RodSensors(){};
-    void Init(int initialHarmonic, dsy_gpio_pin pinBreakBeam, dsy_gpio_pin pinEnc1, dsy_gpio_pin pinEnc2, dsy_gpio_pin pinEncBtn)
+    /* False if the breakbeam can't be captured, the encoder still works */
+    bool Init(int initialHarmonic, dsy_gpio_pin pinBreakBeam, dsy_gpio_pin pinEnc1, dsy_gpio_pin pinEnc2, dsy_gpio_pin pinEncBtn)
     {
         encoderVal = initialHarmonic;
         rodEncoder.Init(pinEnc1, pinEnc2, pinEncBtn);
-        breakBeamSwitch.Init(pinBreakBeam);
+        breakBeamOk = breakBeam.Init(pinBreakBeam);
+        return breakBeamOk;
+    };
+    bool HasBreakBeam()
+    {
+        return breakBeamOk;
     };
     float GetDistance();
     float GetRotationSpeed()
     {
-        return average / 60.0;
+        return rotationSpeed;
     };
 
     int GetPulse()
     {
-        return breakBeamSwitch.Pressed();
+        return !breakBeam.GetLevel();
     };
 
     int GetEncoderVal()
@@ -144,11 +134,45 @@ public:
         return waveformIndex;
     };
 
+    /* Remote control (MIDI CC, presets) */
+    void SetEncoderVal(int val)
+    {
+        encoderVal = (val % 10 + 10) % 10;
+    }
+
+    void SetWaveformIndex(int idx)
+    {
+        waveformIndex = (idx % NUM_WAVEFORMS + NUM_WAVEFORMS) % NUM_WAVEFORMS;
+    }
+
     void SetVal(float val)
     {
         k = val;
     }
 
+    /* True once per breakbeam edge since Process(), with its time in us */
+    bool TakePulse(uint32_t &timeUs)
+    {
+        if (pulseRead >= numPulses)
+            return false;
+        timeUs = pulses[pulseRead++];
+        return true;
+    }
+
+    /* Raw input from the last Process(), for capture */
+    int GetIncrement()
+    {
+        return increment;
+    }
+    bool GetButtonEdge()
+    {
+        return buttonEdge;
+    }
+    bool GetPressed()
+    {
+        return rodEncoder.Pressed();
+    }
+
     int GetLongPress()
     {
         return longPressRisingEdge;
@@ -162,7 +186,6 @@ public:
     void Process()
     {
         rodEncoder.Debounce();
-        breakBeamSwitch.Debounce();
 
         if (rodEncoder.RisingEdge())
         {
@@ -193,14 +216,26 @@ public:
 
         prevLongPress = longPress;
 
-        encoderVal -= rodEncoder.Increment();
+        buttonEdge = rodEncoder.RisingEdge() || rodEncoder.FallingEdge();
+        increment = rodEncoder.Increment();
+        encoderVal -= increment;
         encoderVal = (encoderVal % 10 + 10) % 10;
 
-        updateVelocityAverage();
+        numPulses = 0;
+        pulseRead = 0;
+        while (numPulses < EDGE_RING_SIZE && breakBeam.edges.Pop(pulses[numPulses]))
+        {
+            Pulse_Event(pulses[numPulses]);
+            numPulses++;
+        }
 
-        if (breakBeamSwitch.RisingEdge() || breakBeamSwitch.FallingEdge())
+        /* No edge for too long, the rod has stopped */
+        if (HaveEdge && System::GetUs() - LastTimeWeMeasured > ZeroTimeout)
         {
-            Pulse_Event();
+            rotationSpeed = 0.f;
+            PulseCounter = 1;
+            PeriodSum = 0;
+            HaveEdge = false;
         }
     }
 };
@@ -0,0 +1,220 @@
+#include <stdint.h>
+
+#define SEQ_MAX_STEPS 16
+#define SEQ_MAX_HELD 16
+/* Pulses that can wait for their frame within one block */
+#define SEQ_MAX_PENDING 4
+/* Step value that plays nothing */
+#define SEQ_REST -128
+
+enum SeqMode
+{
+    SEQ_OFF,
+    SEQ_ARP_UP,
+    SEQ_ARP_DOWN,
+    SEQ_ARP_UPDOWN,
+    SEQ_ARP_ORDER,  // in the order the keys were pressed
+    SEQ_STEP,       // pattern of offsets from the last key pressed
+    SEQ_MODE_COUNT,
+};
+
+/*
+  Step sequencer / arpeggiator clocked by one rod's breakbeam pulses, so
+  spinning faster plays faster. Pulses are queued with their timestamps
+  and popped at the matching frame of the next audio block, the same one
+  block latency MidiQueue uses for incoming notes. The sequencer only
+  picks notes; the caller plays them on the rod's own voice channel.
+*/
+class RodSequencer
+{
+private:
+    SeqMode mode;
+
+    /* Held keys in press order */
+    uint8_t held[SEQ_MAX_HELD];
+    size_t numHeld;
+
+    int8_t steps[SEQ_MAX_STEPS];
+    size_t numSteps;
+    size_t stepIndex;
+
+    int lastNote;
+    int orderIndex;
+    bool goingUp;
+    /* Note currently sounding, -1 if none */
+    int playing;
+
+    uint32_t pendingUs[SEQ_MAX_PENDING];
+    size_t numPending;
+
+    int NextArpNote()
+    {
+        /* Nearest held note above (or below) the last one, wrapping round */
+        int up = -1, down = -1, lowest = 128, highest = -1;
+        for (size_t i = 0; i < numHeld; i++)
+        {
+            int n = held[i];
+            if (n < lowest)
+                lowest = n;
+            if (n > highest)
+                highest = n;
+            if (n > lastNote && (up < 0 || n < up))
+                up = n;
+            if (n < lastNote && (down < 0 || n > down))
+                down = n;
+        }
+
+        switch (mode)
+        {
+        case SEQ_ARP_UP:
+            return up >= 0 ? up : lowest;
+        case SEQ_ARP_DOWN:
+            return down >= 0 ? down : highest;
+        case SEQ_ARP_UPDOWN:
+            if (goingUp && up < 0)
+                goingUp = false;
+            else if (!goingUp && down < 0)
+                goingUp = true;
+            if (goingUp)
+                return up >= 0 ? up : lowest;
+            return down >= 0 ? down : highest;
+        default:
+            orderIndex = (orderIndex + 1) % numHeld;
+            return held[orderIndex];
+        }
+    }
+
+public:
+    RodSequencer(){};
+    ~RodSequencer(){};
+
+    void Init()
+    {
+        mode = SEQ_OFF;
+        numHeld = 0;
+        numPending = 0;
+        lastNote = -1;
+        orderIndex = -1;
+        goingUp = true;
+        playing = -1;
+
+        /* Root, octave, fifth, octave */
+        numSteps = 4;
+        stepIndex = 0;
+        for (size_t i = 0; i < SEQ_MAX_STEPS; i++)
+        {
+            steps[i] = 0;
+        }
+        steps[1] = 12;
+        steps[2] = 7;
+        steps[3] = 12;
+    }
+
+    void SetMode(int _mode)
+    {
+        mode = SeqMode((_mode % SEQ_MODE_COUNT + SEQ_MODE_COUNT) % SEQ_MODE_COUNT);
+    }
+
+    inline SeqMode GetMode() const { return mode; }
+    inline bool IsActive() const { return mode != SEQ_OFF; }
+
+    void SetStep(size_t idx, int8_t offset)
+    {
+        if (idx < SEQ_MAX_STEPS)
+            steps[idx] = offset;
+    }
+
+    void SetLength(size_t length)
+    {
+        numSteps = length < 1 ? 1 : (length > SEQ_MAX_STEPS ? SEQ_MAX_STEPS : length);
+        stepIndex = stepIndex % numSteps;
+    }
+
+    void NoteOn(uint8_t note)
+    {
+        for (size_t i = 0; i < numHeld; i++)
+        {
+            if (held[i] == note)
+                return;
+        }
+        if (numHeld < SEQ_MAX_HELD)
+            held[numHeld++] = note;
+    }
+
+    void NoteOff(uint8_t note)
+    {
+        for (size_t i = 0; i < numHeld; i++)
+        {
+            if (held[i] == note)
+            {
+                /* Keep press order for SEQ_ARP_ORDER */
+                for (size_t j = i + 1; j < numHeld; j++)
+                    held[j - 1] = held[j];
+                numHeld--;
+                if (orderIndex >= int(i))
+                    orderIndex--;
+                return;
+            }
+        }
+    }
+
+    /* Audio callback, block rate. Dropped if the block already has plenty */
+    void OnPulse(uint32_t timeUs)
+    {
+        if (mode != SEQ_OFF && numPending < SEQ_MAX_PENDING)
+            pendingUs[numPending++] = timeUs;
+    }
+
+    /* Audio callback, per frame. Pops the next pulse due at or before frame */
+    bool PopDue(const MidiQueue &queue, size_t frame, size_t blockFrames)
+    {
+        if (numPending == 0 || queue.FrameOffset(pendingUs[0], blockFrames) > frame)
+            return false;
+
+        for (size_t i = 1; i < numPending; i++)
+            pendingUs[i - 1] = pendingUs[i];
+        numPending--;
+        return true;
+    }
+
+    /*
+      Advance one step. Returns the note to play, or -1 for a rest or when
+      nothing is held. The previously playing note (GetPlaying()) should be
+      released first.
+    */
+    int Advance()
+    {
+        playing = -1;
+        if (numHeld == 0)
+            return -1;
+
+        if (mode == SEQ_STEP)
+        {
+            int8_t offset = steps[stepIndex];
+            stepIndex = (stepIndex + 1) % numSteps;
+            if (offset == SEQ_REST)
+                return -1;
+            int note = held[numHeld - 1] + offset;
+            if (note < 0 || note > 127)
+                return -1;
+            playing = note;
+            return note;
+        }
+
+        lastNote = NextArpNote();
+        playing = lastNote;
+        return lastNote;
+    }
+
+    inline int GetPlaying() const { return playing; }
+
+    /* Rod stopped or mode changed, the caller releases GetPlaying() first */
+    void Stop()
+    {
+        playing = -1;
+        numPending = 0;
+        stepIndex = 0;
+        lastNote = -1;
+        orderIndex = -1;
+    }
+};
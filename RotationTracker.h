@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <math.h>
+
+/* Loop gains on the phase error at each edge, in pulses */
+#define ROTATION_PHASE_GAIN 0.5f
+#define ROTATION_RATE_GAIN 0.15f
+/* No edge for this long and the rod is treated as stopped */
+#define ROTATION_TIMEOUT_US 500000
+/*
+  Last edge this late (pulses) and the rod is slowing, so the next late
+  edge is taken as the next one rather than as missed edges
+*/
+#define ROTATION_SLOWING_ERR 0.05f
+
+/*
+  Software PLL on one rod's breakbeam edges, estimating its angle between
+  them. Position is counted in pulses (edges), so the fractional part is
+  where the rod is between two edges and an integer lands on an edge.
+
+  Each edge pulls the estimate towards the nearest whole pulse and
+  corrects the rate, O(1) per edge. Between edges the position advances
+  at control rate but never past the next edge, so a rod that slows or
+  stops holds there instead of running ahead, and the first edge after a
+  restart lands exactly on it. An edge about a whole pulse late is taken
+  as a missed one and the count skips it, unless the rod was already
+  slowing: a rod coasting to a stop makes every edge late, and counting
+  those as misses would shift the phase by a pulse for good.
+  host/rotation_sim measures this against synthetic pulse trains.
+
+  GetPhase() is the position within a cycle of pulsesPerCycle edges, e.g.
+  one LFO cycle per revolution.
+*/
+class RotationTracker
+{
+private:
+    float sampleRate;
+    float pulsesPerCycle;
+    /* Pulses into the current cycle, unclamped estimate */
+    float pos;
+    float edgePos;
+    /* Pulses per second */
+    float rate;
+    uint32_t posUs;
+    uint32_t edgeUs;
+    bool running;
+    bool slowing;
+
+    inline static float Seconds(uint32_t later, uint32_t earlier)
+    {
+        int32_t us = int32_t(later - earlier);
+        return us > 0 ? us * 1e-6f : 0.f;
+    }
+
+public:
+    RotationTracker(){};
+    ~RotationTracker(){};
+
+    void Init(float sample_rate, int _pulsesPerCycle)
+    {
+        sampleRate = sample_rate;
+        pulsesPerCycle = _pulsesPerCycle > 0 ? _pulsesPerCycle : 1;
+        pos = edgePos = 0.f;
+        rate = 0.f;
+        posUs = edgeUs = 0;
+        running = false;
+        slowing = false;
+    }
+
+    /* Audio callback, for every edge in time order */
+    void OnEdge(uint32_t timeUs)
+    {
+        float p = pos + rate * Seconds(timeUs, posUs);
+        /* Every edge is a new one, however early */
+        float nearest = floorf(p + 0.5f);
+        if (nearest < edgePos + 1.f || slowing)
+            nearest = edgePos + 1.f;
+
+        if (!running)
+        {
+            /* Restart: the rod stopped on an edge, take it as this one */
+            pos = edgePos = floorf(edgePos + 1.f);
+            posUs = edgeUs = timeUs;
+            running = true;
+            slowing = false;
+            return;
+        }
+
+        float period = Seconds(timeUs, edgeUs);
+        float err = nearest - p;
+        if (rate <= 0.f && period > 0.f)
+        {
+            /* Second edge after a start, the period is the first estimate */
+            rate = 1.f / period;
+            err = 0.f;
+            p = nearest;
+        }
+        else if (period > 0.f)
+        {
+            slowing = err < -ROTATION_SLOWING_ERR;
+            rate += ROTATION_RATE_GAIN * err / period;
+            if (rate < 0.f)
+                rate = 0.f;
+        }
+
+        pos = p + ROTATION_PHASE_GAIN * err;
+        edgePos = nearest;
+        posUs = edgeUs = timeUs;
+
+        /* Whole cycles don't change the phase */
+        float whole = floorf(edgePos / pulsesPerCycle) * pulsesPerCycle;
+        pos -= whole;
+        edgePos -= whole;
+    }
+
+    /* Audio callback, once per block */
+    void Advance(uint32_t nowUs)
+    {
+        if (running && Seconds(nowUs, edgeUs) > ROTATION_TIMEOUT_US * 1e-6f)
+        {
+            running = false;
+            rate = 0.f;
+        }
+
+        pos += rate * Seconds(nowUs, posUs);
+        if (int32_t(nowUs - posUs) > 0)
+            posUs = nowUs;
+    }
+
+    inline bool IsRunning() const { return running && rate > 0.f; }
+    /* Position in the cycle, 0-1, held at the next edge */
+    inline float GetPhase() const
+    {
+        float p = (pos < edgePos + 1.f ? pos : edgePos + 1.f) / pulsesPerCycle;
+        return p - floorf(p);
+    }
+    /* LFO rate for SyncLfo */
+    inline float GetCyclesPerSample() const { return rate / (pulsesPerCycle * sampleRate); }
+};
@@ -0,0 +1,219 @@
+#include "daisy_seed.h"
+#include <string.h>
+
+using namespace daisy;
+
+/* Records waiting to be sent, powers of two */
+#define CAPTURE_AUDIO_RING_SIZE 1024
+#define CAPTURE_MAIN_RING_SIZE 512
+/* Bytes handed to one USB transfer, a multiple of the record size */
+#define CAPTURE_TX_SIZE 512
+#define CAPTURE_VERSION 1
+
+/* What a record's index and value mean */
+enum CaptureType
+{
+    /* Audio callback, once per block when the rods are read. value = block size */
+    CAPTURE_BLOCK,
+    /* index = rod, value = signed encoder steps this block */
+    CAPTURE_ENCODER,
+    /* index = rod, value = 1 pressed, 0 released */
+    CAPTURE_BUTTON,
+    /* index = rod. Time is the EXTI time, the record follows the block that took it */
+    CAPTURE_BREAKBEAM,
+    /* index = sensor, value = range (mm) | status << 8. Time is the read */
+    CAPTURE_RANGE,
+    /* index = pot, value = raw 16 bit ADC reading */
+    CAPTURE_POT,
+    /* value = one received byte. Time is the UART DMA callback */
+    CAPTURE_MIDI,
+    /* value = records lost to full rings since the last of these */
+    CAPTURE_DROPPED,
+};
+
+/* 8 bytes, little endian on the wire */
+struct CaptureRecord
+{
+    uint32_t timeUs;
+    uint8_t type;
+    uint8_t index;
+    uint16_t value;
+};
+
+/* Sent once at the start of every capture, 16 bytes */
+struct CaptureHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t sampleRate;
+    uint16_t blockSize;
+    uint16_t reserved;
+};
+
+/*
+  Raw sensor event capture over USB serial.
+
+  Every input the instrument reacts to is recorded as it is taken, before
+  any filtering: encoder steps, button and breakbeam edges, range samples,
+  pot readings and MIDI bytes, each with its microsecond time, plus a
+  marker for every audio block. Played back through the same classes in
+  the same order, a recording reproduces the instrument's behaviour.
+
+  The audio callback and the main loop each push into their own ring, so
+  both stay single producer. The main loop merges the two in time order
+  and streams them out; when USB can't keep up the rings fill and a
+  CAPTURE_DROPPED record says how much went missing.
+
+  Shares the USB port with the serial log, so only with DEBUG off.
+  host/capture_replay plays a recording back through the firmware.
+*/
+class SensorCapture
+{
+private:
+    UsbHandle *usb;
+    uint32_t sampleRate;
+    uint16_t blockSize;
+
+    volatile bool requested;
+    volatile bool active;
+
+    SpscRing<CaptureRecord, CAPTURE_AUDIO_RING_SIZE> audioRing;
+    SpscRing<CaptureRecord, CAPTURE_MAIN_RING_SIZE> mainRing;
+    /* One counter per producer, so neither needs a lock */
+    volatile uint32_t droppedAudio;
+    uint32_t droppedMain;
+    uint32_t droppedSent;
+
+    /*
+      A transfer only succeeds once the previous one has finished, so the
+      buffer not in flight is always free to fill
+    */
+    uint8_t txBuf[2][CAPTURE_TX_SIZE];
+    size_t txLen;
+    uint8_t txIdx;
+
+    void Append(const void *data, size_t size)
+    {
+        memcpy(&txBuf[txIdx][txLen], data, size);
+        txLen += size;
+    }
+
+    void Start()
+    {
+        /* Anything left over belongs to the last capture */
+        CaptureRecord r;
+        while (audioRing.Pop(r))
+        {
+        }
+        while (mainRing.Pop(r))
+        {
+        }
+        droppedSent = GetDropped();
+        txLen = 0;
+
+        CaptureHeader h;
+        memcpy(h.magic, "ABCR", 4);
+        h.version = CAPTURE_VERSION;
+        h.recordSize = sizeof(CaptureRecord);
+        h.sampleRate = sampleRate;
+        h.blockSize = blockSize;
+        h.reserved = 0;
+        Append(&h, sizeof(h));
+        active = true;
+    }
+
+    /* Oldest of the two rings' heads */
+    bool PopOldest(CaptureRecord &r)
+    {
+        const CaptureRecord *a = audioRing.Peek();
+        const CaptureRecord *m = mainRing.Peek();
+        if (a == NULL && m == NULL)
+            return false;
+        if (m == NULL || (a != NULL && int32_t(a->timeUs - m->timeUs) <= 0))
+            return audioRing.Pop(r);
+        return mainRing.Pop(r);
+    }
+
+public:
+    SensorCapture(){};
+    ~SensorCapture(){};
+
+    /* usb already initialised */
+    void Init(UsbHandle *_usb, float sample_rate, size_t block_size)
+    {
+        usb = _usb;
+        sampleRate = uint32_t(sample_rate);
+        blockSize = block_size;
+        requested = false;
+        active = false;
+        droppedAudio = 0;
+        droppedMain = 0;
+        droppedSent = 0;
+        txLen = 0;
+        txIdx = 0;
+    }
+
+    /* Any context. Takes effect at the next Process() */
+    inline void Request(bool on) { requested = on; }
+    inline bool IsActive() const { return active; }
+
+    /* Audio callback, or the EXTI/DMA time of something it collected */
+    void RecordAudio(CaptureType type, uint8_t index, uint16_t value, uint32_t timeUs)
+    {
+        if (!active)
+            return;
+        CaptureRecord r = {timeUs, uint8_t(type), index, value};
+        if (!audioRing.Push(r))
+            droppedAudio++;
+    }
+
+    /* Main loop */
+    void RecordMain(CaptureType type, uint8_t index, uint16_t value, uint32_t timeUs)
+    {
+        if (!active)
+            return;
+        CaptureRecord r = {timeUs, uint8_t(type), index, value};
+        if (!mainRing.Push(r))
+            droppedMain++;
+    }
+
+    /* Main loop, every pass */
+    void Process()
+    {
+        if (requested != active)
+        {
+            if (requested)
+                Start();
+            else
+                active = false;
+        }
+        if (!active && txLen == 0)
+            return;
+
+        if (active)
+        {
+            uint32_t d = GetDropped();
+            if (d != droppedSent && txLen + sizeof(CaptureRecord) <= CAPTURE_TX_SIZE)
+            {
+                uint32_t lost = d - droppedSent;
+                CaptureRecord r = {System::GetUs(), CAPTURE_DROPPED, 0, uint16_t(lost > 0xFFFF ? 0xFFFF : lost)};
+                Append(&r, sizeof(r));
+                droppedSent = d;
+            }
+
+            CaptureRecord r;
+            while (txLen + sizeof(CaptureRecord) <= CAPTURE_TX_SIZE && PopOldest(r))
+                Append(&r, sizeof(r));
+        }
+
+        if (txLen == 0)
+            return;
+        if (usb->TransmitInternal(txBuf[txIdx], txLen) != UsbHandle::Result::OK)
+            return;
+        txIdx ^= 1;
+        txLen = 0;
+    }
+
+    inline uint32_t GetDropped() const { return droppedAudio + droppedMain; }
+};
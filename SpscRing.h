@@ -0,0 +1,72 @@
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Lock-free single-producer / single-consumer ring buffer.
+
+  One side (e.g. the main loop) only calls Push, the other (e.g. the audio
+  callback) only calls Peek/Pop. Capacity must be a power of two; one slot
+  is never used so full and empty can be told apart.
+*/
+template <typename T, size_t capacity>
+class SpscRing
+{
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+private:
+    T items[capacity];
+    std::atomic<uint32_t> head{0}; // written by consumer
+    std::atomic<uint32_t> tail{0}; // written by producer
+
+public:
+    SpscRing(){};
+    ~SpscRing(){};
+
+    bool Push(const T &item)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t next = (t + 1) & (capacity - 1);
+        if (next == head.load(std::memory_order_acquire))
+            return false;
+
+        items[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /* Pointer to the oldest item, valid until Pop(), or NULL when empty */
+    const T *Peek() const
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return NULL;
+        return &items[h];
+    }
+
+    void Pop()
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        head.store((h + 1) & (capacity - 1), std::memory_order_release);
+    }
+
+    bool Pop(T &item)
+    {
+        const T *front = Peek();
+        if (front == NULL)
+            return false;
+        item = *front;
+        Pop();
+        return true;
+    }
+
+    bool IsEmpty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t Size() const
+    {
+        return (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire)) & (capacity - 1);
+    }
+};
@@ -0,0 +1,279 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  SysEx framing for whole-instrument state transfer:
+
+    F0 7D 41 01 F7                          dump request
+    F0 7D 41 02 <packed data> <checksum> F7 dump
+
+  7D is the non-commercial manufacturer ID, 41 identifies this instrument.
+  Data is 7-bit packed in groups of up to 7 bytes: one byte holding the
+  high bits (bit n = high bit of byte n) followed by the 7 low-bit bytes.
+  The checksum is the sum of the packed bytes, masked to 7 bits.
+*/
+#define SYSEX_MANUFACTURER_ID 0x7D
+#define SYSEX_DEVICE_ID 0x41
+#define SYSEX_CMD_DUMP_REQUEST 0x01
+#define SYSEX_CMD_DUMP 0x02
+/* F0, manufacturer, device, command */
+#define SYSEX_HEADER_SIZE 4
+
+inline size_t SysexPackedSize(size_t size)
+{
+    return size + (size + 6) / 7;
+}
+
+enum SysexResult
+{
+    SYSEX_RESULT_NONE,
+    SYSEX_RESULT_REQUEST,
+    SYSEX_RESULT_DUMP,
+};
+
+/*
+  Incremental SysEx decoder. Fed one byte at a time between F0 and F7 and
+  unpacks straight into the destination buffer, so a dump is never held
+  in packed form. The destination is only valid once TakeResult() returns
+  SYSEX_RESULT_DUMP; a failed transfer leaves it partly overwritten.
+
+  Results are kept as flags until taken, so a request and a dump that both
+  finish before the main loop looks are not lost.
+*/
+class SysexDecoder
+{
+private:
+    uint8_t *dest;
+    size_t destSize;
+    size_t packedSize;
+
+    /* Bytes seen since F0 */
+    size_t count;
+    size_t packedPos;
+    size_t destPos;
+    uint8_t highBits;
+    uint8_t checksum;
+    uint8_t command;
+    /* Header matched this instrument */
+    bool ours;
+    bool valid;
+    bool accepting;
+
+    /* 1 << SysexResult for each result not yet taken */
+    uint8_t results;
+    uint32_t errors;
+
+public:
+    SysexDecoder(){};
+    ~SysexDecoder(){};
+
+    void Init(void *buffer, size_t size)
+    {
+        dest = (uint8_t *)buffer;
+        destSize = size;
+        packedSize = SysexPackedSize(size);
+        accepting = true;
+        valid = false;
+        ours = false;
+        command = 0;
+        results = 0;
+        errors = 0;
+    }
+
+    /*
+      While false, dumps are ignored so the buffer can be used elsewhere.
+      Stopping also cancels a dump half way through and drops one not yet
+      taken, since either would be overwritten.
+    */
+    void SetAccepting(bool accept)
+    {
+        accepting = accept;
+        if (accept)
+            return;
+
+        if (valid && count > 2 && command == SYSEX_CMD_DUMP)
+            valid = false;
+        results &= ~(1u << SYSEX_RESULT_DUMP);
+    }
+
+    /* After F0 */
+    void Begin()
+    {
+        count = 0;
+        packedPos = 0;
+        destPos = 0;
+        checksum = 0;
+        command = 0;
+        ours = false;
+        valid = true;
+    }
+
+    /* Data byte between F0 and F7 */
+    void Feed(uint8_t b)
+    {
+        if (!valid)
+            return;
+
+        switch (count++)
+        {
+        case 0:
+            valid = b == SYSEX_MANUFACTURER_ID;
+            return;
+        case 1:
+            valid = b == SYSEX_DEVICE_ID;
+            return;
+        case 2:
+            command = b;
+            ours = true;
+            valid = b == SYSEX_CMD_DUMP_REQUEST || (b == SYSEX_CMD_DUMP && accepting);
+            return;
+        default:
+            break;
+        }
+
+        if (command != SYSEX_CMD_DUMP || packedPos > packedSize)
+        {
+            valid = false;
+            return;
+        }
+
+        if (packedPos == packedSize)
+        {
+            valid = b == (checksum & 0x7F);
+            packedPos++;
+            return;
+        }
+
+        checksum += b;
+        size_t k = packedPos % 8;
+        packedPos++;
+        if (k == 0)
+        {
+            highBits = b;
+            return;
+        }
+        dest[destPos++] = b | (((highBits >> (k - 1)) & 1) << 7);
+    }
+
+    /* On F7 */
+    void End()
+    {
+        if (valid && command == SYSEX_CMD_DUMP_REQUEST && count == 3)
+        {
+            results |= 1u << SYSEX_RESULT_REQUEST;
+        }
+        else if (valid && command == SYSEX_CMD_DUMP && packedPos == packedSize + 1)
+        {
+            results |= 1u << SYSEX_RESULT_DUMP;
+        }
+        else if (ours)
+        {
+            errors++;
+        }
+        valid = false;
+    }
+
+    /* A status byte other than realtime or F7 cut the message short */
+    void Abort()
+    {
+        if (valid && ours)
+            errors++;
+        valid = false;
+    }
+
+    /* True, once, if r has come in since it was last taken */
+    bool TakeResult(SysexResult r)
+    {
+        bool pending = results & (1u << r);
+        results &= ~(1u << r);
+        return pending;
+    }
+
+    /* Next pending result, dumps first */
+    SysexResult TakeResult()
+    {
+        if (TakeResult(SYSEX_RESULT_DUMP))
+            return SYSEX_RESULT_DUMP;
+        if (TakeResult(SYSEX_RESULT_REQUEST))
+            return SYSEX_RESULT_REQUEST;
+        return SYSEX_RESULT_NONE;
+    }
+
+    uint32_t GetErrors() const { return errors; }
+};
+
+/* Produces a complete dump message a chunk at a time */
+class SysexEncoder
+{
+private:
+    const uint8_t *src;
+    size_t srcSize;
+    size_t packedSize;
+    /* Next byte of the whole message, F0 included */
+    size_t pos;
+    uint8_t checksum;
+
+    uint8_t PackedByte(size_t p) const
+    {
+        size_t group = (p / 8) * 7;
+        size_t k = p % 8;
+        if (k > 0)
+            return src[group + k - 1] & 0x7F;
+
+        uint8_t highBits = 0;
+        for (size_t j = 0; j < 7 && group + j < srcSize; j++)
+        {
+            highBits |= (src[group + j] >> 7) << j;
+        }
+        return highBits;
+    }
+
+public:
+    SysexEncoder(){};
+    ~SysexEncoder(){};
+
+    void Begin(const void *data, size_t size)
+    {
+        src = (const uint8_t *)data;
+        srcSize = size;
+        packedSize = SysexPackedSize(size);
+        pos = 0;
+        checksum = 0;
+    }
+
+    /* Total message length, F0 to F7 */
+    size_t MessageSize() const { return SYSEX_HEADER_SIZE + packedSize + 2; }
+
+    bool IsDone() const { return pos >= MessageSize(); }
+
+    /* Copies up to max bytes of the message into out, returns the count */
+    size_t Read(uint8_t *out, size_t max)
+    {
+        size_t n = 0;
+        while (n < max && !IsDone())
+        {
+            uint8_t b;
+            if (pos == 0)
+                b = 0xF0;
+            else if (pos == 1)
+                b = SYSEX_MANUFACTURER_ID;
+            else if (pos == 2)
+                b = SYSEX_DEVICE_ID;
+            else if (pos == 3)
+                b = SYSEX_CMD_DUMP;
+            else if (pos < SYSEX_HEADER_SIZE + packedSize)
+            {
+                b = PackedByte(pos - SYSEX_HEADER_SIZE);
+                checksum += b;
+            }
+            else if (pos == SYSEX_HEADER_SIZE + packedSize)
+                b = checksum & 0x7F;
+            else
+                b = 0xF7;
+
+            out[n++] = b;
+            pos++;
+        }
+        return n;
+    }
+};
@@ -13,8 +13,10 @@ public:
     void Init(float sample_rate)
     {
         active_ = false;
+        env_gate_ = false;
+        note_ = -1;
+        lastAmp_ = 0.f;
         velocity_ = 1.f;
-        startTime = 0.f;
         env_.Init(sample_rate, 1);
         setADSR(0.005f, 0.1f, 0.5f, 0.2f);
     }
@@ -54,8 +56,10 @@ public:
             {
                 active_ = false;
             }
-            return amp * velocity_;
+            lastAmp_ = amp * velocity_;
+            return lastAmp_;
         }
+        lastAmp_ = 0.f;
         return 0.f;
     }
 
@@ -63,12 +67,12 @@ public:
     {
         note_ = note;
         velocity_ = sqrt(newVelocity / 127.f);
-        startTime = System::GetNow();
     }
 
-    uint32_t GetStartTime()
+    /* Legato: new pitch, same envelope and velocity */
+    void SetNote(int note)
     {
-        return startTime;
+        note_ = note;
     }
 
     void TriggerNote()
@@ -90,21 +94,68 @@ public:
     inline bool IsActive() const { return active_; }
     inline bool IsEnvGate() const { return env_gate_; }
     inline int GetNote() const { return note_; }
+    inline float GetLastAmp() const { return lastAmp_; }
 
 private:
     Adsr env_;
     int note_;
-    uint32_t startTime;
     float velocity_;
+    float lastAmp_;
     bool active_;
     bool env_gate_;
 };
 
 /* ========================= Polyphony Voice Manager ========================= */
 
+#define NUM_MIDI_CHANNELS 16
+/* Internal channels after the MIDI ones, one per rod sequencer */
+#define SEQ_CHANNEL_FIRST NUM_MIDI_CHANNELS
+#define NUM_VOICE_CHANNELS (NUM_MIDI_CHANNELS + NUM_RODS)
+#define ALL_RODS_MASK 0x0F
+
+/* Which held voice to take when every voice is in use */
+enum StealPolicy
+{
+    STEAL_OLDEST,
+    STEAL_QUIETEST,
+    STEAL_LOWEST,
+    STEAL_HIGHEST,
+};
+
+/* Settings for the voices playing one MIDI channel */
+struct VoicePool
+{
+    float attack;
+    float decay;
+    float sustain;
+    float release;
+    /* Max notes held at once on this channel */
+    uint8_t polyphony;
+    /* Bit n set = rod n plays this channel */
+    uint8_t rodMask;
+    /* Only used with a polyphony of 1 */
+    uint8_t notePriority;
+    uint8_t legato;
+    /* Glide time in seconds, 0 = off */
+    float glide;
+};
+
+/*
+  Every MIDI channel plays through a VoicePool (by default its own, but
+  several channels can share one, e.g. MPE member channels) and all pools
+  share the same voice array. Voices live in intrusive lists:
+    freeList       - idle or releasing, least recently released at the head;
+                     allocation takes the first idle voice, so a release
+                     tail is only cut when no voice is silent
+    heldList[pool] - gate on in that pool, oldest allocation at the head
+  plus a (channel, note) -> voice index so note on/off never scan the voice
+  array. A voice only takes its pool's envelope when it changes pool.
+*/
 template <size_t max_voices>
 class VoiceManager
 {
+    static_assert(max_voices < 255, "voice indices are stored as uint8_t");
+
 public:
     VoiceManager() {}
     ~VoiceManager() {}
@@ -112,16 +163,42 @@ public:
     void Init(float sample_rate)
     {
         currentPolyphony = max_voices;
+        stealPolicy = STEAL_OLDEST;
+        allocCounter = 0;
+        panelPools = (1u << NUM_VOICE_CHANNELS) - 1;
         for (size_t i = 0; i < max_voices; i++)
         {
             voices[i].Init(sample_rate);
+            voicePool[i] = 0;
+            voiceNoteChannel[i] = 0;
+        }
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
+        {
+            VoicePool &pool = pools[c];
+            pool.attack = 0.005f;
+            pool.decay = 0.1f;
+            pool.sustain = 0.5f;
+            pool.release = 0.2f;
+            pool.polyphony = max_voices;
+            pool.rodMask = ALL_RODS_MASK;
+            pool.notePriority = 0;
+            pool.legato = false;
+            pool.glide = 0.0f;
+            channelPool[c] = c;
         }
+        ResetLists();
     }
 
     void SetCurrentPolyphony(size_t numVoices)
     {
         FreeAllVoices();
         currentPolyphony = numVoices;
+        ResetLists();
+    }
+
+    void SetStealPolicy(StealPolicy policy)
+    {
+        stealPolicy = policy;
     }
 
     float Process()
@@ -140,62 +217,177 @@ public:
         return voices;
     }
 
-    void setADSR(float a, float d, float s, float r)
+    inline uint8_t GetRodMask(size_t voice) const { return pools[voicePool[voice]].rodMask; }
+    /* MIDI channel of the note the voice was last given */
+    inline uint8_t GetVoiceChannel(size_t voice) const { return voiceNoteChannel[voice]; }
+
+    /* Route notes on channel through another channel's pool */
+    void SetChannelPool(int channel, int pool)
     {
+        channelPool[channel] = pool;
+    }
+
+    /* ---- Per channel settings ---- */
+
+    void SetPoolADSR(int channel, float a, float d, float s, float r)
+    {
+        VoicePool &pool = pools[channel];
+        pool.attack = a;
+        pool.decay = d;
+        pool.sustain = s;
+        pool.release = r;
         for (size_t i = 0; i < max_voices; i++)
         {
-            voices[i].setADSR(a, d, s, r);
+            if (voicePool[i] == channel)
+                voices[i].setADSR(a, d, s, r);
         }
     }
 
-    void SetAttack(float v)
+    void SetPoolPolyphony(int channel, size_t numVoices)
+    {
+        pools[channel].polyphony = numVoices < max_voices ? numVoices : max_voices;
+    }
+
+    void SetPoolRodMask(int channel, uint8_t mask)
+    {
+        pools[channel].rodMask = mask;
+    }
+
+    void SetPoolNotePriority(int channel, uint8_t priority)
+    {
+        pools[channel].notePriority = priority;
+    }
+
+    void SetPoolLegato(int channel, bool legato)
+    {
+        pools[channel].legato = legato;
+    }
+
+    void SetPoolGlide(int channel, float seconds)
+    {
+        pools[channel].glide = seconds;
+    }
+
+    inline const VoicePool &GetPool(int channel) const { return pools[channel]; }
+
+    /* Pool notes on channel play through, e.g. the manager pool for an MPE member */
+    inline int GetChannelPoolIndex(int channel) const { return channelPool[channel]; }
+
+    /* Settings of the pool notes on channel play through */
+    inline const VoicePool &GetChannelPool(int channel) const { return pools[channelPool[channel]]; }
+
+    inline bool IsMono(int channel) const { return GetChannelPool(channel).polyphony == 1; }
+
+    void LoadPool(int channel, const VoicePool &pool)
+    {
+        SetPoolADSR(channel, pool.attack, pool.decay, pool.sustain, pool.release);
+        SetPoolPolyphony(channel, pool.polyphony);
+        SetPoolRodMask(channel, pool.rodMask);
+        SetPoolNotePriority(channel, pool.notePriority);
+        SetPoolLegato(channel, pool.legato);
+        SetPoolGlide(channel, pool.glide);
+    }
+
+    void SetAttack(int channel, float v)
     {
+        pools[channel].attack = v;
         for (size_t i = 0; i < max_voices; i++)
         {
-            voices[i].SetAttack(v);
+            if (voicePool[i] == channel)
+                voices[i].SetAttack(v);
         }
     }
-    void SetDecay(float v)
+    void SetDecay(int channel, float v)
     {
+        pools[channel].decay = v;
         for (size_t i = 0; i < max_voices; i++)
         {
-            voices[i].SetDecay(v);
+            if (voicePool[i] == channel)
+                voices[i].SetDecay(v);
         }
     }
-    void SetSustain(float v)
+    void SetSustain(int channel, float v)
     {
+        pools[channel].sustain = v;
         for (size_t i = 0; i < max_voices; i++)
         {
-            voices[i].SetSustain(v);
+            if (voicePool[i] == channel)
+                voices[i].SetSustain(v);
         }
     }
-    void SetRelease(float v)
+    void SetRelease(int channel, float v)
     {
+        pools[channel].release = v;
         for (size_t i = 0; i < max_voices; i++)
         {
-            voices[i].SetRelease(v);
+            if (voicePool[i] == channel)
+                voices[i].SetRelease(v);
         }
     }
-    // void OnNoteOn(int noteNumber, int velocity)
-    // {
-    //   Voice *v = FindFreeVoice(noteNumber);
-    //   if (v == NULL)
-    //     return;
-    //   v->OnNoteOn(noteNumber, velocity);
-    // }
 
-    void OnNoteOff(int noteNumber, int velocity)
+    /*
+      ---- Front panel pots ----
+      Only the pools in the panel mask follow the pots, so channels with
+      their own envelope (presets, the sequencers) keep it.
+    */
+
+    void SetPanelPools(uint32_t mask)
     {
-        for (size_t i = 0; i < currentPolyphony; i++)
+        panelPools = mask;
+    }
+
+    void SetAttack(float v)
+    {
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
         {
-            Voice *v = &voices[i];
-            if (v->IsActive() && v->GetNote() == noteNumber)
-            {
-                v->OnNoteOff();
-            }
+            if ((panelPools >> c) & 1)
+                SetAttack(c, v);
+        }
+    }
+    void SetDecay(float v)
+    {
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
+        {
+            if ((panelPools >> c) & 1)
+                SetDecay(c, v);
+        }
+    }
+    void SetSustain(float v)
+    {
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
+        {
+            if ((panelPools >> c) & 1)
+                SetSustain(c, v);
+        }
+    }
+    void SetRelease(float v)
+    {
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
+        {
+            if ((panelPools >> c) & 1)
+                SetRelease(c, v);
         }
     }
 
+    void OnNoteOff(int channel, int noteNumber, int velocity)
+    {
+        if (noteNumber < 0 || noteNumber > 127)
+            return;
+
+        uint8_t idx = noteToVoice[channel][noteNumber];
+        if (idx == NO_VOICE || !inHeld[idx])
+            return;
+
+        voices[idx].OnNoteOff();
+
+        /* Keep the note mapped so a quick re-press reuses this voice */
+        uint8_t pool = voicePool[idx];
+        Unlink(heldList[pool], idx);
+        PushBack(freeList, idx);
+        inHeld[idx] = false;
+        heldCount[pool]--;
+    }
+
     void FreeAllVoices()
     {
         for (size_t i = 0; i < max_voices; i++)
@@ -204,56 +396,225 @@ public:
         }
     }
 
-    Voice *FindFreeVoice(int noteNumber)
+    /*
+      Mono legato: the held voice playing oldNote on channel carries on as
+      newNote without retriggering. Returns the voice, or -1 if oldNote no
+      longer has one (e.g. it was stolen).
+    */
+    int RetuneVoice(int channel, int oldNote, int newNote)
+    {
+        if (oldNote < 0 || oldNote > 127 || newNote < 0 || newNote > 127)
+            return -1;
+
+        uint8_t idx = noteToVoice[channel][oldNote];
+        if (idx == NO_VOICE || !inHeld[idx])
+            return -1;
+
+        noteToVoice[channel][oldNote] = NO_VOICE;
+        noteToVoice[channel][newNote] = idx;
+        voices[idx].SetNote(newNote);
+        return idx;
+    }
+
+    /*
+      Claims a voice for noteNumber on channel and moves it to the back of
+      the held list of the channel's pool. Returns the voice index, or -1 if the note
+      is out of range. The caller still sets the note and triggers the
+      envelope.
+    */
+    int AllocateVoice(int channel, int noteNumber)
     {
-        if (currentPolyphony == 1)
+        if (noteNumber < 0 || noteNumber > 127)
+            return -1;
+
+        /* Re-trigger if same note */
+        uint8_t idx = noteToVoice[channel][noteNumber];
+
+        /*
+          Pool already at its own polyphony limit. A released voice still
+          mapped to this note would add to the held count, so it counts as
+          a new voice too.
+        */
+        uint8_t pool = channelPool[channel];
+        if ((idx == NO_VOICE || !inHeld[idx]) && heldCount[pool] >= pools[pool].polyphony)
         {
-            return &voices[0];
+            uint8_t stolen = FindVoiceToSteal(pool, pool + 1);
+            if (stolen != NO_VOICE)
+                idx = stolen;
         }
 
-        /* Re-trigger if same note */
-        for (size_t i = 0; i < currentPolyphony; i++)
+        /* Idle voice, else the least recently released one */
+        if (idx == NO_VOICE)
+            idx = FindFreeVoice();
+
+        if (idx == NO_VOICE)
+            idx = FindVoiceToSteal(0, NUM_VOICE_CHANNELS);
+
+        Claim(idx, channel, noteNumber);
+        return idx;
+    }
+
+private:
+    static constexpr uint8_t NO_VOICE = 0xFF;
+
+    struct VoiceList
+    {
+        uint8_t head;
+        uint8_t tail;
+    };
+
+    Voice voices[max_voices];
+    size_t currentPolyphony;
+
+    VoicePool pools[NUM_VOICE_CHANNELS];
+
+    StealPolicy stealPolicy;
+    /* Bit c set = pool c follows the front panel pots */
+    uint32_t panelPools;
+
+    /* Monotonic, so chords arriving in the same millisecond still order */
+    uint32_t allocCounter;
+    uint32_t allocOrder[max_voices];
+
+    uint8_t noteToVoice[NUM_VOICE_CHANNELS][128];
+    uint8_t channelPool[NUM_VOICE_CHANNELS];
+    uint8_t voicePool[max_voices];
+    uint8_t voiceNoteChannel[max_voices];
+    uint8_t prevVoice[max_voices];
+    uint8_t nextVoice[max_voices];
+    bool inHeld[max_voices];
+    VoiceList freeList;
+    VoiceList heldList[NUM_VOICE_CHANNELS];
+    uint8_t heldCount[NUM_VOICE_CHANNELS];
+
+    void ResetLists()
+    {
+        for (size_t c = 0; c < NUM_VOICE_CHANNELS; c++)
         {
-            if (voices[i].GetNote() == noteNumber)
+            for (size_t n = 0; n < 128; n++)
             {
-                return &voices[i];
-                break;
+                noteToVoice[c][n] = NO_VOICE;
             }
+            heldList[c].head = heldList[c].tail = NO_VOICE;
+            heldCount[c] = 0;
         }
 
-        /* Find inactive voice */
-        for (size_t i = 0; i < currentPolyphony; i++)
+        freeList.head = freeList.tail = NO_VOICE;
+        for (size_t i = 0; i < max_voices; i++)
+        {
+            allocOrder[i] = 0;
+            inHeld[i] = false;
+            if (i < currentPolyphony)
+                PushBack(freeList, i);
+        }
+    }
+
+    uint8_t FindFreeVoice()
+    {
+        for (uint8_t i = freeList.head; i != NO_VOICE; i = nextVoice[i])
         {
             if (!voices[i].IsActive())
-            {
-                return &voices[i];
-            }
+                return i;
         }
+        return freeList.head;
+    }
 
-        /* Find voices in the release phase */
-        for (size_t i = 0; i < currentPolyphony; i++)
+    void PushBack(VoiceList &list, uint8_t idx)
+    {
+        prevVoice[idx] = list.tail;
+        nextVoice[idx] = NO_VOICE;
+        if (list.tail != NO_VOICE)
+            nextVoice[list.tail] = idx;
+        else
+            list.head = idx;
+        list.tail = idx;
+    }
+
+    void Unlink(VoiceList &list, uint8_t idx)
+    {
+        if (prevVoice[idx] != NO_VOICE)
+            nextVoice[prevVoice[idx]] = nextVoice[idx];
+        else
+            list.head = nextVoice[idx];
+
+        if (nextVoice[idx] != NO_VOICE)
+            prevVoice[nextVoice[idx]] = prevVoice[idx];
+        else
+            list.tail = prevVoice[idx];
+    }
+
+    void Claim(uint8_t idx, int channel, int noteNumber)
+    {
+        uint8_t oldPool = voicePool[idx];
+        uint8_t oldChannel = voiceNoteChannel[idx];
+        uint8_t pool = channelPool[channel];
+
+        /* Drop the mapping of whatever note the voice played before */
+        int oldNote = voices[idx].GetNote();
+        if (oldNote >= 0 && oldNote < 128 && noteToVoice[oldChannel][oldNote] == idx)
+            noteToVoice[oldChannel][oldNote] = NO_VOICE;
+        noteToVoice[channel][noteNumber] = idx;
+        voiceNoteChannel[idx] = channel;
+
+        if (inHeld[idx])
         {
-            if (!voices[i].IsEnvGate())
-            {
-                return &voices[i];
-            }
+            Unlink(heldList[oldPool], idx);
+            heldCount[oldPool]--;
+        }
+        else
+        {
+            Unlink(freeList, idx);
         }
+        PushBack(heldList[pool], idx);
+        inHeld[idx] = true;
+        heldCount[pool]++;
+        allocOrder[idx] = ++allocCounter;
 
-        /* Steal oldest voice */
-        Voice *oldest = &voices[0];
+        /* Only pay for the envelope update when the voice changes pool */
+        if (oldPool != pool)
+        {
+            VoicePool &settings = pools[pool];
+            voices[idx].setADSR(settings.attack, settings.decay, settings.sustain, settings.release);
+            voicePool[idx] = pool;
+        }
+    }
 
-        for (size_t i = 1; i < currentPolyphony; i++)
+    /*
+      Picks a held voice from pools [firstPool, lastPool).
+      STEAL_OLDEST only compares list heads.
+    */
+    uint8_t FindVoiceToSteal(size_t firstPool, size_t lastPool)
+    {
+        uint8_t best = NO_VOICE;
+        for (size_t c = firstPool; c < lastPool; c++)
         {
-            if (voices[i].GetStartTime() < oldest->GetStartTime())
+            uint8_t i = heldList[c].head;
+            while (i != NO_VOICE)
             {
-                oldest = &voices[i];
+                if (best == NO_VOICE || IsBetterSteal(i, best))
+                    best = i;
+                if (stealPolicy == STEAL_OLDEST)
+                    break;
+                i = nextVoice[i];
             }
         }
-
-        return oldest;
+        return best;
     }
 
-private:
-    Voice voices[max_voices];
-    size_t currentPolyphony;
+    bool IsBetterSteal(uint8_t candidate, uint8_t best)
+    {
+        Voice &v = voices[candidate];
+        Voice &b = voices[best];
+        switch (stealPolicy)
+        {
+        case STEAL_QUIETEST:
+            return v.GetLastAmp() < b.GetLastAmp();
+        case STEAL_LOWEST:
+            return v.GetNote() < b.GetNote();
+        case STEAL_HIGHEST:
+            return v.GetNote() > b.GetNote();
+        default:
+            return allocOrder[candidate] < allocOrder[best];
+        }
+    }
 };
@@ -0,0 +1,536 @@
+/*
+  Replays a sensor capture (SensorCapture.h) through the whole firmware.
+
+  AbcsFirmwareV2.cpp is built here against the host stand-ins, with its
+  main() renamed so Setup() and Loop() can be driven from here. Every
+  recorded input goes back in where it was taken, at its recorded time:
+
+    encoder steps, button edges   into the rod's Encoder before its block
+    breakbeam edges               the pin toggled and the EXTI handler run
+    range samples                 DistanceSensorManager::FeedSample
+    pot readings                  the ADC, read by the next pot update
+    MIDI bytes                    the UART's receive callback
+
+  Each audio block runs the real AudioCallback at its recorded time, and
+  a main loop pass runs after each group of main loop records. Time only
+  moves with the recording, so a replay is deterministic and runs as fast
+  as the host can go. The I2C bus NACKs everything, so the only ranges are
+  the recorded ones. The firmware starts from power on, not from whatever
+  state the instrument was in when the capture began.
+
+    capture_replay                    self test on a generated recording
+    capture_replay in.abcr            replay, summary and timing
+    capture_replay in.abcr out.wav    also write the output, 32 bit float
+
+  The summary ends with a hash of the output, which only changes when the
+  firmware's response to the recording does.
+*/
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define main FirmwareMain
+#include "../AbcsFirmwareV2.cpp"
+#undef main
+
+#define REPLAY_SAMPLE_RATE 48000
+/* Setup() runs this long before the first record */
+#define REPLAY_BOOT_US 300000
+#define REPLAY_MAX_FRAMES 256
+
+static const uint8_t breakbeamPins[NUM_RODS] = {PIN_BREAKBEAM_IN_1, PIN_BREAKBEAM_IN_2, PIN_BREAKBEAM_IN_3, PIN_BREAKBEAM_IN_4};
+static const uint8_t encoderPins[NUM_RODS] = {PIN_ENC_1_A, PIN_ENC_2_A, PIN_ENC_3_A, PIN_ENC_4_A};
+
+/* Every transfer NACKs: sensors stay dead and only recorded ranges arrive */
+struct NackBus : I2CHandle::Bus
+{
+    I2CHandle::Result Blocking(uint16_t, uint8_t *, uint16_t, bool, uint32_t) override
+    {
+        return I2CHandle::Result::ERR;
+    }
+    I2CHandle::Result Dma(uint16_t, uint8_t *, uint16_t, bool, I2CHandle::CallbackFunctionPtr, void *) override
+    {
+        return I2CHandle::Result::ERR;
+    }
+};
+
+/* A block record and the audio records that followed it */
+struct ReplayBlock
+{
+    const CaptureRecord *block;
+    const CaptureRecord *inputs[NUM_RODS * (EDGE_RING_SIZE + 2)];
+    size_t numInputs;
+};
+
+struct ReplayStats
+{
+    size_t records[CAPTURE_DROPPED + 1];
+    size_t unknown;
+    size_t orphans;
+    uint32_t dropped;
+    uint32_t startUs;
+    uint32_t endUs;
+    size_t frames;
+    size_t passes;
+    double sumSq;
+    float peak;
+    uint64_t hash;
+    double audioNs;
+    double totalNs;
+};
+
+/* Wrap-safe, relative to the first record */
+static uint32_t baseUs;
+static inline int32_t Rel(uint32_t timeUs)
+{
+    return int32_t(timeUs - baseUs);
+}
+
+static void WriteWavHeader(FILE *f, size_t frames)
+{
+    uint32_t dataSize = uint32_t(frames * 2 * sizeof(float));
+    uint32_t riffSize = 36 + dataSize;
+    uint32_t fmtSize = 16, rate = REPLAY_SAMPLE_RATE, byteRate = rate * 2 * sizeof(float);
+    uint16_t format = 3, channels = 2, align = 2 * sizeof(float), bits = 32;
+    fwrite("RIFF", 1, 4, f);
+    fwrite(&riffSize, 4, 1, f);
+    fwrite("WAVEfmt ", 1, 8, f);
+    fwrite(&fmtSize, 4, 1, f);
+    fwrite(&format, 2, 1, f);
+    fwrite(&channels, 2, 1, f);
+    fwrite(&rate, 4, 1, f);
+    fwrite(&byteRate, 4, 1, f);
+    fwrite(&align, 2, 1, f);
+    fwrite(&bits, 2, 1, f);
+    fwrite("data", 1, 4, f);
+    fwrite(&dataSize, 4, 1, f);
+}
+
+/* One block's encoder, button and breakbeam records, then the block */
+static void RunBlock(const ReplayBlock &b, ReplayStats &st, FILE *wav)
+{
+    for (size_t i = 0; i < b.numInputs; i++)
+    {
+        const CaptureRecord &r = *b.inputs[i];
+        if (r.type == CAPTURE_ENCODER)
+            Encoder::Find(DaisySeed::GetPin(encoderPins[r.index]))->Turn(int16_t(r.value));
+        else if (r.type == CAPTURE_BUTTON)
+            Encoder::Find(DaisySeed::GetPin(encoderPins[r.index]))->SetPressed(r.value != 0);
+        else
+        {
+            /* The recorded edge already passed EdgeCapture's checks once */
+            dsy_gpio_pin pin = DaisySeed::GetPin(breakbeamPins[r.index]);
+            hostGpioLow[pin.port][pin.pin] = !hostGpioLow[pin.port][pin.pin];
+            hostUs = r.timeUs;
+            hostExtiPending |= 1u << pin.pin;
+            DispatchEdges(pin.pin, pin.pin);
+        }
+    }
+
+    static float in[REPLAY_MAX_FRAMES * 2];
+    static float out[REPLAY_MAX_FRAMES * 2];
+    size_t frames = b.block->value;
+    hostUs = b.block->timeUs;
+    auto t0 = std::chrono::steady_clock::now();
+    AudioCallback(in, out, frames * 2);
+    st.audioNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+    for (size_t i = 0; i < frames * 2; i++)
+    {
+        float s = out[i];
+        st.sumSq += double(s) * s;
+        if (fabsf(s) > st.peak)
+            st.peak = fabsf(s);
+        /* FNV-1a over the sample bits */
+        uint32_t bits;
+        memcpy(&bits, &s, 4);
+        for (size_t k = 0; k < 4; k++)
+        {
+            st.hash ^= (bits >> (k * 8)) & 0xFF;
+            st.hash *= 1099511628211ull;
+        }
+    }
+    st.frames += frames;
+    if (wav != NULL)
+        fwrite(out, sizeof(float), frames * 2, wav);
+}
+
+/*
+  Replays `size` bytes of capture. The firmware's globals are only set up
+  once, so this runs once per process.
+*/
+static bool Replay(const uint8_t *data, size_t size, ReplayStats &st, FILE *wav)
+{
+    memset(&st, 0, sizeof(st));
+    st.hash = 14695981039346656037ull;
+
+    CaptureHeader h;
+    if (size < sizeof(h))
+    {
+        fprintf(stderr, "capture_replay: no header\n");
+        return false;
+    }
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, "ABCR", 4) != 0 || h.version != CAPTURE_VERSION || h.recordSize != sizeof(CaptureRecord))
+    {
+        fprintf(stderr, "capture_replay: not a version %d capture\n", CAPTURE_VERSION);
+        return false;
+    }
+    if (h.sampleRate != REPLAY_SAMPLE_RATE || h.blockSize == 0 || h.blockSize > REPLAY_MAX_FRAMES)
+    {
+        fprintf(stderr, "capture_replay: %u Hz, %u frame blocks can't be replayed\n", (unsigned)h.sampleRate,
+                (unsigned)h.blockSize);
+        return false;
+    }
+
+    const CaptureRecord *records = (const CaptureRecord *)(data + sizeof(h));
+    size_t numRecords = (size - sizeof(h)) / sizeof(CaptureRecord);
+    if (numRecords == 0)
+    {
+        fprintf(stderr, "capture_replay: no records\n");
+        return false;
+    }
+    baseUs = records[0].timeUs;
+
+    /*
+      Audio records stay with the block that took them. Main loop records
+      are merged with the blocks by time, as the capture wrote them.
+    */
+    ReplayBlock *blocks = (ReplayBlock *)calloc(numRecords, sizeof(ReplayBlock));
+    const CaptureRecord **mains = (const CaptureRecord **)calloc(numRecords, sizeof(CaptureRecord *));
+    const CaptureRecord **pots = (const CaptureRecord **)calloc(numRecords, sizeof(CaptureRecord *));
+    size_t numBlocks = 0, numMains = 0, numPots = 0;
+    for (size_t i = 0; i < numRecords; i++)
+    {
+        const CaptureRecord &r = records[i];
+        if (r.type > CAPTURE_DROPPED)
+        {
+            st.unknown++;
+            continue;
+        }
+        st.records[r.type]++;
+        switch (r.type)
+        {
+        case CAPTURE_BLOCK:
+            if (r.value == 0 || r.value > REPLAY_MAX_FRAMES)
+            {
+                st.unknown++;
+                break;
+            }
+            blocks[numBlocks].block = &r;
+            blocks[numBlocks].numInputs = 0;
+            numBlocks++;
+            break;
+        case CAPTURE_ENCODER:
+        case CAPTURE_BUTTON:
+        case CAPTURE_BREAKBEAM:
+        {
+            ReplayBlock *b = numBlocks ? &blocks[numBlocks - 1] : NULL;
+            if (b == NULL || r.index >= NUM_RODS || b->numInputs >= sizeof(b->inputs) / sizeof(b->inputs[0]))
+                st.orphans++;
+            else
+                b->inputs[b->numInputs++] = &r;
+            break;
+        }
+        case CAPTURE_RANGE:
+        case CAPTURE_MIDI:
+            if (r.type == CAPTURE_RANGE && r.index >= NUM_SENSORS)
+                st.orphans++;
+            else
+                mains[numMains++] = &r;
+            break;
+        case CAPTURE_POT:
+            if (r.index >= NUM_POTS)
+                st.orphans++;
+            else
+            {
+                mains[numMains++] = &r;
+                pots[numPots++] = &r;
+            }
+            break;
+        case CAPTURE_DROPPED:
+            st.dropped += r.value;
+            break;
+        }
+    }
+    /* A range is recorded at its read time, which can be before the pass */
+    std::stable_sort(mains, mains + numMains,
+                     [](const CaptureRecord *a, const CaptureRecord *b) { return Rel(a->timeUs) < Rel(b->timeUs); });
+    st.startUs = records[0].timeUs;
+    st.endUs = records[numRecords - 1].timeUs;
+
+    /* The pots' first readings are there from power on */
+    for (size_t i = 0; i < numPots; i++)
+    {
+        if (Rel(pots[i]->timeUs) != Rel(pots[0]->timeUs))
+            break;
+        hw.adc.Set(pots[i]->index, pots[i]->value);
+    }
+
+    static NackBus bus;
+    I2CHandle::bus = &bus;
+    hostUs = baseUs - REPLAY_BOOT_US;
+    Setup();
+    if (Rel(hostUs) >= 0)
+    {
+        fprintf(stderr, "capture_replay: setup ran past the first record\n");
+        return false;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t m = 0, p = 0;
+    for (size_t b = 0; b <= numBlocks; b++)
+    {
+        /* Everything the main loop recorded up to this block */
+        while (m < numMains && (b == numBlocks || Rel(mains[m]->timeUs) <= Rel(blocks[b].block->timeUs)))
+        {
+            uint32_t passUs = mains[m]->timeUs;
+            for (; m < numMains && mains[m]->timeUs == passUs; m++)
+            {
+                const CaptureRecord &r = *mains[m];
+                if (r.type == CAPTURE_RANGE)
+                    distanceSensorManager.FeedSample(r.index, r.value & 0xFF, r.value >> 8, r.timeUs);
+                else if (r.type == CAPTURE_MIDI)
+                {
+                    uint8_t byte = r.value;
+                    hostUs = r.timeUs;
+                    if (UartHandler::listening != NULL)
+                        UartHandler::listening->Receive(&byte, 1);
+                }
+            }
+
+            /*
+              The ADC holds the next readings the firmware recorded, so a
+              pot update that comes a little early here still reads them
+            */
+            while (p < numPots && Rel(pots[p]->timeUs) < Rel(passUs))
+                p++;
+            for (size_t i = p; i < numPots && pots[i]->timeUs == pots[p]->timeUs; i++)
+                hw.adc.Set(pots[i]->index, pots[i]->value);
+
+            hostUs = passUs;
+            Loop();
+            st.passes++;
+        }
+        if (b < numBlocks)
+            RunBlock(blocks[b], st, wav);
+    }
+    st.totalNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+    free(blocks);
+    free(mains);
+    free(pots);
+    return true;
+}
+
+static void PrintSummary(const ReplayStats &st)
+{
+    static const char *names[] = {"block", "encoder", "button", "breakbeam", "range", "pot", "midi", "dropped"};
+    double seconds = (st.endUs - st.startUs) * 1e-6;
+    printf("%.3f s captured, %zu frames, %zu main loop passes\n", seconds, st.frames, st.passes);
+    for (size_t i = 0; i <= CAPTURE_DROPPED; i++)
+        printf("  %-10s %zu\n", names[i], st.records[i]);
+    if (st.dropped || st.unknown || st.orphans)
+        printf("  capture lost %u records, %zu unreadable, %zu out of place\n", (unsigned)st.dropped, st.unknown,
+               st.orphans);
+    size_t blocks = st.records[CAPTURE_BLOCK];
+    printf("output rms %.4f peak %.4f hash %016llx\n", st.frames ? sqrt(st.sumSq / (st.frames * 2)) : 0.0, st.peak,
+           (unsigned long long)st.hash);
+    printf("audio callback %.0f ns per block, replay %.1fx real time\n", blocks ? st.audioNs / blocks : 0.0,
+           st.totalNs > 0.0 ? seconds * 1e9 / st.totalNs : 0.0);
+}
+
+static uint8_t *ReadFile(const char *path, size_t &size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/* Generated capture, written the way SensorCapture merges its two rings */
+struct Generator
+{
+    CaptureRecord *audio, *main;
+    size_t numAudio, numMain;
+
+    void Audio(uint32_t t, CaptureType type, uint8_t index, uint16_t value)
+    {
+        audio[numAudio++] = {t, uint8_t(type), index, value};
+    }
+    void Main(uint32_t t, CaptureType type, uint8_t index, uint16_t value)
+    {
+        main[numMain++] = {t, uint8_t(type), index, value};
+    }
+
+    size_t Write(uint8_t *out)
+    {
+        CaptureHeader h;
+        memcpy(h.magic, "ABCR", 4);
+        h.version = CAPTURE_VERSION;
+        h.recordSize = sizeof(CaptureRecord);
+        h.sampleRate = REPLAY_SAMPLE_RATE;
+        h.blockSize = 4;
+        h.reserved = 0;
+        memcpy(out, &h, sizeof(h));
+        size_t n = sizeof(h), a = 0, m = 0;
+        while (a < numAudio || m < numMain)
+        {
+            bool fromAudio = m >= numMain || (a < numAudio && int32_t(audio[a].timeUs - main[m].timeUs) <= 0);
+            memcpy(out + n, fromAudio ? &audio[a++] : &main[m++], sizeof(CaptureRecord));
+            n += sizeof(CaptureRecord);
+        }
+        return n;
+    }
+};
+
+#define TEST_START_US 5000000
+#define TEST_SECONDS 2
+/* Rod 0 at 10 revolutions a second */
+#define TEST_EDGE_US 33333
+#define TEST_NOTE_ON_US 200000
+#define TEST_NOTE_OFF_US 1500000
+#define TEST_GAIN_RAW 0x4000
+
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/*
+  Two seconds of a rod spinning, an encoder turned, a button tapped, a
+  hand held over a sensor, the pots and one MIDI note, then checks that
+  each reached the firmware.
+*/
+static int SelfTest()
+{
+    size_t blocks = TEST_SECONDS * REPLAY_SAMPLE_RATE / 4;
+    Generator g;
+    g.audio = (CaptureRecord *)malloc(blocks * 4 * sizeof(CaptureRecord));
+    g.main = (CaptureRecord *)malloc(blocks * 4 * sizeof(CaptureRecord));
+    g.numAudio = g.numMain = 0;
+
+    uint32_t nextEdge = TEST_START_US + 100000;
+    uint32_t prevUs = TEST_START_US;
+    for (size_t b = 0; b < blocks; b++)
+    {
+        uint32_t t = TEST_START_US + uint32_t((b + 1) * 4 * 1000000ull / REPLAY_SAMPLE_RATE);
+        g.Audio(t, CAPTURE_BLOCK, 0, 4);
+        /* Three steps one way, each 100 ms apart */
+        for (uint32_t s = 500000; s <= 700000; s += 100000)
+        {
+            if (prevUs < TEST_START_US + s && t >= TEST_START_US + s)
+                g.Audio(t, CAPTURE_ENCODER, 1, uint16_t(-1));
+        }
+        /* A short press on rod 2 */
+        if (prevUs < TEST_START_US + 300000 && t >= TEST_START_US + 300000)
+            g.Audio(t, CAPTURE_BUTTON, 2, 1);
+        if (prevUs < TEST_START_US + 400000 && t >= TEST_START_US + 400000)
+            g.Audio(t, CAPTURE_BUTTON, 2, 0);
+        for (; nextEdge <= t; nextEdge += TEST_EDGE_US)
+            g.Audio(nextEdge, CAPTURE_BREAKBEAM, 0, 0);
+        prevUs = t;
+    }
+
+    uint8_t noteOn[] = {0x90, 60, 100};
+    uint8_t noteOff[] = {0x80, 60, 0};
+    for (uint32_t t = 0; t < TEST_SECONDS * 1000000u; t += 1000)
+    {
+        uint32_t now = TEST_START_US + t + 500;
+        if (t == TEST_NOTE_ON_US || t == TEST_NOTE_OFF_US)
+        {
+            for (size_t i = 0; i < 3; i++)
+                g.Main(now - 100, CAPTURE_MIDI, 0, t == TEST_NOTE_ON_US ? noteOn[i] : noteOff[i]);
+        }
+        /* 60 mm over sensor 0 at 50 Hz, read a little before the pass */
+        if (t % 20000 == 0)
+            g.Main(now - 300, CAPTURE_RANGE, 0, 60);
+        for (uint8_t pot = 0; pot < NUM_POTS; pot++)
+            g.Main(now, CAPTURE_POT, pot, pot == POT_GAIN ? TEST_GAIN_RAW : 0x8000);
+    }
+
+    uint8_t *capture = (uint8_t *)malloc(sizeof(CaptureHeader) + (g.numAudio + g.numMain) * sizeof(CaptureRecord));
+    size_t size = g.Write(capture);
+    free(g.audio);
+    free(g.main);
+
+    ReplayStats st;
+    Check(Replay(capture, size, st, NULL), "generated capture replays");
+    PrintSummary(st);
+
+    Check(st.frames == blocks * 4, "every block ran");
+    Check(st.records[CAPTURE_BREAKBEAM] > 0 && st.orphans == 0 && st.unknown == 0, "every record had a place");
+    Check(fabsf(rodSensors[0].GetRotationSpeed() - 10.f) < 0.1f, "rod 0 measured at 10 rev/s");
+    Check(rotationTrackers[0].IsRunning(), "rod 0 angle tracked");
+    Check(rodSensors[1].GetEncoderVal() == 5, "rod 1 harmonic moved three steps");
+    Check(rodSensors[2].GetWaveformIndex() == 1, "rod 2 waveform stepped by the tap");
+    Check(distanceSensorManager.GetRange(0) == 60, "sensor 0 has the recorded range");
+    Check(distanceSensorManager.GetHealth(0) == SENSOR_DEAD, "the bus itself was never answered");
+    Check(fabsf(gain - (1.f - TEST_GAIN_RAW / 65536.f)) < 0.01f, "gain pot applied");
+    Check(st.peak > 0.01f, "the note was heard");
+
+    free(capture);
+    printf("capture_replay: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1)
+        return SelfTest();
+    if (argc > 3)
+    {
+        fprintf(stderr, "usage: capture_replay [in.abcr [out.wav]]\n");
+        return 2;
+    }
+
+    size_t size;
+    uint8_t *data = ReadFile(argv[1], size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "%s: can't read\n", argv[1]);
+        return 1;
+    }
+    FILE *wav = NULL;
+    if (argc == 3)
+    {
+        wav = fopen(argv[2], "wb");
+        if (wav == NULL)
+        {
+            fprintf(stderr, "%s: can't write\n", argv[2]);
+            return 1;
+        }
+        WriteWavHeader(wav, 0);
+    }
+
+    ReplayStats st;
+    bool ok = Replay(data, size, st, wav);
+    free(data);
+    if (wav != NULL)
+    {
+        fseek(wav, 0, SEEK_SET);
+        WriteWavHeader(wav, st.frames);
+        ok &= fclose(wav) == 0;
+    }
+    if (!ok)
+        return 1;
+    PrintSummary(st);
+    return 0;
+}
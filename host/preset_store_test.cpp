@@ -0,0 +1,218 @@
+/*
+  PresetStore on the NOR flash model, backed by an image file next to
+  this binary. Every reboot opens the image again and scans it from
+  scratch, as the firmware does at power on.
+
+  Save and recall, across a reboot. Enough saves to wrap the log twice,
+  so every frame is erased over old records. A save cut by a power loss
+  after every one of its erases and page programs, including the torn
+  one it dies in: the slot must come back as the previous record or the
+  new one, never anything else. Then a stuck QUADSPI abort and an erase
+  that never finishes, which must fail the save rather than hang.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daisy_seed.h"
+
+using namespace daisy;
+
+#include "../PresetStore.h"
+
+#define PAYLOAD_SIZE 5000
+#define PAYLOAD_VERSION 7
+/* A little over a second of 1 ms passes covers the erase timeout */
+#define MAX_PASSES 2000
+/* What libDaisy leaves in the registers for memory mapped reads */
+#define MAPPED_CCR 0x0F2C3D0Bu
+#define MAPPED_ABR 0x000000A5u
+
+static char imagePath[512];
+static QSPIHandle qspi;
+static PresetStore store;
+static uint8_t payload[PAYLOAD_SIZE];
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void Fill(uint8_t *buf, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++)
+    {
+        x = x * 1103515245u + 12345u;
+        buf[i] = x >> 16;
+    }
+}
+
+static bool Holds(size_t slot, uint32_t seed)
+{
+    uint8_t expected[PAYLOAD_SIZE];
+    Fill(expected, seed);
+    memset(payload, 0, sizeof(payload));
+    return store.Load(slot) && memcmp(payload, expected, sizeof(payload)) == 0;
+}
+
+static void Reboot()
+{
+    HostFlashOpen(imagePath);
+    hostQuadspi.CCR.value = MAPPED_CCR;
+    hostQuadspi.ABR.value = MAPPED_ABR;
+    store.Init(&qspi, payload, sizeof(payload), PAYLOAD_VERSION);
+}
+
+/* Main loop passes, 1 ms apart, until the save is done or the power goes */
+static void RunSave()
+{
+    for (int i = 0; i < MAX_PASSES && store.IsBusy() && hostFlashOpsLeft != 0; i++)
+    {
+        store.Process();
+        hostUs += 1000;
+    }
+}
+
+static bool Save(size_t slot, uint32_t seed)
+{
+    Fill(payload, seed);
+    if (!store.BeginSave(slot))
+        return false;
+    RunSave();
+    return !store.IsBusy();
+}
+
+static bool MappedAgain()
+{
+    return hostQuadspi.CCR.value == MAPPED_CCR && hostQuadspi.ABR.value == MAPPED_ABR;
+}
+
+static void TestSaveRecall()
+{
+    Reboot();
+    uint32_t erases = hostQspiErases;
+    uint32_t reads = hostQspiStatusReads;
+    Check(Save(3, 1), "save finishes");
+    Check(hostQspiErases - erases == 2, "a two sector frame is erased sector by sector");
+    Check(hostQspiStatusReads - reads >= 2 * hostQspiErasePolls, "erases are polled until WIP clears");
+    Check(MappedAgain(), "memory mapped setup put back after erasing");
+    Check(Holds(3, 1), "saved preset recalls");
+
+    Reboot();
+    Check(Holds(3, 1), "saved preset recalls after a reboot");
+    Check(!store.HasPreset(4), "empty slot stays empty");
+}
+
+static void TestWrap()
+{
+    Reboot();
+    /* 128 frames of two sectors, so this goes round twice */
+    bool saved = true;
+    for (uint32_t n = 0; n < 300; n++)
+        saved &= Save(n % 8, 100 + n);
+    Check(saved, "every save in the wrap finishes");
+
+    Reboot();
+    bool latest = true;
+    for (uint32_t s = 0; s < 8; s++)
+        latest &= Holds(s, 100 + (s < 4 ? 296 + s : 288 + s));
+    Check(latest, "latest record of every slot survives two wraps");
+    Check(store.GetErrors() == 0, "no errors");
+}
+
+static void TestPowerCut()
+{
+    Reboot();
+    Check(Save(5, 50), "bystander slot saved");
+    Check(Save(3, 60), "first record saved");
+    uint32_t current = 60;
+
+    /* 2 erases, 20 pages and the header; one past that completes cleanly */
+    bool always = true;
+    bool bystander = true;
+    int committedAt = -1;
+    for (int k = 0; k <= 24; k++)
+    {
+        uint32_t seed = 1000 + k;
+        hostFlashOpsLeft = k;
+        Fill(payload, seed);
+        store.BeginSave(3);
+        RunSave();
+        bool committed = !store.IsBusy() && hostFlashOpsLeft != 0;
+
+        /* Power back on, the chip finishes or forgets what it was doing */
+        hostQspiBusyPolls = 0;
+        hostQspiWriteEnabled = false;
+        Reboot();
+        if (committed)
+        {
+            current = seed;
+            if (committedAt < 0)
+                committedAt = k;
+        }
+        always &= Holds(3, current);
+        bystander &= Holds(5, 50);
+    }
+    Check(always, "a cut save leaves the previous record, a finished one the new");
+    Check(committedAt == 24, "only a save with every operation whole commits");
+    Check(bystander, "other slots survive every cut");
+}
+
+static void TestStuckAbort()
+{
+    Reboot();
+    uint32_t errors = store.GetErrors();
+    hostQspiAbortStuck = true;
+    Fill(payload, 70);
+    store.BeginSave(2);
+    RunSave();
+    hostQspiAbortStuck = false;
+    hostQuadspi.CR.value = 0;
+    Check(!store.IsBusy(), "stuck abort doesn't hang the save");
+    Check(store.GetErrors() == errors + 1, "stuck abort is an error");
+    Check(MappedAgain(), "memory mapped setup put back after a stuck abort");
+    Check(Save(2, 71) && Holds(2, 71), "saves work once the abort clears");
+}
+
+static void TestEraseTimeout()
+{
+    Reboot();
+    uint32_t errors = store.GetErrors();
+    uint32_t polls = hostQspiErasePolls;
+    hostQspiErasePolls = 1000000;
+    Fill(payload, 80);
+    store.BeginSave(9);
+    RunSave();
+    hostQspiErasePolls = polls;
+    hostQspiBusyPolls = 0;
+    Check(!store.IsBusy(), "erase that never ends times out");
+    Check(store.GetErrors() == errors + 1, "erase timeout is an error");
+    Check(MappedAgain(), "memory mapped setup put back after a timeout");
+    Check(!store.HasPreset(9), "timed out save doesn't commit");
+}
+
+int main(int argc, char **argv)
+{
+    snprintf(imagePath, sizeof(imagePath), "%s.img", argv[0]);
+    remove(imagePath);
+    if (!HostFlashOpen(imagePath))
+    {
+        printf("preset_store_test: can't create %s\n", imagePath);
+        return 1;
+    }
+
+    TestSaveRecall();
+    TestWrap();
+    TestPowerCut();
+    TestStuckAbort();
+    TestEraseTimeout();
+
+    printf("preset_store_test: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
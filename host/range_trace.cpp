@@ -0,0 +1,500 @@
+/*
+  Range traces through VL6180X_Sensor::AddSample, for choosing the One
+  Euro filter settings.
+
+  A trace is a run of range samples with their read times, either
+  generated or taken from the CAPTURE_RANGE records of a sensor capture.
+  Generated traces model the BALANCED profile: a sample every 20 ms with
+  some timing jitter, 1.5 mm of noise, rounded to whole mm, and the odd
+  spike for the median to drop. They come with the hand's true position;
+  a recording is compared with its own centred moving average instead,
+  which has no lag.
+
+  Every trace is run through a grid of SetFilter(minCutoff, beta)
+  settings. The filtered range is sampled every millisecond, the way the
+  audio callback sees it, and scored on
+
+    still rms    mm from the hand while it is held still
+    lag          the delay that best lines the filter up with the hand
+                 while it moves
+
+  The firmware defaults must be the grid setting with the least sweep
+  lag whose still noise is under RANGE_STILL_RMS_MM.
+
+  With the defaults, RangePredictor's output (what GetPredictedRange
+  gives the audio callback) is then set against the filtered range it
+  extrapolates and against the hand one sensor period late, on the sweep
+  and on a hand waved back and forth. It must lag less than the filter
+  and not carry on past the turns:
+
+    overshoot    furthest the output goes past the hand's extremes
+                 within TRACE_TURN_MS either side, on the same trace
+                 without noise so jitter doesn't count
+
+  Last, a sensor that stops mid sweep: the prediction must run on to
+  RANGE_PREDICT_MAX_US past the last sample and hold there.
+
+    range_trace                      generated traces, table and checks
+    range_trace in.abcr [sensor]     the same table for a recording
+    range_trace in.abcr sensor csv   1 ms trace of the defaults as CSV
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daisy_seed.h"
+#include "daisysp.h"
+
+using namespace daisy;
+
+#define DEBUG false
+#define MIN_RANGE 10.f
+#define MAX_RANGE 120.f
+#include "../utils.h"
+#include "../SpscRing.h"
+#include "../SensorCapture.h"
+#include "../vl6180x/VL6180X_Sensor.h"
+#include "../RangePredictor.h"
+
+#define TRACE_MAX_SAMPLES 16384
+#define TRACE_MAX_MS 300000
+/* Left out of the scores while the filter primes */
+#define TRACE_SETTLE_MS 1000
+/* Hand speeds (mm/s) that count as still and as moving */
+#define TRACE_STILL_SPEED 5.f
+#define TRACE_MOVING_SPEED 10.f
+#define TRACE_MAX_LAG_MS 300
+/* Centred average a recording is compared with, in samples */
+#define TRACE_REF_SAMPLES 9
+
+/* Most jitter a still hand may show, half the sensor's 1 mm step */
+#define RANGE_STILL_RMS_MM 0.5f
+/* Past the turn of a wave, the sensor's 1 mm step */
+#define RANGE_MAX_OVERSHOOT_MM 1.f
+/* Past a 250 mm/s sweep stopping dead, which no deceleration announces */
+#define RANGE_MAX_STOP_OVERSHOOT_MM 2.f
+#define TRACE_TURN_MS 250
+
+struct Trace
+{
+    const char *name;
+    size_t numSamples;
+    uint32_t us[TRACE_MAX_SAMPLES];
+    uint8_t mm[TRACE_MAX_SAMPLES];
+    /* The hand every ms from the first sample, and its speed */
+    size_t numMs;
+    float hand[TRACE_MAX_MS];
+    float speed[TRACE_MAX_MS];
+};
+
+struct Setting
+{
+    float minCutoff;
+    float beta;
+};
+
+static const Setting settings[] = {
+    {0.25f, 0.01f}, {0.25f, 0.02f}, {0.25f, 0.03f}, {0.25f, 0.05f}, {0.25f, 0.07f}, {0.25f, 0.1f},
+    {0.5f, 0.01f}, {0.5f, 0.02f}, {0.5f, 0.03f}, {0.5f, 0.05f}, {0.5f, 0.07f}, {0.5f, 0.1f},
+    {1.f, 0.01f}, {1.f, 0.02f}, {1.f, 0.03f}, {1.f, 0.05f}, {1.f, 0.07f}, {1.f, 0.1f},
+    {2.f, 0.01f}, {2.f, 0.02f}, {2.f, 0.03f}, {2.f, 0.05f}, {2.f, 0.07f}, {2.f, 0.1f},
+};
+#define NUM_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+struct Score
+{
+    float stillRms;
+    float lagMs;
+};
+
+static Trace still, sweep, wave, sweepClean, waveClean;
+static Trace recorded;
+static float filtered[TRACE_MAX_MS];
+static float predicted[TRACE_MAX_MS];
+static float delayed[TRACE_MAX_MS];
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* Seeded, so every run scores the same traces */
+static uint32_t rng = 1;
+static float Uniform()
+{
+    rng = rng * 1664525u + 1013904223u;
+    return (rng >> 8) * (1.f / 16777216.f);
+}
+static float Gaussian()
+{
+    float u = Uniform() + 1e-7f;
+    return sqrtf(-2.f * logf(u)) * cosf(2.f * float(M_PI) * Uniform());
+}
+
+static float Still(float t) { return 60.f; }
+
+/* Held, swept out, held, swept back fast, then a slow drift out and back */
+static float Sweep(float t)
+{
+    t = fmodf(t, 8.f);
+    if (t < 1.f)
+        return 30.f;
+    if (t < 1.7f)
+        return 30.f + 100.f * (t - 1.f);
+    if (t < 2.7f)
+        return 100.f;
+    if (t < 2.98f)
+        return 100.f - 250.f * (t - 2.7f);
+    if (t < 4.f)
+        return 30.f;
+    if (t < 5.5f)
+        return 30.f + 20.f * (t - 4.f);
+    if (t < 7.f)
+        return 60.f - 20.f * (t - 5.5f);
+    return 30.f;
+}
+
+/* Waved in and out, from 0.5 Hz up to 2 Hz */
+static float Wave(float t)
+{
+    float hz = 0.5f + 0.0375f * t;
+    return 65.f + 25.f * sinf(2.f * float(M_PI) * hz * t);
+}
+
+/* Without noise only the whole mm rounding is left */
+static void Generate(Trace &tr, const char *name, float (*hand)(float), float seconds, bool noisy = true)
+{
+    tr.name = name;
+    tr.numMs = size_t(seconds * 1000.f);
+    for (size_t i = 0; i < tr.numMs; i++)
+    {
+        tr.hand[i] = hand(i * 1e-3f);
+        tr.speed[i] = (hand((i + 1) * 1e-3f) - hand((i - 1.f) * 1e-3f)) * 500.f;
+    }
+
+    tr.numSamples = 0;
+    float periodMs = vl6180xProfiles[VL6180X_DEFAULT_PROFILE].periodMs;
+    for (float ms = periodMs; ms < tr.numMs - 1 && tr.numSamples < TRACE_MAX_SAMPLES; ms += periodMs)
+    {
+        float t = ms + (Uniform() - 0.5f);
+        float mm = hand(t * 1e-3f);
+        if (noisy)
+            mm += 1.5f * Gaussian() + (Uniform() < 0.01f ? 15.f : 0.f);
+        tr.us[tr.numSamples] = uint32_t(t * 1000.f);
+        tr.mm[tr.numSamples] = uint8_t(constrain(roundf(mm), 0, 255));
+        tr.numSamples++;
+    }
+}
+
+/*
+  AddSample at each read time, then the predictor as FeedSample does. The
+  filter output, and the prediction if asked for, read every ms
+*/
+static void RunFilter(const Trace &tr, const Setting &s, float *out, float *prediction = NULL)
+{
+    VL6180X_Sensor sensor;
+    RangePredictor predictor;
+    sensor.SetFilter(s.minCutoff, s.beta);
+    predictor.Init();
+    size_t next = 0;
+    uint32_t startUs = tr.us[0];
+    for (size_t i = 0; i < tr.numMs; i++)
+    {
+        uint32_t nowUs = startUs + i * 1000;
+        while (next < tr.numSamples && tr.us[next] <= nowUs)
+        {
+            sensor.AddSample(tr.mm[next], tr.us[next]);
+            predictor.Update(sensor.GetFilteredRange(), tr.us[next]);
+            next++;
+        }
+        out[i] = sensor.GetFilteredRange();
+        if (prediction != NULL)
+            prediction[i] = predictor.Predict(nowUs);
+    }
+}
+
+static float StillRms(const Trace &tr, const float *out)
+{
+    double sum = 0.0;
+    size_t n = 0;
+    for (size_t i = TRACE_SETTLE_MS; i < tr.numMs; i++)
+    {
+        if (fabsf(tr.speed[i]) > TRACE_STILL_SPEED)
+            continue;
+        double e = out[i] - tr.hand[i];
+        sum += e * e;
+        n++;
+    }
+    return n ? sqrt(sum / n) : 0.f;
+}
+
+/* Delay (ms) that best lines out up with the hand while it moves */
+static float LagMs(const Trace &tr, const float *out)
+{
+    float best = 0.f;
+    double bestErr = -1.0;
+    for (size_t d = 0; d <= TRACE_MAX_LAG_MS; d++)
+    {
+        double sum = 0.0;
+        size_t n = 0;
+        for (size_t i = TRACE_SETTLE_MS + TRACE_MAX_LAG_MS; i < tr.numMs; i++)
+        {
+            if (fabsf(tr.speed[i - d]) < TRACE_MOVING_SPEED)
+                continue;
+            double e = out[i] - tr.hand[i - d];
+            sum += e * e;
+            n++;
+        }
+        if (n > 0 && (bestErr < 0.0 || sum / n < bestErr))
+        {
+            bestErr = sum / n;
+            best = d;
+        }
+    }
+    return best;
+}
+
+/* Furthest out goes past where the hand turned */
+static float Overshoot(const Trace &tr, const float *out)
+{
+    float worst = 0.f;
+    for (size_t i = TRACE_SETTLE_MS; i + TRACE_TURN_MS < tr.numMs; i++)
+    {
+        float lo = tr.hand[i], hi = tr.hand[i];
+        for (size_t j = i - TRACE_TURN_MS; j <= i + TRACE_TURN_MS; j++)
+        {
+            lo = fminf(lo, tr.hand[j]);
+            hi = fmaxf(hi, tr.hand[j]);
+        }
+        worst = fmaxf(worst, fmaxf(out[i] - hi, lo - out[i]));
+    }
+    return worst;
+}
+
+/* Least lag under the noise bound, then least noise */
+static size_t Choose(const Score *scores)
+{
+    size_t pick = NUM_SETTINGS;
+    for (size_t s = 0; s < NUM_SETTINGS; s++)
+    {
+        if (scores[s].stillRms > RANGE_STILL_RMS_MM)
+            continue;
+        if (pick == NUM_SETTINGS || scores[s].lagMs < scores[pick].lagMs ||
+            (scores[s].lagMs == scores[pick].lagMs && scores[s].stillRms < scores[pick].stillRms))
+            pick = s;
+    }
+    return pick;
+}
+
+static size_t PrintTable(const Trace &stillTrace, const Trace &movingTrace)
+{
+    Score scores[NUM_SETTINGS];
+    printf("min cutoff    beta   still rms   lag (%s)\n", movingTrace.name);
+    for (size_t s = 0; s < NUM_SETTINGS; s++)
+    {
+        RunFilter(stillTrace, settings[s], filtered);
+        scores[s].stillRms = StillRms(stillTrace, filtered);
+        RunFilter(movingTrace, settings[s], filtered);
+        scores[s].lagMs = LagMs(movingTrace, filtered);
+        bool isDefault = settings[s].minCutoff == VL6180X_FILTER_MIN_CUTOFF && settings[s].beta == VL6180X_FILTER_BETA;
+        printf("%7.2f Hz  %6.2f  %7.3f mm  %6.0f ms%s\n", settings[s].minCutoff, settings[s].beta,
+               scores[s].stillRms, scores[s].lagMs, isDefault ? "  default" : "");
+    }
+    size_t pick = Choose(scores);
+    if (pick < NUM_SETTINGS)
+        printf("best under %.2f mm: %.2f Hz, %.2f\n", RANGE_STILL_RMS_MM, settings[pick].minCutoff,
+               settings[pick].beta);
+    return pick;
+}
+
+static uint8_t *ReadFile(const char *path, size_t &size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+  One sensor's samples from a capture. The hand is the centred average of
+  the samples, joined up with straight lines
+*/
+static bool Load(const char *path, int sensor, Trace &tr)
+{
+    size_t size;
+    uint8_t *data = ReadFile(path, size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "range_trace: can't read %s\n", path);
+        return false;
+    }
+    CaptureHeader h;
+    if (size < sizeof(h) || (memcpy(&h, data, sizeof(h)), memcmp(h.magic, "ABCR", 4) != 0) ||
+        h.version != CAPTURE_VERSION || h.recordSize != sizeof(CaptureRecord))
+    {
+        fprintf(stderr, "range_trace: not a version %d capture\n", CAPTURE_VERSION);
+        free(data);
+        return false;
+    }
+
+    const CaptureRecord *records = (const CaptureRecord *)(data + sizeof(h));
+    size_t numRecords = (size - sizeof(h)) / sizeof(CaptureRecord);
+    tr.name = "recorded";
+    tr.numSamples = 0;
+    for (size_t i = 0; i < numRecords && tr.numSamples < TRACE_MAX_SAMPLES; i++)
+    {
+        if (records[i].type != CAPTURE_RANGE || records[i].index != sensor)
+            continue;
+        tr.us[tr.numSamples] = records[i].timeUs;
+        tr.mm[tr.numSamples] = records[i].value & 0xFF;
+        tr.numSamples++;
+    }
+    free(data);
+    if (tr.numSamples < 2 * TRACE_REF_SAMPLES)
+    {
+        fprintf(stderr, "range_trace: too few samples from sensor %d\n", sensor);
+        return false;
+    }
+
+    /* Centred average at each sample, then straight lines between them */
+    static float average[TRACE_MAX_SAMPLES];
+    for (size_t k = 0; k < tr.numSamples; k++)
+    {
+        size_t lo = k >= TRACE_REF_SAMPLES / 2 ? k - TRACE_REF_SAMPLES / 2 : 0;
+        size_t hi = lo + TRACE_REF_SAMPLES <= tr.numSamples ? lo + TRACE_REF_SAMPLES : tr.numSamples;
+        float sum = 0.f;
+        for (size_t j = lo; j < hi; j++)
+            sum += tr.mm[j];
+        average[k] = sum / (hi - lo);
+    }
+
+    uint32_t spanUs = tr.us[tr.numSamples - 1] - tr.us[0];
+    tr.numMs = spanUs / 1000 < TRACE_MAX_MS ? spanUs / 1000 : TRACE_MAX_MS;
+    size_t k = 0;
+    for (size_t i = 0; i < tr.numMs; i++)
+    {
+        uint32_t nowUs = tr.us[0] + i * 1000;
+        while (k + 2 < tr.numSamples && tr.us[k + 1] <= nowUs)
+            k++;
+        float f = float(nowUs - tr.us[k]) / float(tr.us[k + 1] - tr.us[k]);
+        tr.hand[i] = average[k] + f * (average[k + 1] - average[k]);
+    }
+    for (size_t i = 0; i < tr.numMs; i++)
+    {
+        size_t a = i >= 50 ? i - 50 : 0;
+        size_t b = i + 50 < tr.numMs ? i + 50 : tr.numMs - 1;
+        tr.speed[i] = (tr.hand[b] - tr.hand[a]) * 1000.f / float(b > a ? b - a : 1);
+    }
+    return true;
+}
+
+static int Recorded(int argc, char **argv)
+{
+    int sensor = argc > 2 ? atoi(argv[2]) : 0;
+    if (!Load(argv[1], sensor, recorded))
+        return 2;
+
+    if (argc > 3)
+    {
+        Setting defaults = {VL6180X_FILTER_MIN_CUTOFF, VL6180X_FILTER_BETA};
+        RunFilter(recorded, defaults, filtered);
+        printf("ms,hand,filtered\n");
+        for (size_t i = 0; i < recorded.numMs; i++)
+            printf("%u,%.2f,%.2f\n", (unsigned)i, recorded.hand[i], filtered[i]);
+        return 0;
+    }
+
+    printf("%s, sensor %d: %u samples over %.1f s\n", argv[1], sensor, (unsigned)recorded.numSamples,
+           recorded.numMs * 1e-3f);
+    PrintTable(recorded, recorded);
+    return 0;
+}
+
+/*
+  Predictor, filter and the hand a sensor period late, with the defaults.
+  Lag is scored on the noisy trace, overshoot on the clean one so the
+  sensor noise doesn't count as overshoot
+*/
+static void ComparePredictor(const Trace &tr, const Trace &clean, float maxOvershoot)
+{
+    Setting defaults = {VL6180X_FILTER_MIN_CUTOFF, VL6180X_FILTER_BETA};
+    size_t periodMs = vl6180xProfiles[VL6180X_DEFAULT_PROFILE].periodMs;
+    for (size_t i = 0; i < tr.numMs; i++)
+        delayed[i] = tr.hand[i >= periodMs ? i - periodMs : 0];
+
+    RunFilter(tr, defaults, filtered, predicted);
+    float lagFiltered = LagMs(tr, filtered);
+    float lagPredicted = LagMs(tr, predicted);
+    RunFilter(clean, defaults, filtered, predicted);
+    float overFiltered = Overshoot(clean, filtered);
+    float overPredicted = Overshoot(clean, predicted);
+
+    printf("%-6s %9.0f ms %9.0f ms %9.0f ms %8.2f mm %8.2f mm\n", tr.name, lagFiltered, lagPredicted,
+           LagMs(tr, delayed), overFiltered, overPredicted);
+    Check(lagPredicted < lagFiltered, "predictor lags less than the filter");
+    Check(overPredicted <= maxOvershoot, "predictor doesn't overshoot the turns");
+}
+
+/* A sensor that stops answering mid sweep */
+static void TestExtrapolationCap()
+{
+    RangePredictor predictor;
+    predictor.Init();
+    uint32_t us = 0;
+    for (int i = 0; i < 50; i++, us += 20000)
+        predictor.Update(30.f + 0.1f * (us / 1000), us);
+    us -= 20000;
+
+    float capped = predictor.Predict(us + RANGE_PREDICT_MAX_US);
+    float before = predictor.Predict(us + RANGE_PREDICT_MAX_US - 10000);
+    Check(capped > before + 0.5f, "still extrapolating up to the cap");
+    Check(predictor.Predict(us + RANGE_PREDICT_MAX_US + 10000) == capped, "extrapolation stops at the cap");
+    Check(predictor.Predict(us + 1000000) == capped, "a stalled sensor holds where the cap left it");
+    Check(fabsf(capped - (30.f + 0.1f * (us / 1000 + RANGE_PREDICT_MAX_US / 1000))) < 0.5f,
+          "cap lands on the trajectory");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        return Recorded(argc, argv);
+
+    Generate(still, "still", Still, 240.f);
+    Generate(sweep, "sweep", Sweep, 80.f);
+    size_t pick = PrintTable(still, sweep);
+    Check(pick < NUM_SETTINGS, "a setting meets the still noise bound");
+    Check(pick < NUM_SETTINGS && settings[pick].minCutoff == VL6180X_FILTER_MIN_CUTOFF &&
+              settings[pick].beta == VL6180X_FILTER_BETA,
+          "firmware defaults are the best setting");
+
+    Generate(wave, "wave", Wave, 20.f);
+    Generate(sweepClean, "sweep", Sweep, 80.f, false);
+    Generate(waveClean, "wave", Wave, 20.f, false);
+    printf("\ntrace   filter lag  predict lag  period late  filter over  predict over\n");
+    ComparePredictor(sweep, sweepClean, RANGE_MAX_STOP_OVERSHOOT_MM);
+    ComparePredictor(wave, waveClean, RANGE_MAX_OVERSHOOT_MM);
+
+    Setting defaults = {VL6180X_FILTER_MIN_CUTOFF, VL6180X_FILTER_BETA};
+    RunFilter(still, defaults, filtered, predicted);
+    printf("still rms: filter %.3f mm, predictor %.3f mm\n", StillRms(still, filtered), StillRms(still, predicted));
+    TestExtrapolationCap();
+
+    printf("range_trace: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+/*
+  RotationTracker against synthetic breakbeam pulse trains.
+
+  A rod's true angle is integrated from a speed profile in 10 us steps,
+  and an edge is taken each time it crosses a whole pulse. Edge times get
+  uniform jitter and some edges are dropped, then they are fed to the
+  tracker block by block as the audio callback does. After every block
+  the tracker's phase is compared with the true one, while it reports the
+  rod running and once it has seen a few edges since the last start.
+
+    rotation_sim              every scenario, checked against its limits
+    rotation_sim <scenario>   per-block trace as CSV, for plotting
+
+  Errors are in cycles of ROD_LFO_PULSES_PER_CYCLE pulses, wrapped to
+  +-0.5.
+*/
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../RotationTracker.h"
+
+#define SAMPLE_RATE 48000.f
+#define BLOCK_SIZE 4
+#define PULSES_PER_CYCLE 3
+#define STEP_US 10
+/* Edges after a (re)start before the error counts */
+#define SETTLE_EDGES 8
+
+struct Scenario
+{
+    const char *name;
+    float seconds;
+    /* Pulses per second at time t */
+    float (*speed)(float t);
+    uint32_t jitterUs;
+    float dropout;
+    /* Limits, cycles */
+    float maxRms;
+    float maxError;
+};
+
+static float Steady(float t) { return 30.f; }
+static float Ramp(float t) { return 20.f + 20.f * t / 10.f; }
+static float Wobble(float t) { return 30.f + 8.f * sinf(2.f * float(M_PI) * 0.5f * t); }
+static float Slow(float t) { return 4.f; }
+
+/* Spinning, slowing to a stop, still, spun up again */
+static float StopStart(float t)
+{
+    if (t < 3.f)
+        return 30.f;
+    if (t < 4.f)
+        return 30.f * (4.f - t);
+    if (t < 5.f)
+        return 0.f;
+    if (t < 6.f)
+        return 30.f * (t - 5.f);
+    return 30.f;
+}
+
+/*
+  Limits are one and a half to two times what the tracker measures. The
+  wobble and the stop/start spin-up are rate lag. A dropped edge holds the
+  phase at the next edge until the late one arrives, and two in a row hold
+  it two pulses back, which wraps to half a cycle, so only the RMS is
+  checked there.
+*/
+static const Scenario scenarios[] = {
+    {"steady", 10.f, Steady, 300, 0.f, 0.003f, 0.01f},
+    {"ramp", 10.f, Ramp, 300, 0.f, 0.01f, 0.025f},
+    {"wobble", 10.f, Wobble, 300, 0.f, 0.05f, 0.1f},
+    {"jitter", 10.f, Steady, 2000, 0.f, 0.02f, 0.05f},
+    {"dropouts", 10.f, Steady, 300, 0.05f, 0.08f, 0.5f},
+    {"stopstart", 9.f, StopStart, 300, 0.f, 0.1f, 0.4f},
+    {"slow", 10.f, Slow, 300, 0.f, 0.001f, 0.002f},
+};
+
+static uint32_t rngState = 1;
+static float Uniform()
+{
+    rngState = rngState * 1664525u + 1013904223u;
+    return (rngState >> 8) / 16777216.f;
+}
+
+struct Result
+{
+    float rms;
+    float maxError;
+    uint32_t samples;
+    uint32_t edges;
+    uint32_t dropped;
+    bool heldWhileStopped;
+};
+
+static float Wrap(float x)
+{
+    return x - floorf(x + 0.5f);
+}
+
+static Result Run(const Scenario &s, FILE *trace)
+{
+    RotationTracker tracker;
+    tracker.Init(SAMPLE_RATE, PULSES_PER_CYCLE);
+    rngState = 1;
+
+    /* Edge times waiting for the block they fall in, in order */
+    static uint32_t queue[64];
+    size_t queued = 0;
+
+    Result r = {0.f, 0.f, 0, 0, 0, true};
+    double sumSq = 0.0;
+    /* True angle in pulses, starting between two edges */
+    double angle = 0.5;
+    uint32_t nowUs = 0;
+    uint32_t edgesSinceStart = 0;
+    uint64_t block = 0;
+    uint32_t endUs = uint32_t(s.seconds * 1e6f);
+    float heldPhase = -1.f;
+
+    if (trace != NULL)
+        fprintf(trace, "time_s,speed,true_phase,phase,running\n");
+
+    for (uint32_t t = 0; t < endUs; t += STEP_US)
+    {
+        double next = angle + s.speed(t * 1e-6f) * STEP_US * 1e-6;
+        if (floor(next) > floor(angle))
+        {
+            /* Crossing time within the step, then jittered */
+            double frac = (floor(next) - angle) / (next - angle);
+            float jitter = (Uniform() * 2.f - 1.f) * s.jitterUs;
+            uint32_t edgeUs = uint32_t(t + frac * STEP_US + jitter);
+            r.edges++;
+            if (Uniform() < s.dropout)
+                r.dropped++;
+            else if (queued < 64)
+                queue[queued++] = edgeUs;
+        }
+        angle = next;
+
+        /* Audio block boundary */
+        uint32_t blockEnd = uint32_t((block + 1) * BLOCK_SIZE * 1e6 / SAMPLE_RATE);
+        if (t + STEP_US < blockEnd)
+            continue;
+        block++;
+        nowUs = blockEnd;
+
+        bool wasRunning = tracker.IsRunning();
+        size_t used = 0;
+        while (used < queued && int32_t(queue[used] - nowUs) <= 0)
+        {
+            tracker.OnEdge(queue[used++]);
+            edgesSinceStart++;
+        }
+        memmove(queue, queue + used, (queued - used) * sizeof(queue[0]));
+        queued -= used;
+        tracker.Advance(nowUs);
+
+        if (!tracker.IsRunning())
+        {
+            edgesSinceStart = 0;
+            /* A stopped rod's phase only moves on an edge */
+            if (wasRunning || used > 0 || heldPhase < 0.f)
+                heldPhase = tracker.GetPhase();
+            else if (tracker.GetPhase() != heldPhase)
+                r.heldWhileStopped = false;
+        }
+        else
+            heldPhase = -1.f;
+
+        float truePhase = float(fmod(angle, PULSES_PER_CYCLE) / PULSES_PER_CYCLE);
+        float err = Wrap(tracker.GetPhase() - truePhase);
+        if (tracker.IsRunning() && edgesSinceStart >= SETTLE_EDGES)
+        {
+            sumSq += double(err) * err;
+            if (fabsf(err) > r.maxError)
+                r.maxError = fabsf(err);
+            r.samples++;
+        }
+
+        if (trace != NULL)
+            fprintf(trace, "%.6f,%.3f,%.5f,%.5f,%d\n", nowUs * 1e-6f, s.speed(t * 1e-6f), truePhase,
+                    tracker.GetPhase(), tracker.IsRunning());
+    }
+
+    r.rms = r.samples ? float(sqrt(sumSq / r.samples)) : 0.f;
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = sizeof(scenarios) / sizeof(scenarios[0]);
+    if (argc == 2)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (strcmp(argv[1], scenarios[i].name) == 0)
+            {
+                Run(scenarios[i], stdout);
+                return 0;
+            }
+        }
+        fprintf(stderr, "rotation_sim: no scenario %s\n", argv[1]);
+        return 2;
+    }
+
+    int failures = 0;
+    printf("scenario   jitter  dropout  edges  rms (cycles)  max (cycles)\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        const Scenario &s = scenarios[i];
+        Result r = Run(s, NULL);
+        bool ok = r.samples > 0 && r.rms <= s.maxRms && r.maxError <= s.maxError && r.heldWhileStopped;
+        printf("%-9s %5u us  %5.1f%%  %5u  %12.4f  %12.4f  %s\n", s.name, (unsigned)s.jitterUs,
+               s.dropout * 100.f, (unsigned)r.edges, r.rms, r.maxError, ok ? "ok" : "FAIL");
+        if (!ok)
+            failures++;
+    }
+    printf("rotation_sim: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,354 @@
+/*
+  DistanceSensorManager on a simulated mux and four VL6180X sensors, with
+  faults injected on the bus: a sensor unplugged and coming back fresh
+  out of reset, profile changes while it is gone and faster than the
+  queues drain, a wedged bus, a lost completion interrupt, and a sensor
+  that answers setup then holds the bus on its last write.
+
+  Every main loop pass is timed on the simulated clock, transfers costing
+  what they would at 1 MHz and timeouts what the HAL waits. The longest
+  pass must stay under the bound DistanceSensorManager documents.
+*/
+#include <stdio.h>
+
+#include "daisy_seed.h"
+#include "daisysp.h"
+
+using namespace daisy;
+
+#define DEBUG false
+#define MIN_RANGE 10.f
+#define MAX_RANGE 120.f
+#include "../utils.h"
+#include "../SpscRing.h"
+#include "../SensorCapture.h"
+#include "../DistanceSensorManager.h"
+
+#define MAX_STALL_US 4000
+/* HAL timeouts count 1 ms ticks, so a 1 ms timeout waits up to two */
+#define TIMEOUT_US 2000
+/* Rest of the main loop between UpdateRanges calls */
+#define PASS_US 100
+
+/* Nine clocks a byte at 1 MHz, address byte included, plus start and stop */
+static uint32_t TransferUs(uint16_t size)
+{
+    return (size + 1) * 9 + 2;
+}
+
+struct SimSensor
+{
+    bool present;
+    /* Blocking transfers it answers before holding the bus once, -1 never */
+    int hangAfter;
+    uint8_t regs[0x300];
+    uint16_t ptr;
+    bool ranging;
+    uint32_t nextSampleUs;
+    uint32_t blocking;
+    uint32_t averagingWrites;
+
+    void PowerOn()
+    {
+        present = true;
+        hangAfter = -1;
+        memset(regs, 0, sizeof(regs));
+        regs[VL6180X_REG_IDENTIFICATION_MODEL_ID] = 0xB4;
+        regs[VL6180X_REG_SYSTEM_FRESH_OUT_OF_RESET] = 0x01;
+        regs[VL6180X_REG_RESULT_RANGE_STATUS] = 0x01;
+        ptr = 0;
+        ranging = false;
+        blocking = 0;
+        averagingWrites = 0;
+    }
+
+    uint32_t PeriodUs() const { return (regs[SYSRANGE__INTERMEASUREMENT_PERIOD] + 1) * 10000; }
+
+    void Tick()
+    {
+        if (!ranging || int32_t(hostUs - nextSampleUs) < 0)
+            return;
+        regs[VL6180X_REG_RESULT_INTERRUPT_STATUS_GPIO] |= 0x04;
+        regs[VL6180X_REG_RESULT_RANGE_VAL] = 40 + (hostUs / 1000) % 60;
+        nextSampleUs = hostUs + PeriodUs();
+    }
+
+    void Write(uint16_t reg, uint8_t value)
+    {
+        if (reg >= sizeof(regs))
+            return;
+        if (reg == VL6180X_REG_SYSRANGE_START && (value & 0x01))
+        {
+            /* The start bit toggles continuous mode */
+            ranging = !ranging;
+            regs[VL6180X_REG_RESULT_RANGE_STATUS] = ranging ? 0x00 : 0x01;
+            nextSampleUs = hostUs + PeriodUs();
+            return;
+        }
+        if (reg == VL6180X_REG_SYSTEM_INTERRUPT_CLEAR)
+        {
+            regs[VL6180X_REG_RESULT_INTERRUPT_STATUS_GPIO] &= ~0x07;
+            return;
+        }
+        if (reg == VL6180X_REG_READOUT_AVERAGING_SAMPLE_PERIOD)
+            averagingWrites++;
+        regs[reg] = value;
+    }
+};
+
+class SimBus : public I2CHandle::Bus
+{
+public:
+    SimSensor sensors[NUM_SENSORS];
+    uint8_t channels = 0;
+    /* SDA held low, every transfer times out */
+    uint32_t wedgedUntil = 0;
+    /* The next DMA transfer's completion interrupt never comes */
+    bool loseNext = false;
+
+    bool pending = false;
+    uint32_t dueUs;
+    I2CHandle::CallbackFunctionPtr callback;
+    void *context;
+    I2CHandle::Result result;
+
+    /* Called between passes, like the I2C interrupt preempting the loop */
+    void Pump()
+    {
+        while (pending && int32_t(hostUs - dueUs) >= 0)
+        {
+            pending = false;
+            callback(context, result);
+        }
+    }
+
+    I2CHandle::Result Blocking(uint16_t address, uint8_t *data, uint16_t size, bool receive, uint32_t timeoutMs) override
+    {
+        uint32_t cost;
+        SimSensor *s = Selected();
+        if (s != NULL && address == VL6180X_DEFAULT_I2C_ADDR && s->present)
+        {
+            s->blocking++;
+            if (s->hangAfter == 0)
+            {
+                s->hangAfter = -1;
+                hostUs += TIMEOUT_US;
+                return I2CHandle::Result::ERR;
+            }
+            if (s->hangAfter > 0)
+                s->hangAfter--;
+        }
+        I2CHandle::Result r = Transfer(address, data, size, receive, cost);
+        hostUs += cost;
+        return r;
+    }
+
+    I2CHandle::Result Dma(uint16_t address, uint8_t *data, uint16_t size, bool receive, I2CHandle::CallbackFunctionPtr cb, void *ctx) override
+    {
+        if (Wedged())
+            return I2CHandle::Result::ERR;
+        uint32_t cost;
+        result = Transfer(address, data, size, receive, cost);
+        if (loseNext)
+        {
+            loseNext = false;
+            return I2CHandle::Result::OK;
+        }
+        pending = true;
+        dueUs = hostUs + cost;
+        callback = cb;
+        context = ctx;
+        return I2CHandle::Result::OK;
+    }
+
+private:
+    bool Wedged() const { return int32_t(hostUs - wedgedUntil) < 0; }
+
+    SimSensor *Selected()
+    {
+        for (size_t i = 0; i < NUM_SENSORS; i++)
+        {
+            if (channels == (1 << i))
+                return &sensors[i];
+        }
+        return NULL;
+    }
+
+    I2CHandle::Result Transfer(uint16_t address, uint8_t *data, uint16_t size, bool receive, uint32_t &cost)
+    {
+        if (Wedged())
+        {
+            cost = TIMEOUT_US;
+            return I2CHandle::Result::ERR;
+        }
+        if (address == TCAADDR)
+        {
+            if (!receive && size == 1)
+                channels = data[0];
+            cost = TransferUs(size);
+            return I2CHandle::Result::OK;
+        }
+
+        /* Nobody answers the address byte */
+        SimSensor *s = Selected();
+        if (s == NULL || !s->present || address != VL6180X_DEFAULT_I2C_ADDR)
+        {
+            cost = TransferUs(0);
+            return I2CHandle::Result::ERR;
+        }
+
+        s->Tick();
+        cost = TransferUs(size);
+        if (receive)
+        {
+            for (uint16_t i = 0; i < size; i++)
+                data[i] = s->regs[(s->ptr + i) % sizeof(s->regs)];
+            return I2CHandle::Result::OK;
+        }
+        if (size >= 2)
+            s->ptr = data[0] << 8 | data[1];
+        if (size == 3)
+            s->Write(s->ptr, data[2]);
+        return I2CHandle::Result::OK;
+    }
+};
+
+static SimBus bus;
+static DaisySeed hw;
+static DistanceSensorManager sensors;
+static uint32_t maxStallUs = 0;
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void Pass()
+{
+    bus.Pump();
+    uint32_t start = hostUs;
+    sensors.UpdateRanges();
+    uint32_t stall = hostUs - start;
+    if (stall > maxStallUs)
+        maxStallUs = stall;
+    hostUs += PASS_US;
+}
+
+static void RunFor(uint32_t us)
+{
+    uint32_t end = hostUs + us;
+    while (int32_t(hostUs - end) < 0)
+        Pass();
+}
+
+static bool AllHealthy()
+{
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+    {
+        if (sensors.GetHealth(i) != SENSOR_OK)
+            return false;
+    }
+    return true;
+}
+
+static bool HasProfile(size_t idx, int profile)
+{
+    const VL6180XProfileSettings &p = vl6180xProfiles[profile];
+    const uint8_t *regs = bus.sensors[idx].regs;
+    return regs[VL6180X_REG_READOUT_AVERAGING_SAMPLE_PERIOD] == p.averaging &&
+           regs[VL6180X_REG_SYSRANGE_MAX_CONVERGENCE_TIME] == p.convergenceMs &&
+           regs[VL6180X_REG_SYSRANGE_RANGE_CHECK_ENABLES] == p.checkEnables &&
+           regs[SYSRANGE__INTERMEASUREMENT_PERIOD] == VL6180X_Sensor::PeriodReg(p.periodMs);
+}
+
+int main()
+{
+    I2CHandle::bus = &bus;
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+        bus.sensors[i].PowerOn();
+
+    hostUs = 1000;
+    sensors.Init(&hw);
+    RunFor(1500000);
+    Check(AllHealthy(), "all sensors healthy after boot");
+    Check(sensors.GetUpdateRate(0) > 40.f, "samples arrive at the profile's rate");
+    uint32_t bootStall = maxStallUs;
+
+    /*
+      Unplugged, then profile changes as soon as it is marked dead, before
+      the first re-probe has found it missing
+    */
+    bus.sensors[2].present = false;
+    uint32_t end = hostUs + 1000000;
+    while (sensors.GetHealth(2) != SENSOR_DEAD && int32_t(hostUs - end) < 0)
+        Pass();
+    Check(sensors.GetHealth(2) == SENSOR_DEAD, "unplugged sensor is marked dead");
+    for (int i = 0; i < 10; i++)
+    {
+        sensors.SetProfile(i % 2 ? VL6180X_PROFILE_FAST : VL6180X_PROFILE_BALANCED);
+        Pass();
+    }
+    sensors.SetProfile(VL6180X_PROFILE_PRECISE);
+    RunFor(1000000);
+
+    /* Back fresh out of reset: setup, then only the current profile */
+    bus.sensors[2].PowerOn();
+    RunFor(6000000);
+    Check(sensors.GetHealth(2) == SENSOR_OK, "sensor is found again");
+    Check(HasProfile(2, VL6180X_PROFILE_PRECISE), "returning sensor gets the current profile");
+    /* Setup writes it twice, then the queued profile once */
+    Check(bus.sensors[2].averagingWrites == 3, "no stale profile writes for a sensor that was dead");
+    uint32_t setupTransfers = bus.sensors[2].blocking;
+
+    /* More profile changes in one pass than a queue holds */
+    sensors.SetProfile(VL6180X_PROFILE_FAST);
+    sensors.SetProfile(VL6180X_PROFILE_BALANCED);
+    sensors.SetProfile(VL6180X_PROFILE_PRECISE);
+    sensors.SetProfile(VL6180X_PROFILE_FAST);
+    RunFor(200000);
+    bool fast = true;
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+        fast &= HasProfile(i, VL6180X_PROFILE_FAST);
+    Check(fast, "a profile that didn't fit the queue is written later, whole");
+
+    /*
+      SDA held for 700 ms. Mux selects fail, so the sensors go stale
+      rather than failing, then die and are re-probed into the timeout.
+    */
+    bus.wedgedUntil = hostUs + 700000;
+    RunFor(700000);
+    Check(sensors.GetHealth(0) == SENSOR_DEAD, "sensors on a wedged bus are marked dead");
+    RunFor(6000000);
+    Check(AllHealthy(), "sensors come back once the bus lets go");
+
+    /* Lost completion interrupt: the chain times out and the bus is recovered */
+    uint32_t recoveries = sensors.GetRecoveries();
+    bus.loseNext = true;
+    RunFor(100000);
+    Check(sensors.GetRecoveries() == recoveries + 1, "stuck chain recovers the bus");
+    Check(AllHealthy(), "a lost interrupt doesn't take a sensor out");
+
+    /* Worst pass: full setup, then a timeout on the last setup write */
+    bus.sensors[3].present = false;
+    RunFor(1000000);
+    bus.sensors[3].PowerOn();
+    bus.sensors[3].hangAfter = setupTransfers - 1;
+    uint32_t before = maxStallUs;
+    maxStallUs = 0;
+    RunFor(6000000);
+    uint32_t worstStall = maxStallUs;
+    if (before > maxStallUs)
+        maxStallUs = before;
+    Check(worstStall > TIMEOUT_US, "the worst case was reached");
+    Check(sensors.GetHealth(3) == SENSOR_OK, "sensor that hung during setup is found on the next probe");
+    Check(maxStallUs < MAX_STALL_US, "main loop stall stays within the bound");
+
+    printf("sensor_fault_test: longest pass %u us (boot %u us, bound %u us): %s\n",
+           (unsigned)maxStallUs, (unsigned)bootStall, MAX_STALL_US, failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,814 @@
+#pragma once
+/*
+  Host stand-in for the parts of libDaisy the firmware headers use. Time
+  only moves when a host program moves it, so runs are deterministic.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Microseconds since boot, owned by the host program */
+inline uint32_t hostUs = 0;
+
+#define DMA_BUFFER_MEM_SECTION
+
+typedef enum
+{
+    DSY_GPIOA,
+    DSY_GPIOB,
+    DSY_GPIOC,
+    DSY_GPIOD,
+    DSY_GPIOE,
+    DSY_GPIOF,
+    DSY_GPIOG,
+    DSY_GPIOH,
+    DSY_GPIOI,
+    DSY_GPIOJ,
+    DSY_GPIOK,
+    DSY_GPIOX,
+} dsy_gpio_port;
+typedef struct
+{
+    dsy_gpio_port port;
+    uint8_t pin;
+} dsy_gpio_pin;
+typedef enum
+{
+    DSY_GPIO_MODE_INPUT,
+    DSY_GPIO_MODE_OUTPUT_PP,
+    DSY_GPIO_MODE_OUTPUT_OD,
+    DSY_GPIO_MODE_ANALOG,
+} dsy_gpio_mode;
+typedef enum
+{
+    DSY_GPIO_NOPULL,
+    DSY_GPIO_PULLUP,
+    DSY_GPIO_PULLDOWN,
+} dsy_gpio_pull;
+typedef struct
+{
+    dsy_gpio_pin pin;
+    dsy_gpio_mode mode;
+    dsy_gpio_pull pull;
+} dsy_gpio;
+
+/*
+  Pins read high, a released bus or a beam not broken, unless the host
+  program pulls them low
+*/
+inline bool hostGpioLow[DSY_GPIOX][16];
+
+inline void dsy_gpio_init(const dsy_gpio *) {}
+inline void dsy_gpio_deinit(const dsy_gpio *) {}
+inline uint8_t dsy_gpio_read(const dsy_gpio *p) { return !hostGpioLow[p->pin.port][p->pin.pin]; }
+inline void dsy_gpio_write(const dsy_gpio *, uint8_t) {}
+
+/*
+  EXTI setup does nothing. The host program sets a line's bit in
+  hostExtiPending and calls the handler, which clears it like the HAL
+*/
+typedef struct
+{
+    uint32_t MODER;
+} GPIO_TypeDef;
+inline GPIO_TypeDef hostGpioPorts[DSY_GPIOX];
+#define GPIOA (&hostGpioPorts[DSY_GPIOA])
+#define GPIOB (&hostGpioPorts[DSY_GPIOB])
+#define GPIOC (&hostGpioPorts[DSY_GPIOC])
+#define GPIOD (&hostGpioPorts[DSY_GPIOD])
+#define GPIOE (&hostGpioPorts[DSY_GPIOE])
+#define GPIOF (&hostGpioPorts[DSY_GPIOF])
+#define GPIOG (&hostGpioPorts[DSY_GPIOG])
+#define GPIOH (&hostGpioPorts[DSY_GPIOH])
+#define GPIOI (&hostGpioPorts[DSY_GPIOI])
+#define GPIOJ (&hostGpioPorts[DSY_GPIOJ])
+#define GPIOK (&hostGpioPorts[DSY_GPIOK])
+typedef struct
+{
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+#define GPIO_MODE_IT_RISING_FALLING 0x10310000u
+#define GPIO_NOPULL 0
+#define GPIO_PULLUP 1
+#define GPIO_SPEED_FREQ_LOW 0
+inline void HAL_GPIO_Init(GPIO_TypeDef *, GPIO_InitTypeDef *) {}
+typedef enum
+{
+    EXTI0_IRQn = 6,
+    EXTI1_IRQn,
+    EXTI2_IRQn,
+    EXTI3_IRQn,
+    EXTI4_IRQn,
+    EXTI9_5_IRQn = 23,
+    EXTI15_10_IRQn = 40,
+} IRQn_Type;
+inline void HAL_NVIC_SetPriority(IRQn_Type, uint32_t, uint32_t) {}
+inline void HAL_NVIC_EnableIRQ(IRQn_Type) {}
+#define __HAL_RCC_SYSCFG_CLK_ENABLE() \
+    do                                \
+    {                                 \
+    } while (0)
+inline uint32_t hostExtiPending;
+#define __HAL_GPIO_EXTI_GET_IT(mask) (hostExtiPending & (mask))
+#define __HAL_GPIO_EXTI_CLEAR_IT(mask) (hostExtiPending &= ~(mask))
+
+/*
+  The 8MB IS25LP064 behind the QUADSPI, as NOR flash: an erase sets a 4K
+  sector to 0xFF and programming can only clear bits, so a page written
+  without erasing first comes out as the AND of old and new.
+
+  HostFlashOpen() backs it with an image file that every erase and
+  program is written through to, so a power cut can be simulated by
+  stopping and opening the same image again. hostFlashOpsLeft counts
+  down erases and programs until the power goes: the one it runs out on
+  is torn, half done, and the rest are lost.
+*/
+#define HOST_FLASH_SIZE (8 << 20)
+#define HOST_FLASH_SECTOR 4096
+inline uint8_t hostFlash[HOST_FLASH_SIZE];
+inline FILE *hostFlashImage = NULL;
+/* -1 = power stays on */
+inline int32_t hostFlashOpsLeft = -1;
+
+inline void HostFlashPersist(uint32_t address, uint32_t size)
+{
+    if (hostFlashImage == NULL)
+        return;
+    fseek(hostFlashImage, address, SEEK_SET);
+    fwrite(hostFlash + address, 1, size, hostFlashImage);
+    fflush(hostFlashImage);
+}
+
+/* Loads the image at path, or starts an erased one there */
+inline bool HostFlashOpen(const char *path)
+{
+    if (hostFlashImage != NULL)
+        fclose(hostFlashImage);
+    memset(hostFlash, 0xFF, sizeof(hostFlash));
+    hostFlashOpsLeft = -1;
+
+    hostFlashImage = fopen(path, "r+b");
+    if (hostFlashImage != NULL)
+    {
+        size_t n = fread(hostFlash, 1, sizeof(hostFlash), hostFlashImage);
+        return n == sizeof(hostFlash);
+    }
+    hostFlashImage = fopen(path, "w+b");
+    if (hostFlashImage == NULL)
+        return false;
+    HostFlashPersist(0, sizeof(hostFlash));
+    return true;
+}
+
+/* How much of an operation of size bytes gets done before the power goes */
+inline uint32_t HostFlashPowered(uint32_t size)
+{
+    if (hostFlashOpsLeft < 0)
+        return size;
+    if (hostFlashOpsLeft == 0)
+        return 0;
+    return --hostFlashOpsLeft > 0 ? size : size / 2;
+}
+
+inline void HostFlashErase(uint32_t address)
+{
+    address &= ~uint32_t(HOST_FLASH_SECTOR - 1);
+    uint32_t n = HostFlashPowered(HOST_FLASH_SECTOR);
+    memset(hostFlash + address, 0xFF, n);
+    HostFlashPersist(address, n);
+}
+
+inline void HostFlashProgram(uint32_t address, uint32_t size, const uint8_t *data)
+{
+    uint32_t n = HostFlashPowered(size);
+    for (uint32_t i = 0; i < n; i++)
+        hostFlash[address + i] &= data[i];
+    HostFlashPersist(address, n);
+}
+
+/*
+  QUADSPI registers for PresetStore's erase. Writes are seen by the model
+  below: write enable, sector erase on the AR write, status reads that
+  show WIP for hostQspiErasePolls reads before the sector is erased, and
+  the ABORT bit, which clears at once unless hostQspiAbortStuck.
+*/
+struct HostQspiRegister;
+inline void HostQuadspiWrite(HostQspiRegister *reg);
+
+struct HostQspiRegister
+{
+    /* First, so a pointer to the register reads its value */
+    uint32_t value;
+
+    HostQspiRegister &operator=(uint32_t v)
+    {
+        value = v;
+        HostQuadspiWrite(this);
+        return *this;
+    }
+    HostQspiRegister &operator|=(uint32_t v) { return *this = value | v; }
+    operator uint32_t() const { return value; }
+};
+
+typedef struct
+{
+    HostQspiRegister CR, DCR, SR, FCR, DLR, CCR, AR, ABR, DR;
+} QUADSPI_TypeDef;
+inline QUADSPI_TypeDef hostQuadspi;
+#define QUADSPI (&hostQuadspi)
+#define QUADSPI_CR_ABORT (1u << 1)
+#define QUADSPI_SR_TCF (1u << 1)
+#define QUADSPI_FCR_CTEF (1u << 0)
+#define QUADSPI_FCR_CTCF (1u << 1)
+#define QUADSPI_FCR_CSMF (1u << 3)
+#define QUADSPI_FCR_CTOF (1u << 4)
+#define QUADSPI_CCR_IMODE_0 (1u << 8)
+#define QUADSPI_CCR_ADMODE_0 (1u << 10)
+#define QUADSPI_CCR_ADMODE (3u << 10)
+#define QUADSPI_CCR_ADSIZE_1 (1u << 13)
+#define QUADSPI_CCR_DMODE_0 (1u << 24)
+#define QUADSPI_CCR_FMODE_0 (1u << 26)
+
+inline uint32_t hostQspiErasePolls = 3;
+inline bool hostQspiAbortStuck = false;
+/* Erases and status reads seen, for the host program to check */
+inline uint32_t hostQspiErases = 0;
+inline uint32_t hostQspiStatusReads = 0;
+inline bool hostQspiWriteEnabled = false;
+inline uint32_t hostQspiBusyPolls = 0;
+inline uint32_t hostQspiEraseAddress = 0;
+
+inline void HostQuadspiWrite(HostQspiRegister *reg)
+{
+    QUADSPI_TypeDef *q = &hostQuadspi;
+    uint8_t instruction = q->CCR.value & 0xFF;
+
+    if (reg == &q->CR)
+    {
+        if (!hostQspiAbortStuck)
+            q->CR.value &= ~QUADSPI_CR_ABORT;
+    }
+    else if (reg == &q->FCR)
+    {
+        if (q->FCR.value & QUADSPI_FCR_CTCF)
+            q->SR.value &= ~QUADSPI_SR_TCF;
+    }
+    /* Commands with an address go out when AR is written */
+    else if (reg == &q->CCR && !(q->CCR.value & QUADSPI_CCR_ADMODE))
+    {
+        switch (instruction)
+        {
+        case 0x06: // write enable
+            hostQspiWriteEnabled = true;
+            q->SR.value |= QUADSPI_SR_TCF;
+            break;
+        case 0x05: // read status
+            hostQspiStatusReads++;
+            if (hostQspiBusyPolls > 0 && --hostQspiBusyPolls == 0)
+                HostFlashErase(hostQspiEraseAddress);
+            q->DR.value = hostQspiBusyPolls > 0 ? 0x03 : 0x00;
+            q->SR.value |= QUADSPI_SR_TCF;
+            break;
+        default:
+            break;
+        }
+    }
+    else if (reg == &q->AR && instruction == 0x20 && hostQspiWriteEnabled && hostQspiBusyPolls == 0)
+    {
+        hostQspiErases++;
+        hostQspiWriteEnabled = false;
+        hostQspiEraseAddress = q->AR.value;
+        hostQspiBusyPolls = hostQspiErasePolls > 0 ? hostQspiErasePolls : 1;
+        q->SR.value |= QUADSPI_SR_TCF;
+    }
+}
+
+inline void SCB_InvalidateDCache_by_Addr(void *, int32_t) {}
+
+namespace daisy
+{
+struct System
+{
+    static uint32_t GetNow() { return hostUs / 1000; }
+    static uint32_t GetUs() { return hostUs; }
+    static uint32_t GetTick() { return hostUs * 200; }
+    static uint32_t GetTickFreq() { return 200000000; }
+    static void Delay(uint32_t ms) { hostUs += ms * 1000; }
+    static void DelayUs(uint32_t us) { hostUs += us; }
+};
+
+class ScopedIrqBlocker
+{
+public:
+    ScopedIrqBlocker() {}
+    ~ScopedIrqBlocker() {}
+};
+
+/*
+  Transfers go to the program's I2CHandle::Bus when it sets one, which
+  decides what they cost and how they end. Without one every transfer
+  succeeds at once.
+*/
+class I2CHandle
+{
+public:
+    enum class Result
+    {
+        OK,
+        ERR,
+    };
+    typedef void (*CallbackFunctionPtr)(void *context, Result result);
+
+    struct Config
+    {
+        enum class Peripheral
+        {
+            I2C_1,
+            I2C_2,
+            I2C_3,
+            I2C_4,
+        };
+        enum class Speed
+        {
+            I2C_100KHZ,
+            I2C_400KHZ,
+            I2C_1MHZ,
+        };
+        Peripheral periph;
+        struct
+        {
+            dsy_gpio_pin scl;
+            dsy_gpio_pin sda;
+        } pin_config;
+        Speed speed;
+    };
+
+    struct Bus
+    {
+        virtual Result Blocking(uint16_t address, uint8_t *data, uint16_t size, bool receive, uint32_t timeoutMs) = 0;
+        /* Calls callback later, from the program's stand-in for the I2C interrupt */
+        virtual Result Dma(uint16_t address, uint8_t *data, uint16_t size, bool receive, CallbackFunctionPtr callback, void *context) = 0;
+    };
+    static inline Bus *bus = nullptr;
+
+    Result Init(const Config &) { return Result::OK; }
+    Result TransmitBlocking(uint16_t address, uint8_t *data, uint16_t size, uint32_t timeout)
+    {
+        return bus ? bus->Blocking(address, data, size, false, timeout) : Result::OK;
+    }
+    Result ReceiveBlocking(uint16_t address, uint8_t *data, uint16_t size, uint32_t timeout)
+    {
+        return bus ? bus->Blocking(address, data, size, true, timeout) : Result::OK;
+    }
+    Result TransmitDma(uint16_t address, uint8_t *data, uint16_t size, CallbackFunctionPtr callback, void *context)
+    {
+        if (bus)
+            return bus->Dma(address, data, size, false, callback, context);
+        callback(context, Result::OK);
+        return Result::OK;
+    }
+    Result ReceiveDma(uint16_t address, uint8_t *data, uint16_t size, CallbackFunctionPtr callback, void *context)
+    {
+        if (bus)
+            return bus->Dma(address, data, size, true, callback, context);
+        callback(context, Result::OK);
+        return Result::OK;
+    }
+};
+
+/* Host capture output is thrown away */
+class UsbHandle
+{
+public:
+    enum class Result
+    {
+        OK,
+        ERR,
+    };
+    enum UsbPeriph
+    {
+        FS_INTERNAL,
+        FS_EXTERNAL,
+        FS_BOTH,
+    };
+    void Init(UsbPeriph) {}
+    Result TransmitInternal(uint8_t *, size_t) { return Result::OK; }
+};
+
+/*
+  Received bytes are handed in by the host program through Receive(),
+  which calls the listener as the DMA interrupt would; the UART that last
+  started listening is kept in `listening`. Transmits complete at once
+  and are only counted.
+*/
+class UartHandler
+{
+public:
+    enum class Result
+    {
+        OK,
+        ERR,
+    };
+    struct Config
+    {
+        enum class Peripheral
+        {
+            USART_1,
+            USART_2,
+            USART_3,
+            UART_4,
+            UART_5,
+            USART_6,
+            UART_7,
+            UART_8,
+            LPUART_1,
+        };
+        enum class StopBits
+        {
+            BITS_0_5,
+            BITS_1,
+            BITS_1_5,
+            BITS_2,
+        };
+        enum class Parity
+        {
+            NONE,
+            EVEN,
+            ODD,
+        };
+        enum class Mode
+        {
+            RX,
+            TX,
+            TX_RX,
+        };
+        enum class WordLength
+        {
+            BITS_7,
+            BITS_8,
+            BITS_9,
+        };
+        struct
+        {
+            dsy_gpio_pin tx;
+            dsy_gpio_pin rx;
+        } pin_config;
+        Peripheral periph;
+        StopBits stopbits;
+        Parity parity;
+        Mode mode;
+        WordLength wordlength;
+        uint32_t baudrate;
+    };
+    typedef void (*CircularRxCallbackFunctionPtr)(uint8_t *data, size_t size, void *context, Result res);
+    typedef void (*StartCallbackFunctionPtr)(void *context);
+    typedef void (*EndCallbackFunctionPtr)(void *context, Result res);
+
+    Result Init(const Config &) { return Result::OK; }
+    Result DmaListenStart(uint8_t *, size_t, CircularRxCallbackFunctionPtr callback, void *context)
+    {
+        rxCallback = callback;
+        rxContext = context;
+        listening = this;
+        return Result::OK;
+    }
+    Result DmaTransmit(uint8_t *, size_t size, StartCallbackFunctionPtr start, EndCallbackFunctionPtr end, void *context)
+    {
+        txBytes += size;
+        if (start != NULL)
+            start(context);
+        if (end != NULL)
+            end(context, Result::OK);
+        return Result::OK;
+    }
+
+    void Receive(uint8_t *data, size_t size)
+    {
+        if (rxCallback != NULL)
+            rxCallback(data, size, rxContext, Result::OK);
+    }
+    size_t GetTxBytes() const { return txBytes; }
+
+    static inline UartHandler *listening = NULL;
+
+private:
+    CircularRxCallbackFunctionPtr rxCallback = NULL;
+    void *rxContext = NULL;
+    size_t txBytes = 0;
+};
+
+enum MidiMessageType
+{
+    NoteOff,
+    NoteOn,
+    PolyphonicKeyPressure,
+    ControlChange,
+    ProgramChange,
+    ChannelPressure,
+    PitchBend,
+    SystemCommon,
+    SystemRealTime,
+    ChannelMode,
+    MessageLast,
+};
+enum SystemRealTimeType
+{
+    TimingClock,
+    SRTUndefined0,
+    Start,
+    Continue,
+    Stop,
+    SRTUndefined1,
+    ActiveSensing,
+    Reset,
+    SystemRealTimeLast,
+};
+
+struct NoteOnEvent
+{
+    int channel;
+    uint8_t note;
+    uint8_t velocity;
+};
+struct NoteOffEvent
+{
+    int channel;
+    uint8_t note;
+    uint8_t velocity;
+};
+struct PolyphonicKeyPressureEvent
+{
+    int channel;
+    uint8_t note;
+    uint8_t pressure;
+};
+struct ControlChangeEvent
+{
+    int channel;
+    uint8_t control_number;
+    uint8_t value;
+};
+struct ProgramChangeEvent
+{
+    int channel;
+    uint8_t program;
+};
+struct ChannelPressureEvent
+{
+    int channel;
+    uint8_t pressure;
+};
+struct PitchBendEvent
+{
+    int channel;
+    int16_t value;
+};
+
+struct MidiEvent
+{
+    MidiMessageType type;
+    int channel;
+    uint8_t data[2];
+    SystemRealTimeType srt_type;
+
+    NoteOnEvent AsNoteOn() { return {channel, data[0], data[1]}; }
+    NoteOffEvent AsNoteOff() { return {channel, data[0], data[1]}; }
+    PolyphonicKeyPressureEvent AsPolyphonicKeyPressure() { return {channel, data[0], data[1]}; }
+    ControlChangeEvent AsControlChange() { return {channel, data[0], data[1]}; }
+    ProgramChangeEvent AsProgramChange() { return {channel, data[0]}; }
+    ChannelPressureEvent AsChannelPressure() { return {channel, data[0]}; }
+    PitchBendEvent AsPitchBend() { return {channel, int16_t((data[1] << 7 | data[0]) - 8192)}; }
+};
+
+/*
+  Channel messages with running status, and realtime messages anywhere.
+  System common messages are skipped, MidiUart takes SysEx out before
+  it gets here.
+*/
+class MidiParser
+{
+public:
+    void Init() { Reset(); }
+    void Reset()
+    {
+        status = 0;
+        count = 0;
+    }
+    bool Parse(uint8_t byte, MidiEvent *event_out)
+    {
+        if (byte >= 0xF8)
+        {
+            event_out->type = SystemRealTime;
+            event_out->channel = 0;
+            event_out->srt_type = SystemRealTimeType(byte - 0xF8);
+            return true;
+        }
+        if (byte >= 0xF0)
+        {
+            Reset();
+            return false;
+        }
+        if (byte & 0x80)
+        {
+            status = byte;
+            count = 0;
+            return false;
+        }
+        if (status == 0)
+            return false;
+
+        data[count++] = byte;
+        MidiMessageType type = MidiMessageType((status >> 4) - 8);
+        size_t needed = type == ProgramChange || type == ChannelPressure ? 1 : 2;
+        if (count < needed)
+            return false;
+        count = 0;
+
+        /* CC 120 and up are channel mode messages, as in libDaisy */
+        event_out->type = type == ControlChange && data[0] >= 120 ? ChannelMode : type;
+        event_out->channel = status & 0x0F;
+        event_out->data[0] = data[0];
+        event_out->data[1] = needed == 2 ? data[1] : 0;
+        return true;
+    }
+
+private:
+    uint8_t status;
+    uint8_t data[2];
+    size_t count;
+};
+
+/*
+  Turns and presses come from the host program through Turn() and
+  SetPressed(), and show up at the next Debounce() the way real ones
+  would. An encoder is found again by its A pin.
+*/
+class Encoder
+{
+public:
+    void Init(dsy_gpio_pin a, dsy_gpio_pin, dsy_gpio_pin, float = 0.f)
+    {
+        pinA = a;
+        steps = increment = 0;
+        held = pressed = wasPressed = false;
+        pressedMs = 0;
+        if (numEncoders < sizeof(encoders) / sizeof(encoders[0]))
+            encoders[numEncoders++] = this;
+    }
+    void Debounce()
+    {
+        increment = steps;
+        steps = 0;
+        wasPressed = pressed;
+        pressed = held;
+        if (pressed && !wasPressed)
+            pressedMs = System::GetNow();
+    }
+    int32_t Increment() const { return increment; }
+    bool RisingEdge() const { return pressed && !wasPressed; }
+    bool FallingEdge() const { return !pressed && wasPressed; }
+    bool Pressed() const { return pressed; }
+    float TimeHeldMs() const { return pressed ? float(System::GetNow() - pressedMs) : 0.f; }
+
+    void Turn(int32_t n) { steps += n; }
+    void SetPressed(bool p) { held = p; }
+
+    static Encoder *Find(dsy_gpio_pin a)
+    {
+        for (size_t i = 0; i < numEncoders; i++)
+        {
+            if (encoders[i]->pinA.port == a.port && encoders[i]->pinA.pin == a.pin)
+                return encoders[i];
+        }
+        return NULL;
+    }
+
+private:
+    dsy_gpio_pin pinA;
+    int32_t steps, increment;
+    bool held, pressed, wasPressed;
+    uint32_t pressedMs;
+
+    static inline Encoder *encoders[8];
+    static inline size_t numEncoders = 0;
+};
+
+struct AdcChannelConfig
+{
+    void InitSingle(dsy_gpio_pin) {}
+};
+
+/* Readings are whatever the host program last Set(), 0 until then */
+class AdcHandle
+{
+public:
+    enum OverSampling
+    {
+        OVS_NONE,
+        OVS_4,
+        OVS_8,
+        OVS_16,
+        OVS_32,
+        OVS_64,
+        OVS_128,
+        OVS_256,
+        OVS_512,
+        OVS_1024,
+        OVS_LAST,
+    };
+    void Init(AdcChannelConfig *, size_t, OverSampling = OVS_32) {}
+    void Start() {}
+    uint16_t Get(uint8_t chn) const { return values[chn]; }
+    float GetFloat(uint8_t chn) const { return values[chn] / 65536.f; }
+
+    void Set(uint8_t chn, uint16_t value) { values[chn] = value; }
+
+private:
+    uint16_t values[16] = {};
+};
+
+/* Page programs into the NOR model above, reads straight from it */
+class QSPIHandle
+{
+public:
+    enum Result
+    {
+        OK,
+        ERR,
+    };
+    /* An erased chip, unless an image was opened first */
+    QSPIHandle()
+    {
+        if (hostFlashImage == NULL)
+            memset(hostFlash, 0xFF, sizeof(hostFlash));
+    }
+    Result Write(uint32_t address, uint32_t size, uint8_t *buffer)
+    {
+        if (address + size > HOST_FLASH_SIZE)
+            return ERR;
+        HostFlashProgram(address, size, buffer);
+        return OK;
+    }
+    void *GetData(uint32_t offset = 0) { return hostFlash + offset; }
+};
+
+struct AudioHandle
+{
+    typedef const float *InterleavingInputBuffer;
+    typedef float *InterleavingOutputBuffer;
+    typedef void (*InterleavingAudioCallback)(InterleavingInputBuffer in, InterleavingOutputBuffer out, size_t size);
+};
+
+/*
+  48kHz, with the block size the firmware asks for. StartAudio() only
+  keeps the callback, the host program calls it for every block.
+*/
+class DaisySeed
+{
+public:
+    UsbHandle usb_handle;
+    AdcHandle adc;
+    QSPIHandle qspi;
+    AudioHandle::InterleavingAudioCallback audioCallback = NULL;
+
+    void Init(bool = false) {}
+    void SetAudioBlockSize(size_t size) { blockSize = size; }
+    size_t AudioBlockSize() const { return blockSize; }
+    float AudioSampleRate() const { return 48000.f; }
+    void StartAudio(AudioHandle::InterleavingAudioCallback cb) { audioCallback = cb; }
+    void StartLog(bool = false) {}
+    void SetLed(bool) {}
+
+    /* Daisy Seed pinout, D0-D32 */
+    static dsy_gpio_pin GetPin(uint8_t pin_idx)
+    {
+        static const dsy_gpio_pin pins[] = {
+            {DSY_GPIOB, 12}, {DSY_GPIOC, 11}, {DSY_GPIOC, 10}, {DSY_GPIOC, 9}, {DSY_GPIOC, 8},
+            {DSY_GPIOD, 2}, {DSY_GPIOC, 12}, {DSY_GPIOG, 10}, {DSY_GPIOG, 11}, {DSY_GPIOB, 4},
+            {DSY_GPIOB, 5}, {DSY_GPIOB, 8}, {DSY_GPIOB, 9}, {DSY_GPIOB, 6}, {DSY_GPIOB, 7},
+            {DSY_GPIOC, 0}, {DSY_GPIOA, 3}, {DSY_GPIOB, 1}, {DSY_GPIOA, 7}, {DSY_GPIOA, 6},
+            {DSY_GPIOC, 1}, {DSY_GPIOC, 4}, {DSY_GPIOA, 5}, {DSY_GPIOA, 4}, {DSY_GPIOA, 1},
+            {DSY_GPIOA, 0}, {DSY_GPIOD, 11}, {DSY_GPIOG, 9}, {DSY_GPIOA, 2}, {DSY_GPIOB, 14},
+            {DSY_GPIOB, 15}, {DSY_GPIOC, 2}, {DSY_GPIOC, 3},
+        };
+        return pin_idx < sizeof(pins) / sizeof(pins[0]) ? pins[pin_idx] : dsy_gpio_pin{DSY_GPIOX, 0};
+    }
+
+    template <typename... V>
+    static void PrintLine(const char *, V...) {}
+    template <typename... V>
+    static void Print(const char *, V...) {}
+
+private:
+    size_t blockSize = 48;
+};
+
+namespace seed
+{
+}
+} // namespace daisy
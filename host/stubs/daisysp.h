@@ -0,0 +1,252 @@
+#pragma once
+/*
+  Host stand-in for the DaisySP modules the firmware uses. Shapes are
+  simplified (linear envelope segments, naive waveforms), good enough to
+  exercise the control code around them, not to compare audio with the
+  hardware.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#define PI_F 3.1415927410125732421875f
+#define TWOPI_F (2.0f * PI_F)
+
+namespace daisysp
+{
+inline float fclamp(float in, float min, float max)
+{
+    return fminf(fmaxf(in, min), max);
+}
+
+inline float mtof(float m)
+{
+    return powf(2.f, (m - 69.f) / 12.f) * 440.f;
+}
+
+/* Naive waveforms, the band-limited ones alias */
+class Oscillator
+{
+public:
+    enum
+    {
+        WAVE_SIN,
+        WAVE_TRI,
+        WAVE_SAW,
+        WAVE_RAMP,
+        WAVE_SQUARE,
+        WAVE_POLYBLEP_TRI,
+        WAVE_POLYBLEP_SAW,
+        WAVE_POLYBLEP_SQUARE,
+        WAVE_LAST,
+    };
+    void Init(float sample_rate)
+    {
+        sampleRate = sample_rate;
+        freq = 100.f;
+        amp = 0.5f;
+        phase = 0.f;
+        waveform = WAVE_SIN;
+    }
+    void SetFreq(float f) { freq = f; }
+    void SetAmp(float a) { amp = a; }
+    void SetWaveform(uint8_t wf) { waveform = wf < WAVE_LAST ? wf : WAVE_SIN; }
+    float Process()
+    {
+        float out;
+        switch (waveform)
+        {
+        case WAVE_TRI:
+        case WAVE_POLYBLEP_TRI:
+            out = 1.f - 4.f * fabsf(phase - 0.5f);
+            break;
+        case WAVE_SAW:
+        case WAVE_POLYBLEP_SAW:
+            out = 1.f - 2.f * phase;
+            break;
+        case WAVE_RAMP:
+            out = 2.f * phase - 1.f;
+            break;
+        case WAVE_SQUARE:
+        case WAVE_POLYBLEP_SQUARE:
+            out = phase < 0.5f ? 1.f : -1.f;
+            break;
+        default:
+            out = sinf(TWOPI_F * phase);
+            break;
+        }
+        phase += freq / sampleRate;
+        phase -= floorf(phase);
+        return out * amp;
+    }
+
+private:
+    float sampleRate, freq, amp, phase;
+    uint8_t waveform;
+};
+
+/* Trapezoidal SVF, stable at any setting */
+class Svf
+{
+public:
+    void Init(float sample_rate)
+    {
+        sampleRate = sample_rate;
+        freq = 1000.f;
+        res = 0.f;
+        ic1 = ic2 = 0.f;
+        low = band = high = notch = peak = 0.f;
+    }
+    void SetFreq(float f) { freq = fclamp(f, 1.f, sampleRate * 0.49f); }
+    void SetRes(float r) { res = fclamp(r, 0.f, 0.99f); }
+    void SetDrive(float) {}
+    void Process(float in)
+    {
+        float g = tanf(PI_F * freq / sampleRate);
+        float k = 2.f - 2.f * res;
+        float a1 = 1.f / (1.f + g * (g + k));
+        float a2 = g * a1;
+        float a3 = g * a2;
+        float v3 = in - ic2;
+        float v1 = a1 * ic1 + a2 * v3;
+        float v2 = ic2 + a2 * ic1 + a3 * v3;
+        ic1 = 2.f * v1 - ic1;
+        ic2 = 2.f * v2 - ic2;
+        low = v2;
+        band = v1;
+        high = in - k * v1 - v2;
+        notch = low + high;
+        peak = low - high;
+    }
+    float Low() const { return low; }
+    float High() const { return high; }
+    float Band() const { return band; }
+    float Notch() const { return notch; }
+    float Peak() const { return peak; }
+
+private:
+    float sampleRate, freq, res, ic1, ic2;
+    float low, band, high, notch, peak;
+};
+
+class Line
+{
+public:
+    void Init(float sample_rate)
+    {
+        sampleRate = sample_rate;
+        val = end = inc = 0.f;
+        finished = 1;
+    }
+    void Start(float start, float _end, float dur)
+    {
+        val = start;
+        end = _end;
+        inc = dur > 0.f ? (end - start) / (dur * sampleRate) : end - start;
+        finished = 0;
+    }
+    float Process(uint8_t *_finished)
+    {
+        if (!finished)
+        {
+            val += inc;
+            if ((inc >= 0.f && val >= end) || (inc < 0.f && val <= end))
+            {
+                val = end;
+                finished = 1;
+            }
+        }
+        *_finished = finished;
+        return val;
+    }
+
+private:
+    float sampleRate, val, end, inc;
+    uint8_t finished;
+};
+
+enum
+{
+    ADSR_SEG_IDLE = 0,
+    ADSR_SEG_ATTACK = 1,
+    ADSR_SEG_DECAY = 2,
+    ADSR_SEG_RELEASE = 4,
+};
+
+class Adsr
+{
+public:
+    void Init(float sample_rate, int block_size = 1)
+    {
+        sampleRate = sample_rate / block_size;
+        attack = 0.1f;
+        decay = 0.1f;
+        release = 0.1f;
+        sustain = 0.7f;
+        segment = ADSR_SEG_IDLE;
+        level = 0.f;
+        lastGate = false;
+    }
+    void SetTime(int seg, float t)
+    {
+        if (seg == ADSR_SEG_ATTACK)
+            attack = t;
+        else if (seg == ADSR_SEG_DECAY)
+            decay = t;
+        else if (seg == ADSR_SEG_RELEASE)
+            release = t;
+    }
+    void SetSustainLevel(float s) { sustain = s; }
+    void Retrigger(bool hard)
+    {
+        segment = ADSR_SEG_ATTACK;
+        if (hard)
+            level = 0.f;
+    }
+    float Process(bool gate)
+    {
+        if (gate && !lastGate)
+            segment = ADSR_SEG_ATTACK;
+        else if (!gate && lastGate)
+            segment = ADSR_SEG_RELEASE;
+        lastGate = gate;
+
+        switch (segment)
+        {
+        case ADSR_SEG_ATTACK:
+            level += Step(attack);
+            if (level >= 1.f)
+            {
+                level = 1.f;
+                segment = ADSR_SEG_DECAY;
+            }
+            break;
+        case ADSR_SEG_DECAY:
+            level -= Step(decay) * (1.f - sustain);
+            if (level <= sustain)
+                level = sustain;
+            break;
+        case ADSR_SEG_RELEASE:
+            level -= Step(release);
+            if (level <= 0.f)
+            {
+                level = 0.f;
+                segment = ADSR_SEG_IDLE;
+            }
+            break;
+        default:
+            break;
+        }
+        return level;
+    }
+    uint8_t GetCurrentSegment() { return segment; }
+    bool IsRunning() const { return segment != ADSR_SEG_IDLE; }
+
+private:
+    float sampleRate, attack, decay, release, sustain, level;
+    uint8_t segment;
+    bool lastGate;
+
+    float Step(float seconds) const { return seconds > 0.f ? 1.f / (seconds * sampleRate) : 1.f; }
+};
+} // namespace daisysp
@@ -0,0 +1,285 @@
+/*
+  Round-trips instrument state dumps through Sysex.h, the same encoder
+  and decoder the firmware uses.
+
+    sysex_tool                       self test
+    sysex_tool encode state.bin out.syx
+    sysex_tool decode in.syx state.bin
+    sysex_tool request out.syx       dump request to send to the unit
+
+  Decoding checks the checksum and that the dump is exactly one
+  InstrumentState of this firmware's version.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daisy_seed.h"
+#include "daisysp.h"
+
+using namespace daisy;
+
+#define NUM_RODS 4
+#define NUM_SENSORS 4
+#include "../VoiceManager.h"
+#include "../ModMatrix.h"
+#include "../CcRouting.h"
+#include "../InstrumentState.h"
+#include "../Sysex.h"
+
+static InstrumentState state;
+static InstrumentState decoded;
+
+/*
+  Same framing as MidiUart::PopEvent: F0 begins, F7 ends, any other
+  status byte aborts, and bytes outside a message go to the MidiParser
+*/
+static SysexResult Decode(SysexDecoder &decoder, const uint8_t *bytes, size_t size)
+{
+    SysexResult result = SYSEX_RESULT_NONE;
+    bool inSysex = false;
+    for (size_t i = 0; i < size; i++)
+    {
+        uint8_t b = bytes[i];
+        if (b >= 0xF8)
+            continue;
+        if (b == 0xF0)
+        {
+            decoder.Begin();
+            inSysex = true;
+            continue;
+        }
+        if (!inSysex)
+            continue;
+        if (b == 0xF7)
+        {
+            decoder.End();
+            inSysex = false;
+            SysexResult r = decoder.TakeResult();
+            if (r != SYSEX_RESULT_NONE)
+                result = r;
+        }
+        else if (b < 0x80)
+            decoder.Feed(b);
+        else
+        {
+            decoder.Abort();
+            inSysex = false;
+        }
+    }
+    return result;
+}
+
+/* Whole message, read in chunks the size the firmware uses */
+static size_t Encode(const void *data, size_t size, uint8_t *out)
+{
+    SysexEncoder encoder;
+    encoder.Begin(data, size);
+    size_t n = 0;
+    while (!encoder.IsDone())
+        n += encoder.Read(out + n, 32);
+    return n;
+}
+
+static uint8_t *ReadFile(const char *path, size_t &size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static bool WriteFile(const char *path, const void *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(data, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int SelfTest()
+{
+    static uint8_t message[sizeof(InstrumentState) * 2];
+    SysexDecoder decoder;
+    decoder.Init(&decoded, sizeof(decoded));
+
+    /* Pseudo-random bytes, so every high bit pattern gets packed */
+    uint8_t *raw = (uint8_t *)&state;
+    uint32_t x = 12345;
+    for (size_t i = 0; i < sizeof(state); i++)
+    {
+        x = x * 1103515245u + 12345u;
+        raw[i] = x >> 16;
+    }
+    state.version = INSTRUMENT_STATE_VERSION;
+
+    size_t n = Encode(&state, sizeof(state), message);
+    Check(n == SYSEX_HEADER_SIZE + SysexPackedSize(sizeof(state)) + 2, "message length");
+    bool sevenBit = true;
+    for (size_t i = 1; i + 1 < n; i++)
+        sevenBit &= message[i] < 0x80;
+    Check(sevenBit, "only data bytes between F0 and F7");
+
+    Check(Decode(decoder, message, n) == SYSEX_RESULT_DUMP, "dump decodes");
+    Check(memcmp(&state, &decoded, sizeof(state)) == 0, "dump round-trips exactly");
+
+    /* Realtime bytes may sit anywhere inside a SysEx message */
+    static uint8_t clocked[sizeof(message) * 2];
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        clocked[m++] = message[i];
+        if (i % 5 == 0)
+            clocked[m++] = 0xF8;
+    }
+    memset(&decoded, 0, sizeof(decoded));
+    Check(Decode(decoder, clocked, m) == SYSEX_RESULT_DUMP, "dump with clock bytes decodes");
+    Check(memcmp(&state, &decoded, sizeof(state)) == 0, "dump with clock bytes round-trips");
+
+    /* One flipped data bit fails the checksum */
+    message[n / 2] ^= 0x01;
+    Check(Decode(decoder, message, n) == SYSEX_RESULT_NONE, "corrupt dump is rejected");
+    message[n / 2] ^= 0x01;
+
+    /* A channel message cuts it short */
+    uint8_t saved = message[n / 3];
+    message[n / 3] = 0xB0;
+    Check(Decode(decoder, message, n) == SYSEX_RESULT_NONE, "interrupted dump is rejected");
+    message[n / 3] = saved;
+
+    /* Short by one byte */
+    message[n - 2] = 0xF7;
+    Check(Decode(decoder, message, n - 1) == SYSEX_RESULT_NONE, "truncated dump is rejected");
+
+    /* Someone else's SysEx is ignored */
+    uint8_t other[] = {0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7};
+    Check(Decode(decoder, other, sizeof(other)) == SYSEX_RESULT_NONE, "foreign SysEx is ignored");
+    Check(decoder.GetErrors() == 3, "errors counted for our own bad messages only");
+
+    uint8_t request[] = {0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, SYSEX_CMD_DUMP_REQUEST, 0xF7};
+    Check(Decode(decoder, request, sizeof(request)) == SYSEX_RESULT_REQUEST, "dump request");
+
+    /* Stopping half way through a dump leaves the rest of the buffer alone */
+    n = Encode(&state, sizeof(state), message);
+    memset(&decoded, 0, sizeof(decoded));
+    decoder.Begin();
+    for (size_t i = 1; i + 1 < n; i++)
+    {
+        if (i == n / 2)
+            decoder.SetAccepting(false);
+        decoder.Feed(message[i]);
+    }
+    decoder.End();
+    Check(decoder.TakeResult() == SYSEX_RESULT_NONE, "dump cancelled by SetAccepting(false)");
+    const uint8_t *tail = (const uint8_t *)&decoded + sizeof(decoded) - 16;
+    bool untouched = true;
+    for (size_t i = 0; i < 16; i++)
+        untouched &= tail[i] == 0;
+    Check(untouched, "cancelled dump stops writing");
+    decoder.SetAccepting(true);
+
+    /* A dump and a request finishing before the results are taken */
+    decoder.Begin();
+    for (size_t i = 1; i + 1 < n; i++)
+        decoder.Feed(message[i]);
+    decoder.End();
+    decoder.Begin();
+    for (size_t i = 1; i + 1 < sizeof(request); i++)
+        decoder.Feed(request[i]);
+    decoder.End();
+    Check(decoder.TakeResult() == SYSEX_RESULT_DUMP, "dump kept alongside a request");
+    Check(decoder.TakeResult() == SYSEX_RESULT_REQUEST, "request kept alongside a dump");
+    Check(decoder.TakeResult() == SYSEX_RESULT_NONE, "results taken once");
+
+    /* Sizes that end on and off a 7-byte group */
+    for (size_t size = 1; size <= 30; size++)
+    {
+        uint8_t in[30], out[30] = {0}, msg[64];
+        for (size_t i = 0; i < size; i++)
+            in[i] = uint8_t(i * 37 + 0x80 * (i & 1));
+        SysexDecoder d;
+        d.Init(out, size);
+        size_t len = Encode(in, size, msg);
+        Check(Decode(d, msg, len) == SYSEX_RESULT_DUMP && memcmp(in, out, size) == 0, "odd sizes round-trip");
+    }
+
+    printf("sysex_tool: %zu byte state, %zu byte dump: %s\n", sizeof(state), n, failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1)
+        return SelfTest();
+
+    static uint8_t message[sizeof(InstrumentState) * 2];
+    if (argc == 3 && strcmp(argv[1], "request") == 0)
+    {
+        uint8_t request[] = {0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, SYSEX_CMD_DUMP_REQUEST, 0xF7};
+        return WriteFile(argv[2], request, sizeof(request)) ? 0 : 1;
+    }
+    if (argc == 4 && strcmp(argv[1], "encode") == 0)
+    {
+        size_t size;
+        uint8_t *data = ReadFile(argv[2], size);
+        if (data == NULL || size != sizeof(InstrumentState))
+        {
+            fprintf(stderr, "%s: expected %zu bytes of state\n", argv[2], sizeof(InstrumentState));
+            return 1;
+        }
+        size_t n = Encode(data, size, message);
+        free(data);
+        return WriteFile(argv[3], message, n) ? 0 : 1;
+    }
+    if (argc == 4 && strcmp(argv[1], "decode") == 0)
+    {
+        size_t size;
+        uint8_t *data = ReadFile(argv[2], size);
+        if (data == NULL)
+        {
+            fprintf(stderr, "%s: can't read\n", argv[2]);
+            return 1;
+        }
+        SysexDecoder decoder;
+        decoder.Init(&decoded, sizeof(decoded));
+        SysexResult r = Decode(decoder, data, size);
+        free(data);
+        if (r != SYSEX_RESULT_DUMP)
+        {
+            fprintf(stderr, "%s: no valid dump\n", argv[2]);
+            return 1;
+        }
+        if (decoded.version != INSTRUMENT_STATE_VERSION)
+        {
+            fprintf(stderr, "%s: state version %u, this firmware is %u\n", argv[2],
+                    (unsigned)decoded.version, (unsigned)INSTRUMENT_STATE_VERSION);
+            return 1;
+        }
+        return WriteFile(argv[3], &decoded, sizeof(decoded)) ? 0 : 1;
+    }
+
+    fprintf(stderr, "usage: sysex_tool [encode state.bin out.syx | decode in.syx state.bin | request out.syx]\n");
+    return 2;
+}
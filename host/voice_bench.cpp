@@ -0,0 +1,94 @@
+/*
+  Stress benchmark for the VoiceManager allocator: dense chord bursts on
+  several channels, every chord stealing from the last, at 5, 16 and 32
+  voices and every steal policy. Reports the average cost of a note on
+  (allocate and trigger) and a note off, clock reads included.
+
+    make -C host bench
+*/
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "daisy_seed.h"
+#include "daisysp.h"
+
+using namespace daisy;
+
+#define NUM_RODS 4
+#include "../VoiceManager.h"
+
+#define BURSTS 200000
+#define MAX_CHORD 8
+#define CHANNELS 4
+
+/* Small fixed-seed generator, so every run fires the same bursts */
+static uint32_t rngState = 1;
+static uint32_t Rand()
+{
+    rngState = rngState * 1664525u + 1013904223u;
+    return rngState >> 8;
+}
+
+template <size_t voices>
+static void Run(StealPolicy policy, const char *name)
+{
+    static VoiceManager<voices> vm;
+    vm.Init(48000.f);
+    vm.SetStealPolicy(policy);
+    /* Two of the channels get a smaller pool of their own */
+    vm.SetPoolPolyphony(1, voices / 2);
+    vm.SetPoolPolyphony(3, 2);
+    rngState = 1;
+
+    int chord[CHANNELS][MAX_CHORD];
+    int chordSize[CHANNELS] = {0};
+    uint64_t ons = 0, offs = 0;
+    double onNs = 0.0, offNs = 0.0;
+
+    for (uint32_t b = 0; b < BURSTS; b++)
+    {
+        int channel = Rand() % CHANNELS;
+        int size = 1 + Rand() % MAX_CHORD;
+        int root = 36 + Rand() % 48;
+
+        auto t0 = std::chrono::steady_clock::now();
+        for (int n = 0; n < chordSize[channel]; n++)
+            vm.OnNoteOff(channel, chord[channel][n], 0);
+        auto t1 = std::chrono::steady_clock::now();
+        for (int n = 0; n < size; n++)
+        {
+            int idx = vm.AllocateVoice(channel, root + n * 3);
+            vm.GetVoices()[idx].OnNoteOn(root + n * 3, 100);
+            vm.GetVoices()[idx].TriggerNote();
+            chord[channel][n] = root + n * 3;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+
+        offs += chordSize[channel];
+        ons += size;
+        chordSize[channel] = size;
+        offNs += std::chrono::duration<double, std::nano>(t1 - t0).count();
+        onNs += std::chrono::duration<double, std::nano>(t2 - t1).count();
+    }
+
+    printf("%2zu voices  %-9s  note on %6.1f ns  note off %6.1f ns\n",
+           voices, name, onNs / ons, offNs / offs);
+}
+
+template <size_t voices>
+static void RunAll()
+{
+    Run<voices>(STEAL_OLDEST, "oldest");
+    Run<voices>(STEAL_QUIETEST, "quietest");
+    Run<voices>(STEAL_LOWEST, "lowest");
+    Run<voices>(STEAL_HIGHEST, "highest");
+}
+
+int main()
+{
+    RunAll<5>();
+    RunAll<16>();
+    RunAll<32>();
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+  VoiceManager pool checks.
+
+  Mono channel, non-legato: A on, A off, B on, A on, A off, B off used to
+  leave a voice gated on A. The released voice still mapped to A was
+  handed back on the re-press without the pool limit, so B's voice was
+  never stolen and the pool held two voices.
+
+  A voice still sounding its release tail is only reused once no voice
+  is idle.
+
+  The pots only reach the pools in the panel mask.
+
+  Then random chords on pools of different sizes, checking after every
+  note that no pool has more voices gated than its polyphony.
+*/
+#include <stdio.h>
+
+#include "daisy_seed.h"
+#include "daisysp.h"
+
+using namespace daisy;
+
+#define NUM_RODS 4
+#include "../VoiceManager.h"
+#include "../MonoNotes.h"
+
+#define VOICES 5
+#define NOTE_A 60
+#define NOTE_B 62
+
+static VoiceManager<VOICES> vm;
+static MonoNotes<VOICES> mono;
+static int failures = 0;
+
+static void Check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t Gated(int channel)
+{
+    size_t n = 0;
+    for (size_t v = 0; v < VOICES; v++)
+    {
+        if (vm.GetVoices()[v].IsEnvGate() && vm.GetVoiceChannel(v) == channel)
+            n++;
+    }
+    return n;
+}
+
+static void StartNote(int channel, int note)
+{
+    int v = vm.AllocateVoice(channel, note);
+    vm.GetVoices()[v].OnNoteOn(note, 100);
+    vm.GetVoices()[v].TriggerNote();
+}
+
+/* The firmware's MonoPlay without legato or glide */
+static void MonoPlay(int channel)
+{
+    int target = mono.Stack(channel).Get(vm.GetChannelPool(channel).notePriority);
+    int sounding = mono.GetSounding(channel);
+    if (target == sounding)
+        return;
+    if (target < 0)
+        vm.OnNoteOff(channel, sounding, 0);
+    else
+        StartNote(channel, target);
+    mono.SetSounding(channel, target);
+}
+
+static void MonoOn(int channel, int note)
+{
+    mono.Stack(channel).Push(note);
+    MonoPlay(channel);
+    Check(Gated(channel) <= 1, "mono pool holds one voice");
+}
+
+static void MonoOff(int channel, int note)
+{
+    mono.Stack(channel).Remove(note);
+    MonoPlay(channel);
+    Check(Gated(channel) <= 1, "mono pool holds one voice");
+}
+
+static void TestMonoRepress()
+{
+    vm.Init(48000.f);
+    mono.Init(48000.f, 4);
+    vm.SetPoolPolyphony(0, 1);
+
+    MonoOn(0, NOTE_A);
+    MonoOff(0, NOTE_A);
+    MonoOn(0, NOTE_B);
+    MonoOn(0, NOTE_A);
+    MonoOff(0, NOTE_A);
+    MonoOff(0, NOTE_B);
+    Check(Gated(0) == 0, "no voice gated once every key is up");
+}
+
+static void TestPolyRepress()
+{
+    vm.Init(48000.f);
+    vm.SetPoolPolyphony(0, 2);
+
+    /* A's voice is released but keeps its mapping, then A comes back */
+    StartNote(0, NOTE_A);
+    vm.OnNoteOff(0, NOTE_A, 0);
+    StartNote(0, NOTE_B);
+    StartNote(0, NOTE_B + 2);
+    StartNote(0, NOTE_A);
+    Check(Gated(0) == 2, "re-pressed note steals within its pool");
+}
+
+static void TestReleaseTail()
+{
+    vm.Init(48000.f);
+
+    /* Voice 0 released first, with a long tail, the rest short */
+    for (int n = 0; n < VOICES; n++)
+        StartNote(0, NOTE_A + n);
+    vm.GetVoices()[0].SetRelease(2.f);
+    for (int i = 0; i < 4800; i++)
+        vm.Process();
+    for (int n = 0; n < VOICES; n++)
+        vm.OnNoteOff(0, NOTE_A + n, 0);
+    for (int i = 0; i < 24000; i++)
+        vm.Process();
+    Check(vm.GetVoices()[0].IsActive(), "long release still sounding");
+
+    int v = vm.AllocateVoice(0, NOTE_B + 12);
+    Check(v != 0 && !vm.GetVoices()[0].IsEnvGate() && vm.GetVoices()[0].IsActive(), "idle voice taken before a release tail");
+}
+
+static void TestPanelPools()
+{
+    vm.Init(48000.f);
+    vm.SetPoolADSR(1, 3.f, 2.f, 0.3f, 3.f);
+    vm.SetPanelPools(1u << 0);
+    vm.SetRelease(0.5f);
+    vm.SetAttack(0.1f);
+    Check(vm.GetPool(0).release == 0.5f && vm.GetPool(0).attack == 0.1f, "pots set the panel pool");
+    Check(vm.GetPool(1).release == 3.f && vm.GetPool(1).attack == 3.f, "pots leave other pools alone");
+}
+
+static uint32_t rngState = 7;
+static uint32_t Rand()
+{
+    rngState = rngState * 1664525u + 1013904223u;
+    return rngState >> 8;
+}
+
+static void TestRandomLimits()
+{
+    vm.Init(48000.f);
+    vm.SetPoolPolyphony(1, 1);
+    vm.SetPoolPolyphony(2, 2);
+    vm.SetPoolPolyphony(3, 3);
+
+    for (int i = 0; i < 100000 && !failures; i++)
+    {
+        int channel = Rand() % 4;
+        int note = 60 + Rand() % 6;
+        if (Rand() % 2)
+            StartNote(channel, note);
+        else
+            vm.OnNoteOff(channel, note, 0);
+
+        for (int c = 0; c < 4; c++)
+            Check(Gated(c) <= vm.GetPool(c).polyphony, "random notes stay within the pool limits");
+    }
+}
+
+int main()
+{
+    TestMonoRepress();
+    TestPolyRepress();
+    TestReleaseTail();
+    TestPanelPools();
+    TestRandomLimits();
+    printf("voice_pool_test: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}